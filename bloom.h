@@ -0,0 +1,167 @@
+#ifndef __BLOOM_H__
+#define __BLOOM_H__
+
+/*
+ * Split block Bloom filter.
+ *
+ * A key maps to one 256-bit block and sets one bit in each of its eight
+ * 32-bit words, so a check reads a single half cache line and compiles
+ * down to a handful of AVX2 instructions. Keys are given as 64-bit hashes,
+ * the high half picks the block and the low half the bits.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#define BLOOM_BLOCK_WORDS 8U
+#define BLOOM_BLOCK_BYTES (BLOOM_BLOCK_WORDS * sizeof(uint32_t))
+#define BLOOM_DEFAULT_BITS_PER_KEY 10U
+#define BLOOM_PREFETCH_DISTANCE 8U
+
+typedef struct {
+    uint32_t block_num;
+    uint32_t bits_per_key;
+    uint32_t *words;
+} BloomFilter;
+
+static const uint32_t bloom_salt[BLOOM_BLOCK_WORDS] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U,
+};
+
+/* callers may hand in weak hashes, spread them before use */
+static inline uint64_t
+bloom_mix64(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static inline uint32_t
+bloom_calc_block_num(uint64_t expected, uint32_t bits_per_key) {
+    uint64_t need = (expected * bits_per_key + 255U) / 256U;
+    uint32_t block_num = 1;
+    while(block_num < need && block_num < (1U << 31U))
+        block_num <<= 1U;
+    return block_num;
+}
+
+static inline void
+bloom_reset(BloomFilter *b, uint64_t expected) {
+    uint32_t block_num = bloom_calc_block_num(expected, b->bits_per_key);
+    if(block_num != b->block_num) {
+        free(b->words);
+        b->words = aligned_alloc(BLOOM_BLOCK_BYTES, (size_t)block_num * BLOOM_BLOCK_BYTES);
+        assert(b->words);
+        b->block_num = block_num;
+    }
+    memset(b->words, 0, (size_t)b->block_num * BLOOM_BLOCK_BYTES);
+}
+
+static inline BloomFilter *
+bloom_new(uint64_t expected, uint32_t bits_per_key) {
+    BloomFilter *b = malloc(sizeof(BloomFilter));
+    b->block_num = 0;
+    b->bits_per_key = bits_per_key ? bits_per_key : BLOOM_DEFAULT_BITS_PER_KEY;
+    b->words = NULL;
+    bloom_reset(b, expected);
+    return b;
+}
+
+static inline void
+bloom_free(BloomFilter *b) {
+    if(b) {
+        free(b->words);
+        free(b);
+    }
+}
+
+static inline void
+bloom_clear(BloomFilter *b) {
+    memset(b->words, 0, (size_t)b->block_num * BLOOM_BLOCK_BYTES);
+}
+
+static inline size_t
+bloom_bytes(const BloomFilter *b) {
+    return sizeof(BloomFilter) + (size_t)b->block_num * BLOOM_BLOCK_BYTES;
+}
+
+static inline uint32_t *
+bloom_block(const BloomFilter *b, uint64_t hash) {
+    return b->words + (size_t)((uint32_t)(hash >> 32U) & (b->block_num - 1)) * BLOOM_BLOCK_WORDS;
+}
+
+#if defined(__AVX2__)
+static inline __m256i
+bloom_block_mask(uint32_t key) {
+    __m256i salt = _mm256_loadu_si256((const __m256i *)bloom_salt);
+    __m256i bit = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32((int)key), salt), 27);
+    return _mm256_sllv_epi32(_mm256_set1_epi32(1), bit);
+}
+#endif
+
+static inline void
+bloom_add(BloomFilter *b, uint64_t hash) {
+    hash = bloom_mix64(hash);
+    uint32_t *block = bloom_block(b, hash);
+#if defined(__AVX2__)
+    __m256i words = _mm256_load_si256((const __m256i *)block);
+    _mm256_store_si256((__m256i *)block, _mm256_or_si256(words, bloom_block_mask((uint32_t)hash)));
+#else
+    for(uint32_t i = 0;i < BLOOM_BLOCK_WORDS;i++)
+        block[i] |= 1U << (((uint32_t)hash * bloom_salt[i]) >> 27U);
+#endif
+}
+
+/* false means the key was never added */
+static inline bool
+bloom_check_mixed(const BloomFilter *b, uint64_t hash) {
+    const uint32_t *block = bloom_block(b, hash);
+#if defined(__AVX2__)
+    __m256i words = _mm256_load_si256((const __m256i *)block);
+    return _mm256_testc_si256(words, bloom_block_mask((uint32_t)hash));
+#else
+    for(uint32_t i = 0;i < BLOOM_BLOCK_WORDS;i++) {
+        if(!(block[i] & (1U << (((uint32_t)hash * bloom_salt[i]) >> 27U))))
+            return false;
+    }
+    return true;
+#endif
+}
+
+static inline bool
+bloom_check(const BloomFilter *b, uint64_t hash) {
+    return bloom_check_mixed(b, bloom_mix64(hash));
+}
+
+/* out[i] is set when hashes[i] may be present, blocks are prefetched ahead */
+static inline void
+bloom_check_batch(const BloomFilter *b, const uint64_t *hashes, size_t n, bool *out) {
+    uint64_t mixed[BLOOM_PREFETCH_DISTANCE];
+    size_t pre = n < BLOOM_PREFETCH_DISTANCE ? n : BLOOM_PREFETCH_DISTANCE;
+    for(size_t i = 0;i < pre;i++) {
+        mixed[i] = bloom_mix64(hashes[i]);
+        __builtin_prefetch(bloom_block(b, mixed[i]));
+    }
+    for(size_t i = 0;i < n;i++) {
+        uint64_t hash = mixed[i % BLOOM_PREFETCH_DISTANCE];
+        if(i + BLOOM_PREFETCH_DISTANCE < n) {
+            uint64_t next = bloom_mix64(hashes[i + BLOOM_PREFETCH_DISTANCE]);
+            mixed[i % BLOOM_PREFETCH_DISTANCE] = next;
+            __builtin_prefetch(bloom_block(b, next));
+        }
+        out[i] = bloom_check_mixed(b, hash);
+    }
+}
+
+#endif
@@ -0,0 +1,381 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+
+#include "composite_map.h"
+
+#define COMPOSITE_INIT_SIZE 8
+#define PART_HEADER 4
+#define HASH_SEED 0x9e3779b97f4a7c15ULL
+#define HASH_MUL 0xff51afd7ed558ccdULL
+
+#define copy_composite_val(m, val) \
+    (((m)->type && (m)->type->copy_val) ? ((m)->type->copy_val)((val)) : (val))
+
+#define free_composite_val(m, val) do { \
+    if((m)->type && (m)->type->val_destructor) \
+        (m)->type->val_destructor((val)); \
+} while(0)
+
+static uint64_t _hash_parts(const KeyPart *parts, int n, uint64_t *group_hash);
+static int _slot_index(uint64_t hash, int size);
+static bool _match_prefix(const unsigned char *key, uint32_t key_len, const KeyPart *parts, int n);
+static int _decode_parts(const CompositeEntry *e, KeyPart *parts);
+static CompositeEntry *_find_entry(CompositeMap *m, const KeyPart *parts, int n, uint64_t hash);
+static PrefixGroup *_find_group(CompositeMap *m, const KeyPart *part, uint64_t group_hash);
+static PrefixGroup *_add_group(CompositeMap *m, const KeyPart *part, uint64_t group_hash);
+static void _remove_entry(CompositeMap *m, CompositeEntry *e);
+static void _resize_slots(CompositeMap *m, int new_size);
+static void _resize_groups(CompositeMap *m, int new_size);
+static void _shrink(CompositeMap *m);
+
+CompositeMap *new_composite_map(CompositeType *type) {
+    CompositeMap *m = (CompositeMap *)malloc(sizeof(CompositeMap));
+    m->type = type;
+    m->slots = (CompositeEntry **)calloc(COMPOSITE_INIT_SIZE, sizeof(CompositeEntry *));
+    m->groups = (PrefixGroup **)calloc(COMPOSITE_INIT_SIZE, sizeof(PrefixGroup *));
+    m->count = 0;
+    m->slots_size = COMPOSITE_INIT_SIZE;
+    m->group_count = 0;
+    m->groups_size = COMPOSITE_INIT_SIZE;
+    m->bytes = 0;
+    return m;
+}
+
+void free_composite_map(CompositeMap *m) {
+    for(int i = 0;i < m->slots_size;i++) {
+        CompositeEntry *e = m->slots[i];
+        while(e) {
+            CompositeEntry *tmp = e;
+            e = e->next;
+            free_composite_val(m, tmp->value);
+            free(tmp);
+        }
+    }
+    for(int i = 0;i < m->groups_size;i++) {
+        PrefixGroup *g = m->groups[i];
+        while(g) {
+            PrefixGroup *tmp = g;
+            g = g->next;
+            free(tmp);
+        }
+    }
+    free(m->slots);
+    free(m->groups);
+    free(m);
+}
+
+int add_composite_map(CompositeMap *m, const KeyPart *parts, int n, void *value) {
+    if(n <= 0 || n > COMPOSITE_MAX_PARTS)
+        return FAILED;
+    uint64_t group_hash;
+    uint64_t hash = _hash_parts(parts, n, &group_hash);
+    CompositeEntry *e = _find_entry(m, parts, n, hash);
+    if(e) {
+        free_composite_val(m, e->value);
+        e->value = copy_composite_val(m, value);
+        return REPLACE;
+    }
+    if(m->count >= m->slots_size)
+        _resize_slots(m, m->slots_size * 2);
+    PrefixGroup *g = _find_group(m, &parts[0], group_hash);
+    if(g == NULL)
+        g = _add_group(m, &parts[0], group_hash);
+    size_t key_len = 0;
+    for(int i = 0;i < n;i++) {
+        assert(parts[i].len <= UINT32_MAX);
+        key_len += PART_HEADER + parts[i].len;
+    }
+    e = (CompositeEntry *)malloc(sizeof(CompositeEntry) + key_len);
+    unsigned char *p = e->key;
+    for(int i = 0;i < n;i++) {
+        uint32_t len = (uint32_t)parts[i].len;
+        memcpy(p, &len, PART_HEADER);
+        memcpy(p + PART_HEADER, parts[i].data, len);
+        p += PART_HEADER + len;
+    }
+    e->hash = hash;
+    e->part_num = n;
+    e->key_len = (uint32_t)key_len;
+    e->value = copy_composite_val(m, value);
+    e->group = g;
+    e->group_prev = NULL;
+    e->group_next = g->head;
+    if(g->head)
+        g->head->group_prev = e;
+    g->head = e;
+    g->count++;
+    int h = _slot_index(hash, m->slots_size);
+    e->next = m->slots[h];
+    m->slots[h] = e;
+    m->count++;
+    m->bytes += sizeof(CompositeEntry) + key_len;
+    return ADD;
+}
+
+void *query_composite_map(CompositeMap *m, const KeyPart *parts, int n) {
+    if(n <= 0 || n > COMPOSITE_MAX_PARTS)
+        return NULL;
+    uint64_t group_hash;
+    CompositeEntry *e = _find_entry(m, parts, n, _hash_parts(parts, n, &group_hash));
+    return e ? e->value : NULL;
+}
+
+int remove_composite_map(CompositeMap *m, const KeyPart *parts, int n) {
+    if(n <= 0 || n > COMPOSITE_MAX_PARTS)
+        return FAILED;
+    uint64_t group_hash;
+    CompositeEntry *e = _find_entry(m, parts, n, _hash_parts(parts, n, &group_hash));
+    if(e == NULL)
+        return FAILED;
+    _remove_entry(m, e);
+    _shrink(m);
+    return SUCC;
+}
+
+/*
+ * Visits every entry whose key starts with the n given parts, n == 0 visits
+ * the whole map. Only the group of the first part is walked. The hook must
+ * not change the map.
+ */
+void traverse_composite_map(CompositeMap *m, const KeyPart *parts, int n, composite_hook hook, void *extra) {
+    KeyPart key[COMPOSITE_MAX_PARTS];
+    if(n < 0 || n > COMPOSITE_MAX_PARTS)
+        return;
+    if(n == 0) {
+        for(int i = 0;i < m->slots_size;i++) {
+            for(CompositeEntry *e = m->slots[i];e;e = e->next)
+                hook(key, _decode_parts(e, key), e->value, extra);
+        }
+        return;
+    }
+    uint64_t group_hash;
+    _hash_parts(parts, 1, &group_hash);
+    PrefixGroup *g = _find_group(m, &parts[0], group_hash);
+    if(g == NULL)
+        return;
+    for(CompositeEntry *e = g->head;e;e = e->group_next) {
+        if(n > 1 && (e->part_num < (uint32_t)n || !_match_prefix(e->key, e->key_len, parts, n)))
+            continue;
+        hook(key, _decode_parts(e, key), e->value, extra);
+    }
+}
+
+/* drops every entry under the prefix and returns how many went */
+int remove_composite_prefix(CompositeMap *m, const KeyPart *parts, int n) {
+    if(n <= 0 || n > COMPOSITE_MAX_PARTS)
+        return 0;
+    uint64_t group_hash;
+    _hash_parts(parts, 1, &group_hash);
+    PrefixGroup *g = _find_group(m, &parts[0], group_hash);
+    if(g == NULL)
+        return 0;
+    int removed = 0;
+    CompositeEntry *e = g->head;
+    while(e) {
+        // the group is freed with its last entry, so next is read first
+        CompositeEntry *next = e->group_next;
+        if(n == 1 || (e->part_num >= (uint32_t)n && _match_prefix(e->key, e->key_len, parts, n))) {
+            _remove_entry(m, e);
+            removed++;
+        }
+        e = next;
+    }
+    _shrink(m);
+    return removed;
+}
+
+void get_composite_map_stats(CompositeMap *m, CompositeStats *stats) {
+    stats->count = m->count;
+    stats->slots_size = m->slots_size;
+    stats->group_count = m->group_count;
+    stats->bytes = sizeof(CompositeMap) + m->bytes + (size_t)m->slots_size * sizeof(CompositeEntry *)
+        + (size_t)m->groups_size * sizeof(PrefixGroup *);
+}
+
+/* private function */
+
+static inline uint64_t _hash_word(uint64_t hash, uint64_t word) {
+    hash = (hash ^ word) * HASH_MUL;
+    return hash ^ (hash >> 32);
+}
+
+/*
+ * Chained over the parts eight bytes at a time, each part led by its length
+ * like the encoding, group_hash is the state after the first one.
+ */
+static uint64_t _hash_parts(const KeyPart *parts, int n, uint64_t *group_hash) {
+    uint64_t hash = HASH_SEED;
+    for(int i = 0;i < n;i++) {
+        const unsigned char *p = (const unsigned char *)parts[i].data;
+        size_t len = parts[i].len;
+        hash = _hash_word(hash, len);
+        for(;len >= sizeof(uint64_t);len -= sizeof(uint64_t), p += sizeof(uint64_t)) {
+            uint64_t word;
+            memcpy(&word, p, sizeof(word));
+            hash = _hash_word(hash, word);
+        }
+        if(len) {
+            uint64_t word = 0;
+            memcpy(&word, p, len);
+            hash = _hash_word(hash, word);
+        }
+        if(i == 0)
+            *group_hash = hash;
+    }
+    return hash;
+}
+
+/* the high bits are the better mixed ones, fold them in before masking */
+static int _slot_index(uint64_t hash, int size) {
+    hash ^= hash >> 29;
+    hash *= HASH_SEED;
+    hash ^= hash >> 32;
+    return (int)(hash & (uint64_t)(size - 1));
+}
+
+static bool _match_prefix(const unsigned char *key, uint32_t key_len, const KeyPart *parts, int n) {
+    uint32_t off = 0;
+    for(int i = 0;i < n;i++) {
+        uint32_t len;
+        if(off + PART_HEADER > key_len)
+            return false;
+        memcpy(&len, key + off, PART_HEADER);
+        if(len != parts[i].len || off + PART_HEADER + len > key_len)
+            return false;
+        if(memcmp(key + off + PART_HEADER, parts[i].data, len) != 0)
+            return false;
+        off += PART_HEADER + len;
+    }
+    return true;
+}
+
+static int _decode_parts(const CompositeEntry *e, KeyPart *parts) {
+    uint32_t off = 0;
+    for(uint32_t i = 0;i < e->part_num;i++) {
+        uint32_t len;
+        memcpy(&len, e->key + off, PART_HEADER);
+        parts[i].data = e->key + off + PART_HEADER;
+        parts[i].len = len;
+        off += PART_HEADER + len;
+    }
+    return (int)e->part_num;
+}
+
+static CompositeEntry *_find_entry(CompositeMap *m, const KeyPart *parts, int n, uint64_t hash) {
+    CompositeEntry *e = m->slots[_slot_index(hash, m->slots_size)];
+    while(e) {
+        if(e->hash == hash && e->part_num == (uint32_t)n && _match_prefix(e->key, e->key_len, parts, n))
+            return e;
+        e = e->next;
+    }
+    return NULL;
+}
+
+static PrefixGroup *_find_group(CompositeMap *m, const KeyPart *part, uint64_t group_hash) {
+    PrefixGroup *g = m->groups[_slot_index(group_hash, m->groups_size)];
+    while(g) {
+        if(g->hash == group_hash && _match_prefix(g->key, g->key_len, part, 1))
+            return g;
+        g = g->next;
+    }
+    return NULL;
+}
+
+static PrefixGroup *_add_group(CompositeMap *m, const KeyPart *part, uint64_t group_hash) {
+    if(m->group_count >= m->groups_size)
+        _resize_groups(m, m->groups_size * 2);
+    uint32_t len = (uint32_t)part->len;
+    PrefixGroup *g = (PrefixGroup *)malloc(sizeof(PrefixGroup) + PART_HEADER + len);
+    memcpy(g->key, &len, PART_HEADER);
+    memcpy(g->key + PART_HEADER, part->data, len);
+    g->key_len = PART_HEADER + len;
+    g->hash = group_hash;
+    g->head = NULL;
+    g->count = 0;
+    int h = _slot_index(group_hash, m->groups_size);
+    g->next = m->groups[h];
+    m->groups[h] = g;
+    m->group_count++;
+    m->bytes += sizeof(PrefixGroup) + g->key_len;
+    return g;
+}
+
+/* unlinks e from its chain and its group, dropping the group once empty */
+static void _remove_entry(CompositeMap *m, CompositeEntry *e) {
+    CompositeEntry **pe = &m->slots[_slot_index(e->hash, m->slots_size)];
+    while(*pe != e)
+        pe = &(*pe)->next;
+    *pe = e->next;
+    PrefixGroup *g = e->group;
+    if(e->group_prev)
+        e->group_prev->group_next = e->group_next;
+    else
+        g->head = e->group_next;
+    if(e->group_next)
+        e->group_next->group_prev = e->group_prev;
+    if(--g->count == 0) {
+        PrefixGroup **pg = &m->groups[_slot_index(g->hash, m->groups_size)];
+        while(*pg != g)
+            pg = &(*pg)->next;
+        *pg = g->next;
+        m->group_count--;
+        m->bytes -= sizeof(PrefixGroup) + g->key_len;
+        free(g);
+    }
+    m->count--;
+    m->bytes -= sizeof(CompositeEntry) + e->key_len;
+    free_composite_val(m, e->value);
+    free(e);
+}
+
+static void _resize_slots(CompositeMap *m, int new_size) {
+    CompositeEntry **new_slots = (CompositeEntry **)calloc(new_size, sizeof(CompositeEntry *));
+    for(int i = 0;i < m->slots_size;i++) {
+        CompositeEntry *e = m->slots[i];
+        while(e) {
+            CompositeEntry *next = e->next;
+            int h = _slot_index(e->hash, new_size);
+            e->next = new_slots[h];
+            new_slots[h] = e;
+            e = next;
+        }
+    }
+    free(m->slots);
+    m->slots = new_slots;
+    m->slots_size = new_size;
+}
+
+static void _resize_groups(CompositeMap *m, int new_size) {
+    PrefixGroup **new_groups = (PrefixGroup **)calloc(new_size, sizeof(PrefixGroup *));
+    for(int i = 0;i < m->groups_size;i++) {
+        PrefixGroup *g = m->groups[i];
+        while(g) {
+            PrefixGroup *next = g->next;
+            int h = _slot_index(g->hash, new_size);
+            g->next = new_groups[h];
+            new_groups[h] = g;
+            g = next;
+        }
+    }
+    free(m->groups);
+    m->groups = new_groups;
+    m->groups_size = new_size;
+}
+
+/* after a bulk prefix removal the tables may shrink several times at once */
+static void _shrink(CompositeMap *m) {
+    int new_size = m->slots_size;
+    while(new_size > COMPOSITE_INIT_SIZE && m->count < new_size / 4)
+        new_size /= 2;
+    if(new_size != m->slots_size)
+        _resize_slots(m, new_size);
+    new_size = m->groups_size;
+    while(new_size > COMPOSITE_INIT_SIZE && m->group_count < new_size / 4)
+        new_size /= 2;
+    if(new_size != m->groups_size)
+        _resize_groups(m, new_size);
+}
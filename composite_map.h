@@ -0,0 +1,84 @@
+#ifndef _COMPOSITE_MAP_H
+#define _COMPOSITE_MAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+/*
+ * Flat map keyed by a path of parts, e.g. tenant, user, counter. The whole
+ * path is hashed once into a single table instead of walking a HashMap per
+ * level, and entries sharing their first part are linked into a group so a
+ * prefix can be visited or dropped without scanning the table.
+ */
+
+#define COMPOSITE_MAX_PARTS 16
+
+typedef struct {
+    const void *data;
+    size_t len;
+} KeyPart;
+
+#define KEY_PART_STR(s) ((KeyPart){(s), strlen((s))})
+#define KEY_PART_VAL(p) ((KeyPart){(p), sizeof(*(p))})
+
+typedef struct {
+    void *(*copy_val)(const void *val);
+    void (*val_destructor)(void *val);
+} CompositeType;
+
+struct PrefixGroup;
+
+typedef struct CompositeEntry {
+    struct CompositeEntry *next;        // chain in the flat table
+    struct CompositeEntry *group_prev;  // entries sharing the first part
+    struct CompositeEntry *group_next;
+    struct PrefixGroup *group;
+    void *value;
+    uint64_t hash;
+    uint32_t part_num;
+    uint32_t key_len;
+    unsigned char key[];                // parts encoded as len:4 then the bytes
+} CompositeEntry;
+
+typedef struct PrefixGroup {
+    struct PrefixGroup *next;
+    CompositeEntry *head;
+    uint64_t hash;
+    int count;
+    uint32_t key_len;
+    unsigned char key[];                // encoded first part
+} PrefixGroup;
+
+typedef struct {
+    CompositeType *type;
+    CompositeEntry **slots;
+    PrefixGroup **groups;
+    int count;
+    int slots_size;
+    int group_count;
+    int groups_size;
+    size_t bytes;                       // entries and prefix groups
+} CompositeMap;
+
+typedef struct {
+    int count;
+    int slots_size;
+    int group_count;
+    size_t bytes;
+} CompositeStats;
+
+typedef void(*composite_hook)(const KeyPart *parts, int n, void *value, void *extra);
+
+CompositeMap *new_composite_map(CompositeType *type);
+void free_composite_map(CompositeMap *m);
+int add_composite_map(CompositeMap *m, const KeyPart *parts, int n, void *value);
+void *query_composite_map(CompositeMap *m, const KeyPart *parts, int n);
+int remove_composite_map(CompositeMap *m, const KeyPart *parts, int n);
+void traverse_composite_map(CompositeMap *m, const KeyPart *parts, int n, composite_hook hook, void *extra);
+int remove_composite_prefix(CompositeMap *m, const KeyPart *parts, int n);
+void get_composite_map_stats(CompositeMap *m, CompositeStats *stats);
+
+#endif
@@ -0,0 +1,366 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "extcount.h"
+
+#define EXTCOUNT_DEFAULT_PARTS 64
+#define EXTCOUNT_MAX_PARTS 1024
+#define EXTCOUNT_MAX_BUFFER (1U << 20U)
+#define EXTCOUNT_MIN_BUFFER (1U << 12U)
+#define EXTCOUNT_ARENA_CHUNK (1U << 20U)
+#define EXTCOUNT_MAX_DEPTH 4
+
+/* the key bytes follow the header in the partition file */
+typedef struct {
+    OaHashInt hash;
+    uint32_t len;
+    uint64_t count;
+} ExtCountRecord;
+
+static const char *_arena_copy(ExtCount *ec, const char *key, size_t len);
+static void _arena_reset(ExtCount *ec);
+static bool _spill_table(ExtCount *ec);
+static ExtCountPart *_open_parts(ExtCount *ec);
+static void _close_parts(ExtCount *ec, ExtCountPart *parts);
+static bool _append(ExtCount *ec, ExtCountPart *part, const void *data, size_t len);
+static bool _append_record(ExtCount *ec, ExtCountPart *parts, int depth,
+    OaStrSlice key, uint64_t count, OaHashInt hash);
+static bool _flush(ExtCount *ec, ExtCountPart *part);
+static bool _write_all(int fd, const char *data, size_t len);
+static bool _count_part(ExtCount *ec, ExtCountPart *part, int depth,
+    extcount_hook hook, void *extra);
+static ExtCountPart *_split_part(ExtCount *ec, const char *data, size_t size, int depth);
+static void _emit_table(ExtCount *ec, oa_hash_t(extcount) *h, extcount_hook hook, void *extra);
+static inline int _part_idx(OaHashInt hash, int depth, int part_num);
+
+ExtCount *new_extcount(const char *dir, size_t budget, int part_num) {
+    if(part_num < 1)
+        part_num = EXTCOUNT_DEFAULT_PARTS;
+    if(part_num > EXTCOUNT_MAX_PARTS)
+        part_num = EXTCOUNT_MAX_PARTS;
+    // the write buffers take at most a quarter of the budget
+    while(part_num > 1 && (size_t)part_num * EXTCOUNT_MIN_BUFFER > budget / 4U)
+        part_num >>= 1U;
+    ExtCount *ec = (ExtCount *)calloc(1, sizeof(ExtCount));
+    ec->dir = strdup(dir ? dir : "/tmp");
+    ec->budget = budget;
+    ec->part_num = part_num;
+    ec->buffer_size = budget / 4U / (size_t)part_num;
+    if(ec->buffer_size > EXTCOUNT_MAX_BUFFER)
+        ec->buffer_size = EXTCOUNT_MAX_BUFFER;
+    if(ec->buffer_size < EXTCOUNT_MIN_BUFFER)
+        ec->buffer_size = EXTCOUNT_MIN_BUFFER;
+    size_t buffers = ec->buffer_size * (size_t)part_num;
+    ec->table_budget = budget > buffers ? budget - buffers : 0;
+    // half for the slots, half for the key bytes they point to
+    ec->policy = oa_default_policy;
+    ec->policy.max_bytes = ec->table_budget / 2U;
+    ec->policy.full_action = OA_FULL_FAIL;
+    ec->table = oa_hash_new(extcount);
+    oa_hash_set_policy(extcount, ec->table, &ec->policy);
+    return ec;
+}
+
+void free_extcount(ExtCount *ec) {
+    if(ec->parts)
+        _close_parts(ec, ec->parts);
+    oa_hash_free(extcount, ec->table);
+    _arena_reset(ec);
+    free(ec->arena);
+    free(ec->dir);
+    free(ec);
+}
+
+bool add_extcount(ExtCount *ec, const char *key, size_t len, uint64_t delta) {
+    assert(ec->table && len <= UINT32_MAX);
+    OaStrSlice word = oa_str_slice(key, len);
+    OaHashInt hash = oa_hash_key_hash(extcount, word);
+    ec->records++;
+    OaHashInt idx = oa_hash_get_with_hash(extcount, ec->table, word, hash);
+    if(idx != oa_hash_end(ec->table)) {
+        oa_hash_value(ec->table, idx) += delta;
+        return true;
+    }
+    for(int attempt = 0;attempt < 2;attempt++) {
+        const char *copy = _arena_copy(ec, key, len);
+        if(copy && oa_hash_map_add_with_hash(extcount, ec->table, oa_str_slice(copy, len), delta, hash))
+            return true;
+        if(!_spill_table(ec))
+            return false;
+    }
+    // too long for an empty arena, straight to disk
+    return _append_record(ec, ec->parts, 0, word, delta, hash);
+}
+
+/*
+ * Streams every key with its sum to hook, one partition at a time. The key
+ * is only valid during the call. The counter takes no more adds after it.
+ */
+bool finish_extcount(ExtCount *ec, extcount_hook hook, void *extra) {
+    assert(ec->table);
+    if(!ec->parts) {
+        _emit_table(ec, ec->table, hook, extra);
+    }
+    else if(!_spill_table(ec)) {
+        return false;
+    }
+    oa_hash_free(extcount, ec->table);
+    ec->table = NULL;
+    _arena_reset(ec);
+    if(!ec->parts)
+        return true;
+
+    bool ok = true;
+    for(int i = 0;i < ec->part_num;i++) {
+        ok = ok && _flush(ec, &ec->parts[i]);
+        free(ec->parts[i].buf);
+        ec->parts[i].buf = NULL;
+    }
+    for(int i = 0;ok && i < ec->part_num;i++)
+        ok = _count_part(ec, &ec->parts[i], 0, hook, extra);
+    return ok;
+}
+
+/* private function */
+
+/* NULL once the key bytes would outgrow their half of the budget */
+static const char *_arena_copy(ExtCount *ec, const char *key, size_t len) {
+    if(!ec->arena_num || ec->arena_len + len > ec->arena_cap) {
+        size_t chunk = ec->table_budget / 16U;
+        if(chunk > EXTCOUNT_ARENA_CHUNK)
+            chunk = EXTCOUNT_ARENA_CHUNK;
+        if(chunk < len)
+            chunk = len;
+        if(ec->arena_bytes + chunk > ec->table_budget / 2U)
+            return NULL;
+        ec->arena = (char **)realloc(ec->arena, (ec->arena_num + 1) * sizeof(char *));
+        ec->arena[ec->arena_num++] = (char *)malloc(chunk);
+        ec->arena_bytes += chunk;
+        ec->arena_cap = chunk;
+        ec->arena_len = 0;
+    }
+    char *copy = ec->arena[ec->arena_num - 1] + ec->arena_len;
+    memcpy(copy, key, len);
+    ec->arena_len += len;
+    return copy;
+}
+
+static void _arena_reset(ExtCount *ec) {
+    for(int i = 0;i < ec->arena_num;i++)
+        free(ec->arena[i]);
+    ec->arena_num = 0;
+    ec->arena_len = 0;
+    ec->arena_bytes = 0;
+}
+
+/* the table goes to the partitions of depth 0 and starts over empty */
+static bool _spill_table(ExtCount *ec) {
+    if(!ec->parts && !(ec->parts = _open_parts(ec)))
+        return false;
+    oa_hash_t(extcount) *h = ec->table;
+    bool stored = !oa_is_inline(h);
+    for(OaHashInt i = oa_hash_begin(h);i < oa_hash_end(h);i++) {
+        if(!oa_hash_exist(h, i))
+            continue;
+        OaStrSlice key = oa_hash_key(h, i);
+        OaHashInt hash = stored ? h->ext->hashes[i] : oa_hash_key_hash(extcount, key);
+        if(!_append_record(ec, ec->parts, 0, key, oa_hash_value(h, i), hash))
+            return false;
+    }
+    oa_hash_clear(extcount, h);
+    _arena_reset(ec);
+    ec->spills++;
+    return true;
+}
+
+/* unlinked right away, nothing is left behind if the process dies */
+static ExtCountPart *_open_parts(ExtCount *ec) {
+    size_t path_len = strlen(ec->dir) + sizeof("/extcount.XXXXXX");
+    char *path = (char *)malloc(path_len);
+    ExtCountPart *parts = (ExtCountPart *)calloc(ec->part_num, sizeof(ExtCountPart));
+    for(int i = 0;i < ec->part_num;i++)
+        parts[i].fd = -1;
+    for(int i = 0;i < ec->part_num;i++) {
+        snprintf(path, path_len, "%s/extcount.XXXXXX", ec->dir);
+        parts[i].fd = mkstemp(path);
+        if(parts[i].fd < 0) {
+            free(path);
+            _close_parts(ec, parts);
+            return NULL;
+        }
+        unlink(path);
+        parts[i].buf = (char *)malloc(ec->buffer_size);
+    }
+    free(path);
+    return parts;
+}
+
+static void _close_parts(ExtCount *ec, ExtCountPart *parts) {
+    for(int i = 0;i < ec->part_num;i++) {
+        if(parts[i].fd >= 0)
+            close(parts[i].fd);
+        free(parts[i].buf);
+    }
+    free(parts);
+}
+
+static bool _append(ExtCount *ec, ExtCountPart *part, const void *data, size_t len) {
+    if(part->len + len > ec->buffer_size) {
+        if(!_flush(ec, part))
+            return false;
+        if(len > ec->buffer_size) {
+            if(!_write_all(part->fd, (const char *)data, len))
+                return false;
+            part->bytes += len;
+            ec->bytes_written += len;
+            return true;
+        }
+    }
+    memcpy(part->buf + part->len, data, len);
+    part->len += len;
+    return true;
+}
+
+static bool _append_record(ExtCount *ec, ExtCountPart *parts, int depth,
+        OaStrSlice key, uint64_t count, OaHashInt hash) {
+    ExtCountRecord record = {hash, (uint32_t)key.len, count};
+    ExtCountPart *part = &parts[_part_idx(hash, depth, ec->part_num)];
+    return _append(ec, part, &record, sizeof(record)) && _append(ec, part, key.ptr, key.len);
+}
+
+static bool _flush(ExtCount *ec, ExtCountPart *part) {
+    if(!part->len)
+        return true;
+    if(!_write_all(part->fd, part->buf, part->len))
+        return false;
+    part->bytes += part->len;
+    ec->bytes_written += part->len;
+    part->len = 0;
+    return true;
+}
+
+static bool _write_all(int fd, const char *data, size_t len) {
+    while(len) {
+        ssize_t n = write(fd, data, len);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+/*
+ * The keys of the table borrow from the mapping. A partition whose file
+ * or table does not fit into the budget is split on the next hash bits,
+ * the deepest level is counted whatever it takes.
+ */
+static bool _count_part(ExtCount *ec, ExtCountPart *part, int depth,
+        extcount_hook hook, void *extra) {
+    size_t size = (size_t)part->bytes;
+    void *data = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, part->fd, 0) : NULL;
+    // the mapping keeps the unlinked file alive
+    close(part->fd);
+    part->fd = -1;
+    if(!size)
+        return true;
+    if(data == MAP_FAILED)
+        return false;
+    madvise(data, size, MADV_SEQUENTIAL);
+    if(depth > ec->max_depth)
+        ec->max_depth = depth;
+    // a single partition splits into itself
+    bool bounded = depth < EXTCOUNT_MAX_DEPTH && ec->part_num > 1;
+    bool full = bounded && size > ec->table_budget / 2U;
+    if(!full) {
+        oa_hash_t(extcount) *h = oa_hash_new(extcount);
+        if(bounded)
+            oa_hash_set_policy(extcount, h, &ec->policy);
+        const char *p = (const char *)data;
+        const char *end = p + size;
+        ExtCountRecord record;
+        while(p < end) {
+            memcpy(&record, p, sizeof(record));
+            OaStrSlice key = oa_str_slice(p + sizeof(record), record.len);
+            OaHashInt idx = oa_hash_get_with_hash(extcount, h, key, record.hash);
+            if(idx != oa_hash_end(h))
+                oa_hash_value(h, idx) += record.count;
+            else if(!oa_hash_map_add_with_hash(extcount, h, key, record.count, record.hash))
+                break;
+            p += sizeof(record) + record.len;
+        }
+        full = p < end;
+        if(!full)
+            _emit_table(ec, h, hook, extra);
+        oa_hash_free(extcount, h);
+    }
+    ExtCountPart *parts = full ? _split_part(ec, (const char *)data, size, depth) : NULL;
+    munmap(data, size);
+    if(!full)
+        return true;
+    if(!parts)
+        return false;
+    bool ok = true;
+    for(int i = 0;ok && i < ec->part_num;i++)
+        ok = _count_part(ec, &parts[i], depth + 1, hook, extra);
+    _close_parts(ec, parts);
+    return ok;
+}
+
+/* the records of one file spread over part_num new ones, buffers released */
+static ExtCountPart *_split_part(ExtCount *ec, const char *data, size_t size, int depth) {
+    ExtCountPart *parts = _open_parts(ec);
+    if(!parts)
+        return NULL;
+    const char *p = data;
+    const char *end = data + size;
+    ExtCountRecord record;
+    bool ok = true;
+    while(ok && p < end) {
+        memcpy(&record, p, sizeof(record));
+        OaStrSlice key = oa_str_slice(p + sizeof(record), record.len);
+        ok = _append_record(ec, parts, depth + 1, key, record.count, record.hash);
+        p += sizeof(record) + record.len;
+    }
+    for(int i = 0;i < ec->part_num;i++) {
+        ok = ok && _flush(ec, &parts[i]);
+        free(parts[i].buf);
+        parts[i].buf = NULL;
+    }
+    if(!ok) {
+        _close_parts(ec, parts);
+        return NULL;
+    }
+    return parts;
+}
+
+static void _emit_table(ExtCount *ec, oa_hash_t(extcount) *h, extcount_hook hook, void *extra) {
+    OaStrSlice key;
+    uint64_t count;
+    oa_hash_foreach(h, key, count, {
+        hook(key, count, extra);
+    });
+    ec->keys += oa_hash_size(h);
+}
+
+/*
+ * Depth 0 takes the high bits like wordcount, so the table still sees
+ * uniform low bits. Deeper levels remix the hash with a per level seed,
+ * the keys of one partition share their high bits.
+ */
+static inline int _part_idx(OaHashInt hash, int depth, int part_num) {
+    if(part_num == 1)
+        return 0;
+    uint32_t bits = depth ? (uint32_t)oa_hash_slice_mix(0x9e3779b97f4a7c15ULL * (uint64_t)depth, hash) : hash;
+    return (int)(((uint64_t)bits * (uint64_t)part_num) >> 32U);
+}
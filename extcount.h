@@ -0,0 +1,59 @@
+#ifndef _EXTCOUNT_H
+#define _EXTCOUNT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "oa_hash.h"
+
+/*
+ * Sum per key for inputs whose distinct keys do not fit in memory.
+ *
+ * Keys are counted in an OA table until it would outgrow the memory
+ * budget, then its entries are appended to part_num unlinked files in
+ * the spill directory, picked by the high bits of the key hash, through
+ * one large buffer per file, and counting starts over. finish_extcount
+ * maps the files one after another and sums each in its own table. A
+ * file that would still not fit is split again on other hash bits.
+ * Nothing touches the disk when everything fits.
+ */
+
+OA_COUNTER_INIT_STR_SLICE(extcount, uint64_t, PRIu64)
+
+typedef struct {
+    int fd;
+    char *buf;                          // records not written yet
+    size_t len;
+    uint64_t bytes;                     // written to fd so far
+} ExtCountPart;
+
+typedef struct {
+    char *dir;
+    size_t budget;                      // bytes for tables, keys and buffers
+    size_t table_budget;                // budget less the write buffers
+    size_t buffer_size;                 // per partition
+    int part_num;
+    OaResizePolicy policy;              // max_bytes caps every table
+    oa_hash_t(extcount) *table;         // keys point into arena
+    char **arena;                       // chunks of key bytes
+    int arena_num;
+    size_t arena_len;                   // used in the last chunk
+    size_t arena_cap;                   // size of the last chunk
+    size_t arena_bytes;                 // all chunks
+    ExtCountPart *parts;                // NULL until the first spill
+    uint64_t records;                   // add_extcount calls
+    uint64_t keys;                      // distinct keys, known after finish
+    uint64_t spills;                    // tables written out
+    uint64_t bytes_written;
+    int max_depth;                      // deepest split finish needed
+} ExtCount;
+
+typedef void(*extcount_hook)(OaStrSlice key, uint64_t count, void *extra);
+
+ExtCount *new_extcount(const char *dir, size_t budget, int part_num);
+void free_extcount(ExtCount *ec);
+bool add_extcount(ExtCount *ec, const char *key, size_t len, uint64_t delta);
+bool finish_extcount(ExtCount *ec, extcount_hook hook, void *extra);
+
+#endif
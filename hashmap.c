@@ -6,23 +6,96 @@
 #include <assert.h>
 #include <time.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "hashmap.h"
 
-static int _add_slot(HashMap *m, Slot **slots, int slot_size, void *key, void *value);
+static int _add_hashmap(HashMap *m, void *key, void *value, uint64_t hash_key);
+static int _add_slot(HashMap *m, Slot **slots, int slot_size, void *key, void *value, uint64_t hash_key);
 static void _move_slot(HashMap *m, Slot **slots, int slot_size, void *key, void *value);
 static void rehash(HashMap *m, int new_size);
+static size_t _hashmap_bytes(int slots_size, int count);
+static int _grow_size(HashMap *m);
+static int _shrink_size(HashMap *m);
+static void _shrink_if_sparse(HashMap *m);
+static int _remove_slot(HashMap *m, const void *key, uint64_t hash_key);
+static int _evict_slot(HashMap *m);
+static void _unlink_hot(HashMap *m, int h, int pos);
+static Slot *_find_slot(HashMap *m, const void *key);
+static Slot *_find_slot_bloom(HashMap *m, const void *key, uint64_t hash_key);
+static Slot *_find_slot_hash(HashMap *m, const void *key, uint64_t hash_key);
+static Slot *_find_slot_len(HashMap *m, const char *key, size_t len, uint64_t hash_key);
+static inline bool _str_equal_len(const char *str, const char *key, size_t len);
+static uint64_t _bloom_capacity(HashMap *m, int slots_size);
+static void *_hit_slot(HashMap *m, Slot *p, uint64_t hash_key);
+static uint64_t _now_ms(void);
+static char *_aof_path(const char *path, const char *suffix);
+static int _aof_record(AppendLog *log, MapType *type, int op, const void *key, const void *value);
+static void _aof_log(HashMap *m, int op, const void *key, const void *value);
+static int _aof_flush(AppendLog *log);
+static int _aof_write_snapshot(HashMap *m);
+static int _aof_fold(HashMap *m);
+static void _aof_reap(AppendLog *log, int options);
+static void _aof_replay(HashMap *m, const char *path, bool is_snapshot);
+
+#define BATCH_SIZE 64
+#define EXPIRE_BATCH 64
+#define LEN_KEY_SCRATCH 256     // add_hashmap_len keys shorter than this are not malloc'ed
+
+#define AOF_ADD 1
+#define AOF_DEL 2
+#define AOF_HEADER 9            // op:1 klen:4 vlen:4
+#define AOF_MAGIC "HMSNAP01"
+#define AOF_MAGIC_LEN 8
+#define AOF_SNAPSHOT_BUFFER (1 << 16)
+
+static ResizePolicy default_policy = {
+    1.0,        //max_load
+    0.25,       //min_load
+    2.0,        //grow_factor
+    0.5,        //shrink_hysteresis
+    0,          //max_bytes
+    FULL_FAIL,  //full_action
+};
+
+static MapExt *_get_ext(HashMap *m) {
+    if(m->ext == NULL) {
+        m->ext = (MapExt *)calloc(1, sizeof(MapExt));
+        assert(m->ext);
+    }
+    return m->ext;
+}
+
+#define get_ext_field(m, field) ((m)->ext ? (m)->ext->field : NULL)
+#define get_policy(m) ((m)->ext && (m)->ext->policy ? (m)->ext->policy : &default_policy)
+#define get_bloom(m) get_ext_field(m, bloom)
+#define get_cache(m) get_ext_field(m, cache)
+#define get_expires(m) get_ext_field(m, expires)
+#define get_aof(m) get_ext_field(m, aof)
 
 HashMap *new_hashmap(MapType *type){
     HashMap *m = (HashMap *)malloc(sizeof(HashMap));
-    m->slots = (Slot **)calloc(INIT_SIZE, sizeof(Slot *));
+    memset(m->inline_slots, 0, sizeof(m->inline_slots));
+    m->slots = m->inline_slots;
     m->count = 0;
     m->slots_size = INIT_SIZE;
     m->type = type;
+    m->ext = NULL;
     return m;
 }
 
 void free_hashmap(HashMap *m){
+    if(get_aof(m))
+        close_hashmap_aof(m);
+    if(get_expires(m)) {
+        MapType *expires_type = get_expires(m)->type;
+        free_hashmap(get_expires(m));
+        free(expires_type);
+    }
     for(int i = 0;i < m->slots_size;i++){
         Slot *p = m->slots[i];
         if(p == NULL)
@@ -37,63 +110,157 @@ void free_hashmap(HashMap *m){
         }
         m->slots[i] = NULL;
     }
-    free(m->slots);
+    if(m->slots != m->inline_slots)
+        free(m->slots);
+    if(m->ext) {
+        bloom_free(m->ext->bloom);
+        if(m->ext->cache)
+            free(m->ext->cache->hot);
+        free(m->ext->cache);
+        LATENCY_FREE(m->ext);
+        free(m->ext);
+    }
     free(m);
 }
 
 int add_hashmap(HashMap *m, void *key, void *value){
-    if(m->count >= m->slots_size && m->slots_size <= INT_MAX/2){
-        rehash(m, m->slots_size * 2);
-    }
-    return _add_slot(m, m->slots, m->slots_size, key, value);
+    return _add_hashmap(m, key, value, gen_hash_key(m, key));
+}
+
+int add_hashmap_with_hash(HashMap *m, void *key, void *value, uint64_t hash_key) {
+    return _add_hashmap(m, key, value, hash_key);
+}
+
+/*
+ * For maps keyed by C strings under bkdrhash_hashmap, the key is copied
+ * only when it is new: a NUL terminated scratch copy goes through the
+ * type's copy_key, so its allocator and key_destructor stay paired.
+ */
+int add_hashmap_len(HashMap *m, const char *key, size_t len, void *value) {
+    assert(m->type->hash_function == bkdrhash_hashmap && m->type->copy_key);
+    uint64_t hash_key = bkdrhash_hashmap_len(key, len);
+    Slot *p = _find_slot_len(m, key, len, hash_key);
+    if(p)
+        return add_hashmap_with_hash(m, p->key, value, hash_key);
+    char stack_key[LEN_KEY_SCRATCH];
+    char *new_key = len < sizeof(stack_key) ? stack_key : malloc(len + 1);
+    memcpy(new_key, key, len);
+    new_key[len] = '\0';
+    int ret = _add_hashmap(m, new_key, value, hash_key);
+    if(new_key != stack_key)
+        free(new_key);
+    return ret;
+}
+
+void *query_hashmap_len(HashMap *m, const char *key, size_t len) {
+    assert(m->type->hash_function == bkdrhash_hashmap);
+    uint64_t hash_key = bkdrhash_hashmap_len(key, len);
+    Slot *p = NULL;
+    if(!get_bloom(m) || bloom_check(get_bloom(m), hash_key))
+        p = _find_slot_len(m, key, len, hash_key);
+    return _hit_slot(m, p, hash_key);
+}
+
+/* the hash every *_with_hash call of maps of this type expects */
+uint64_t hash_hashmap(HashMap *m, const void *key) {
+    return gen_hash_key(m, key);
 }
 
 void *query_hashmap(HashMap *m, const void *key){
-    uint64_t hash_key = gen_hash_key(m, key);
-    int h = HASH(hash_key, m->slots_size);
-    Slot *p = m->slots[h];
-    while(p){
-        if(key == p->key || cmp_key(m, p->key, key))
-            return p->value;
-        p = p->next;
-    }
-    return NULL;
+    return query_hashmap_with_hash(m, key, gen_hash_key(m, key));
 }
 
-int remove_hashmap(HashMap *m, const void *key){
-    uint64_t hash_key = gen_hash_key(m, key);
-    int h = HASH(hash_key, m->slots_size);
-    Slot *p = m->slots[h];
-    Slot *prior = NULL;
-    bool is_find = false;
-    while(p){
-        if(key == p->key || cmp_key(m, p->key, key)){
-            is_find = true;
-            break;
+void *query_hashmap_with_hash(HashMap *m, const void *key, uint64_t hash_key) {
+    Slot *p = NULL;
+    if(!get_bloom(m) || bloom_check(get_bloom(m), hash_key))
+        p = _find_slot_hash(m, key, hash_key);
+    return _hit_slot(m, p, hash_key);
+}
+
+/*
+ * Lookups in groups of BATCH_SIZE: the filter drops the misses it can,
+ * then the buckets of the rest and the chain heads in them are prefetched
+ * one pass each before any chain is walked.
+ */
+void query_hashmap_batch(HashMap *m, const void **keys, int n, void **values) {
+    uint64_t hashes[BATCH_SIZE];
+    bool maybe[BATCH_SIZE];
+    for(int base = 0;base < n;base += BATCH_SIZE) {
+        int num = n - base < BATCH_SIZE ? n - base : BATCH_SIZE;
+        for(int i = 0;i < num;i++)
+            hashes[i] = gen_hash_key(m, keys[base + i]);
+        if(get_bloom(m))
+            bloom_check_batch(get_bloom(m), hashes, num, maybe);
+        else
+            memset(maybe, true, num);
+        for(int i = 0;i < num;i++) {
+            if(maybe[i])
+                __builtin_prefetch(&m->slots[HASH(hashes[i], m->slots_size)]);
+        }
+        for(int i = 0;i < num;i++) {
+            if(maybe[i])
+                __builtin_prefetch(m->slots[HASH(hashes[i], m->slots_size)]);
+        }
+        for(int i = 0;i < num;i++) {
+            Slot *p = maybe[i] ? _find_slot_hash(m, keys[base + i], hashes[i]) : NULL;
+            values[base + i] = _hit_slot(m, p, hashes[i]);
         }
-        prior = p;
-        p = p->next;
     }
-    if(!is_find)
+}
+
+int remove_hashmap(HashMap *m, const void *key){
+    return remove_hashmap_with_hash(m, key, gen_hash_key(m, key));
+}
+
+int remove_hashmap_with_hash(HashMap *m, const void *key, uint64_t hash_key) {
+    LATENCY_BEGIN(start);
+    if(get_expires(m) && get_expires(m)->count > 0)
+        remove_hashmap_with_hash(get_expires(m), key, hash_key);
+    if(!_remove_slot(m, key, hash_key)) {
+        LATENCY_END(_get_ext(m), remove, start);
         return FAILED;
-    if(prior){
-        prior->next = p->next;
-        free_key(m, p);
-        free_val(m, p);
-        free(p);
     }
-    else {
-        m->slots[h] = p->next;
-        free_key(m, p);
-        free_val(m, p);
-        free(p);
-    }
-    m->count--;
-    if(m->count < m->slots_size / 4)
-        rehash(m, m->slots_size / 2);
+    _shrink_if_sparse(m);
+    LATENCY_END(_get_ext(m), remove, start);
     return SUCC;
 }
 
+/*
+ * Drops every entry pred returns 0 for in one walk over the chains, with
+ * the destructors, the ttl and a log record each, then shrinks at most
+ * once. pred must not change m. Returns the number of entries dropped.
+ */
+int retain_hashmap(HashMap *m, retain_hook pred, void *extra) {
+    int removed = 0;
+    for(int i = 0;i < m->slots_size;i++) {
+        Slot **link = &m->slots[i];
+        int pos = 0;
+        while(*link) {
+            Slot *p = *link;
+            if(pred(p->key, p->value, extra)) {
+                link = &p->next;
+                pos++;
+                continue;
+            }
+            *link = p->next;
+            _unlink_hot(m, i, pos);
+            if(get_expires(m) && get_expires(m)->count > 0)
+                _remove_slot(get_expires(m), p->key, gen_hash_key(m, p->key));
+            if(get_aof(m))
+                _aof_log(m, AOF_DEL, p->key, NULL);
+            free_key(m, p);
+            free_val(m, p);
+            free(p);
+            m->count--;
+            removed++;
+        }
+    }
+    if(get_expires(m))
+        _shrink_if_sparse(get_expires(m));
+    _shrink_if_sparse(m);
+    return removed;
+}
+
 void traverse_hashmap(HashMap *m, traverse_hook hook, void *extra){
 	for(int i = 0;i < m->slots_size;i++){
 		Slot *p = m->slots[i];
@@ -114,6 +281,273 @@ void get_hashmap_stats(HashMap *m, Stats *stats) {
     stats->count = m->count;
     stats->slots_size = m->slots_size;
     stats->load_factor = ((double)m->count) / m->slots_size;
+    stats->bytes = _hashmap_bytes(m->slots_size, m->count);
+    stats->policy = *get_policy(m);
+}
+
+void init_hashmap_policy(ResizePolicy *policy) {
+    *policy = default_policy;
+}
+
+void set_hashmap_policy(HashMap *m, ResizePolicy *policy) {
+    assert(policy == NULL || (policy->max_load > 0 && policy->grow_factor > 1
+        && policy->min_load < policy->max_load));
+    _get_ext(m)->policy = policy;
+}
+
+void enable_hashmap_bloom(HashMap *m, int bits_per_key) {
+    MapExt *ext = _get_ext(m);
+    bloom_free(ext->bloom);
+    ext->bloom = bloom_new(_bloom_capacity(m, m->slots_size), bits_per_key);
+    for(int i = 0;i < m->slots_size;i++){
+        for(Slot *p = m->slots[i];p;p = p->next)
+            bloom_add(ext->bloom, gen_hash_key(m, p->key));
+    }
+}
+
+void disable_hashmap_bloom(HashMap *m) {
+    if(m->ext) {
+        bloom_free(m->ext->bloom);
+        m->ext->bloom = NULL;
+    }
+}
+
+/*
+ * Bounded cache mode, entries beyond max_entries (or the byte budget of a
+ * FULL_EVICT policy) are evicted in CLOCK order. The referenced bits live
+ * in the cache, not in Slot: every chain keeps the entries hit since the
+ * hand passed at its head and counts them in one byte. A hit moves its
+ * entry to the head at most once per sweep, new entries join right behind
+ * the hit ones, so the tail the hand evicts is the oldest cold entry.
+ */
+void enable_hashmap_cache(HashMap *m, int max_entries, evict_hook hook, void *extra) {
+    MapExt *ext = _get_ext(m);
+    if(ext->cache == NULL) {
+        ext->cache = (Cache *)calloc(1, sizeof(Cache));
+        ext->cache->hot = (uint8_t *)calloc(m->slots_size, sizeof(uint8_t));
+    }
+    ext->cache->max_entries = max_entries;
+    ext->cache->hook = hook;
+    ext->cache->extra = extra;
+    while(max_entries && m->count > max_entries)
+        _evict_slot(m);
+}
+
+void get_hashmap_cache_stats(HashMap *m, CacheStats *stats) {
+    if(get_cache(m))
+        *stats = get_cache(m)->stats;
+    else
+        memset(stats, 0, sizeof(CacheStats));
+}
+
+/* FAILED when the library was built without HASH_LATENCY */
+int get_hashmap_latency(HashMap *m, LatencyStats *stats) {
+    return LATENCY_READ(_get_ext(m), stats) ? SUCC : FAILED;
+}
+
+void reset_hashmap_latency(HashMap *m) {
+    LATENCY_RESET(_get_ext(m));
+}
+
+/*
+ * Deadlines live in a second map, keyed by the very key pointers stored
+ * in m and holding the absolute expiry time in ms as the value. Maps that
+ * never set a ttl pay nothing. Expired entries are dropped lazily when a
+ * query meets them and by active_expire_hashmap.
+ */
+int add_hashmap_ttl(HashMap *m, void *key, void *value, uint64_t ttl_ms) {
+    int ret = add_hashmap(m, key, value);
+    if(ret == FAILED)
+        return FAILED;
+    expire_hashmap(m, key, ttl_ms);
+    return ret;
+}
+
+int expire_hashmap(HashMap *m, const void *key, uint64_t ttl_ms) {
+    Slot *p = _find_slot(m, key);
+    if(p == NULL)
+        return FAILED;
+    if(get_expires(m) == NULL) {
+        MapType *expires_type = (MapType *)calloc(1, sizeof(MapType));
+        expires_type->hash_function = m->type->hash_function;
+        expires_type->key_cmp = m->type->key_cmp;
+        _get_ext(m)->expires = new_hashmap(expires_type);
+    }
+    add_hashmap(get_expires(m), p->key, (void *)(uintptr_t)(_now_ms() + ttl_ms));
+    return SUCC;
+}
+
+int persist_hashmap(HashMap *m, const void *key) {
+    if(get_expires(m) == NULL)
+        return FAILED;
+    return remove_hashmap(get_expires(m), key);
+}
+
+int64_t ttl_hashmap(HashMap *m, const void *key) {
+    Slot *p = _find_slot(m, key);
+    if(p == NULL)
+        return TTL_MISSING;
+    if(get_expires(m) == NULL)
+        return TTL_NONE;
+    Slot *e = _find_slot(get_expires(m), p->key);
+    if(e == NULL)
+        return TTL_NONE;
+    uint64_t deadline = (uint64_t)(uintptr_t)e->value;
+    uint64_t now = _now_ms();
+    if(deadline <= now) {
+        remove_hashmap(m, p->key);
+        return TTL_MISSING;
+    }
+    return (int64_t)(deadline - now);
+}
+
+/*
+ * Walks the deadline map from a persistent cursor, reclaiming stale
+ * entries, and looks at no more than max_samples deadlines. Like redis it
+ * stops early once a round finds fewer than a quarter of them expired.
+ */
+int active_expire_hashmap(HashMap *m, int max_samples) {
+    HashMap *e = get_expires(m);
+    if(e == NULL)
+        return 0;
+    uint64_t now = _now_ms();
+    void *keys[EXPIRE_BATCH];
+    int expired = 0;
+    while(max_samples > 0 && e->count > 0) {
+        int limit = max_samples < EXPIRE_BATCH ? max_samples : EXPIRE_BATCH;
+        int sampled = 0, n = 0;
+        for(int visited = 0;visited < e->slots_size && sampled < limit;visited++) {
+            int i = m->ext->expire_cursor % e->slots_size;
+            m->ext->expire_cursor = i + 1;
+            for(Slot *p = e->slots[i];p;p = p->next) {
+                sampled++;
+                if((uint64_t)(uintptr_t)p->value <= now && n < EXPIRE_BATCH)
+                    keys[n++] = p->key;
+            }
+        }
+        for(int i = 0;i < n;i++)
+            remove_hashmap(m, keys[i]);
+        expired += n;
+        max_samples -= sampled;
+        if(n * 4 < sampled)
+            break;
+    }
+    return expired;
+}
+
+void reserve_hashmap(HashMap *m, int count) {
+    int new_size = m->slots_size;
+    while(count > new_size * get_policy(m)->max_load)
+        new_size *= 2;
+    if(new_size != m->slots_size)
+        rehash(m, new_size);
+}
+
+/*
+ * Append only log. Each add_hashmap and remove_hashmap that changes the
+ * map appends op:1 klen:4 vlen:4 and the serialized key and value, in host
+ * byte order, to a buffer that is written out (and fdatasync'ed when asked)
+ * once group_bytes have piled up. rewrite_hashmap_aof moves the log to
+ * path.old and forks, the child dumps the table into path.snap while the
+ * parent logs into a fresh path. Recovery replays path.snap, path.old and
+ * path in that order; replaying records a snapshot already holds is
+ * harmless since the last record of a key wins. Ttls are not logged.
+ */
+HashMap *load_hashmap(MapType *type, const char *path) {
+    assert(type->deserialize_key && type->deserialize_val);
+    HashMap *m = new_hashmap(type);
+    char *snap_path = _aof_path(path, ".snap");
+    char *old_path = _aof_path(path, ".old");
+    _aof_replay(m, snap_path, true);
+    _aof_replay(m, old_path, false);
+    _aof_replay(m, path, false);
+    free(snap_path);
+    free(old_path);
+    return m;
+}
+
+/* open after load_hashmap on the same path, or the log misses the loaded entries */
+int open_hashmap_aof(HashMap *m, const char *path, size_t group_bytes, int sync) {
+    assert(m->type->serialize_key && m->type->serialize_val);
+    if(get_aof(m))
+        return FAILED;
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if(fd < 0)
+        return FAILED;
+    AppendLog *log = (AppendLog *)calloc(1, sizeof(AppendLog));
+    log->path = _aof_path(path, "");
+    log->snap_path = _aof_path(path, ".snap");
+    log->old_path = _aof_path(path, ".old");
+    log->tmp_path = _aof_path(path, ".snap.tmp");
+    log->fd = fd;
+    log->group_bytes = group_bytes;
+    log->sync = sync;
+    _get_ext(m)->aof = log;
+    if(access(log->old_path, F_OK) == 0)
+        _aof_fold(m);
+    return SUCC;
+}
+
+/* FAILED as well when a group commit failed since the last call, records may be lost */
+int sync_hashmap_aof(HashMap *m) {
+    AppendLog *log = get_aof(m);
+    if(log == NULL)
+        return FAILED;
+    int ok = _aof_flush(log) && !log->error;
+    log->error = 0;
+    return ok ? SUCC : FAILED;
+}
+
+int rewrite_hashmap_aof(HashMap *m) {
+    AppendLog *log = get_aof(m);
+    if(log == NULL || log->child || !_aof_flush(log))
+        return FAILED;
+    // a compaction that died left its log behind, fold it in the foreground
+    if(access(log->old_path, F_OK) == 0)
+        return _aof_fold(m) ? SUCC : FAILED;
+    if(rename(log->path, log->old_path) != 0)
+        return FAILED;
+    int fd = open(log->path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if(fd < 0) {
+        rename(log->old_path, log->path);
+        return FAILED;
+    }
+    pid_t pid = fork();
+    if(pid < 0) {
+        close(fd);
+        rename(log->old_path, log->path);
+        return FAILED;
+    }
+    if(pid == 0)
+        _exit(_aof_write_snapshot(m) ? 0 : 1);
+    close(log->fd);
+    log->fd = fd;
+    log->child = pid;
+    return SUCC;
+}
+
+/* SUCC once no compaction is running */
+int poll_hashmap_aof(HashMap *m) {
+    if(get_aof(m) == NULL)
+        return SUCC;
+    _aof_reap(get_aof(m), WNOHANG);
+    return get_aof(m)->child ? FAILED : SUCC;
+}
+
+void close_hashmap_aof(HashMap *m) {
+    AppendLog *log = get_aof(m);
+    if(log == NULL)
+        return;
+    _aof_flush(log);
+    _aof_reap(log, 0);
+    close(log->fd);
+    free(log->path);
+    free(log->snap_path);
+    free(log->old_path);
+    free(log->tmp_path);
+    free(log->buf);
+    free(log);
+    _get_ext(m)->aof = NULL;
 }
 
 uint64_t bkdrhash_hashmap(const void *key) {
@@ -125,6 +559,15 @@ uint64_t bkdrhash_hashmap(const void *key) {
     return hash & 0x7FFFFFFFFFFFFFFF;
 }
 
+/* same value as bkdrhash_hashmap over the first len bytes, no NUL needed */
+uint64_t bkdrhash_hashmap_len(const char *key, size_t len) {
+    uint64_t seed = 31;
+    uint64_t hash = 0;
+    for(size_t i = 0;i < len;i++)
+        hash = hash * seed + key[i];
+    return hash & 0x7FFFFFFFFFFFFFFF;
+}
+
 void
 intersect_hashmap(HashMap *m1, HashMap *m2, intersect_hook hook, void *extra) {
     for(int i = 0;i < m1->slots_size;i++){
@@ -156,8 +599,9 @@ union_hashmap(HashMap *m1, HashMap *m2, HashMap *union_m) {
 		if(p == NULL)
 			continue;
 		while(p){
-            if(query_hashmap(union_m, p->key) == NULL)
-                add_hashmap(union_m, p->key, p->value);
+            uint64_t hash_key = gen_hash_key(union_m, p->key);
+            if(query_hashmap_with_hash(union_m, p->key, hash_key) == NULL)
+                add_hashmap_with_hash(union_m, p->key, p->value, hash_key);
 			p = p->next;
 		}
 	}
@@ -184,8 +628,35 @@ dump_hashmap(HashMap *m, int key_type){
 }
 
 /* private function */
-static int _add_slot(HashMap *m, Slot **slots, int slot_size, void *key, void *value) {
-    uint64_t hash_key = gen_hash_key(m, key);
+static int _add_hashmap(HashMap *m, void *key, void *value, uint64_t hash_key) {
+    LATENCY_BEGIN(start);
+    ResizePolicy *policy = get_policy(m);
+    if(get_expires(m) && get_expires(m)->count > 0)
+        remove_hashmap_with_hash(get_expires(m), key, hash_key);
+    if(policy->max_bytes && _hashmap_bytes(m->slots_size, m->count + 1) > policy->max_bytes
+            && _find_slot_bloom(m, key, hash_key) == NULL) {
+        if(policy->full_action != FULL_EVICT || !_evict_slot(m)) {
+            LATENCY_END(_get_ext(m), add, start);
+            return FAILED;
+        }
+    }
+    else if(get_cache(m) && get_cache(m)->max_entries && m->count >= get_cache(m)->max_entries
+            && _find_slot_bloom(m, key, hash_key) == NULL) {
+        _evict_slot(m);
+    }
+    if(m->count >= m->slots_size * policy->max_load){
+        int new_size = _grow_size(m);
+        if(new_size != m->slots_size)
+            rehash(m, new_size);
+    }
+    int ret = _add_slot(m, m->slots, m->slots_size, key, value, hash_key);
+    if(get_aof(m))
+        _aof_log(m, AOF_ADD, key, value);
+    LATENCY_END(_get_ext(m), add, start);
+    return ret;
+}
+
+static int _add_slot(HashMap *m, Slot **slots, int slot_size, void *key, void *value, uint64_t hash_key) {
     int h = HASH(hash_key, slot_size);
     Slot *head = slots[h];
     if(head == NULL) {
@@ -195,29 +666,45 @@ static int _add_slot(HashMap *m, Slot **slots, int slot_size, void *key, void *v
         head->next = NULL;
         slots[h] = head;
         m->count++;
+        if(get_bloom(m))
+            bloom_add(get_bloom(m), hash_key);
         return ADD;
     }
     Slot *p = slots[h];
-    while(p){
+    Slot *last_hot = NULL;
+    int hot = get_cache(m) ? get_cache(m)->hot[h] : 0;
+    for(int pos = 0;p;pos++, p = p->next){
         if(key == p->key || cmp_key(m, p->key, key)) {
             free_val(m, p);
             copy_val(m, p, value);
             return REPLACE;
         }
-        p = p->next;
+        if(pos < hot)
+            last_hot = p;
     }
     Slot *new_slot = (Slot *)malloc(sizeof(Slot));
     copy_key(m, new_slot, key);
     copy_val(m, new_slot, value);
-    slots[h] = new_slot;
-    new_slot->next = head;
+    // behind the hit entries of a cache chain, in front otherwise
+    if(last_hot) {
+        new_slot->next = last_hot->next;
+        last_hot->next = new_slot;
+    }
+    else {
+        slots[h] = new_slot;
+        new_slot->next = head;
+    }
     m->count++;
+    if(get_bloom(m))
+        bloom_add(get_bloom(m), hash_key);
     return ADD;
 }
 
 static void _move_slot(HashMap *m, Slot **slots, int slot_size, void *key, void *value) {
     uint64_t hash_key = gen_hash_key(m, key);
     int h = HASH(hash_key, slot_size);
+    if(get_bloom(m))
+        bloom_add(get_bloom(m), hash_key);
     Slot *head = slots[h];
     if(head == NULL) {
         head = (Slot *)malloc(sizeof(Slot));
@@ -242,9 +729,397 @@ static void _move_slot(HashMap *m, Slot **slots, int slot_size, void *key, void
     }
 }
 
+static size_t _hashmap_bytes(int slots_size, int count) {
+    return sizeof(HashMap) + (size_t)slots_size * sizeof(Slot *) + (size_t)count * sizeof(Slot);
+}
+
+static int _grow_size(HashMap *m) {
+    ResizePolicy *policy = get_policy(m);
+    double size = m->slots_size * policy->grow_factor;
+    int new_size = size > INT_MAX ? INT_MAX : (int)size;
+    if(new_size <= m->slots_size)
+        new_size = m->slots_size < INT_MAX ? m->slots_size + 1 : INT_MAX;
+    if(policy->max_bytes && _hashmap_bytes(new_size, m->count + 1) > policy->max_bytes)
+        return m->slots_size;
+    return new_size;
+}
+
+static int _shrink_size(HashMap *m) {
+    ResizePolicy *policy = get_policy(m);
+    double limit = policy->max_load * (1 - policy->shrink_hysteresis);
+    int new_size = m->slots_size;
+    while(new_size > INIT_SIZE) {
+        int next = (int)(new_size / policy->grow_factor);
+        if(next < INIT_SIZE)
+            next = INIT_SIZE;
+        if(next >= new_size || m->count > next * limit)
+            break;
+        new_size = next;
+    }
+    return new_size;
+}
+
+static void _shrink_if_sparse(HashMap *m) {
+    if(m->count < m->slots_size * get_policy(m)->min_load) {
+        int new_size = _shrink_size(m);
+        if(new_size != m->slots_size)
+            rehash(m, new_size);
+    }
+}
+
+/* unlinks and frees the entry of key, no resize */
+static int _remove_slot(HashMap *m, const void *key, uint64_t hash_key) {
+    int h = HASH(hash_key, m->slots_size);
+    Slot *p = m->slots[h];
+    Slot *prior = NULL;
+    int pos = 0;
+    while(p) {
+        if(key == p->key || cmp_key(m, p->key, key))
+            break;
+        prior = p;
+        p = p->next;
+        pos++;
+    }
+    if(!p)
+        return FAILED;
+    if(get_aof(m))
+        _aof_log(m, AOF_DEL, p->key, NULL);
+    if(prior)
+        prior->next = p->next;
+    else
+        m->slots[h] = p->next;
+    _unlink_hot(m, h, pos);
+    free_key(m, p);
+    free_val(m, p);
+    free(p);
+    m->count--;
+    return SUCC;
+}
+
+/* keeps the hit count of chain h right when the entry at pos leaves it */
+static void _unlink_hot(HashMap *m, int h, int pos) {
+    if(get_cache(m) && pos < get_cache(m)->hot[h])
+        get_cache(m)->hot[h]--;
+}
+
+/*
+ * CLOCK sweep with evict_idx as the hand over the chains: the hit entries
+ * at the head of a chain lose their bit and survive, the tail is dropped
+ * unless it was hit too, and the hand moves on. Two rounds always find a
+ * victim.
+ */
+static int _evict_slot(HashMap *m) {
+    if(m->count <= 0)
+        return 0;
+    MapExt *ext = _get_ext(m);
+    for(int n = 0;n <= 2 * m->slots_size;n++) {
+        int i = (ext->evict_idx + n) % m->slots_size;
+        Slot *p = m->slots[i];
+        if(p == NULL)
+            continue;
+        Slot *prior = NULL;
+        int len = 1;
+        for(;p->next;prior = p, p = p->next)
+            len++;
+        if(ext->cache) {
+            int hot = ext->cache->hot[i];
+            ext->cache->hot[i] = 0;
+            if(hot >= len)
+                continue;
+        }
+        if(prior)
+            prior->next = NULL;
+        else
+            m->slots[i] = NULL;
+        if(ext->expires && ext->expires->count > 0)
+            remove_hashmap(ext->expires, p->key);
+        if(ext->aof)
+            _aof_log(m, AOF_DEL, p->key, NULL);
+        if(ext->cache) {
+            if(ext->cache->hook)
+                ext->cache->hook(p->key, p->value, ext->cache->extra);
+            ext->cache->stats.evictions++;
+        }
+        free_key(m, p);
+        free_val(m, p);
+        free(p);
+        m->count--;
+        ext->evict_idx = (i + 1) % m->slots_size;
+        return 1;
+    }
+    return 0;
+}
+
+static uint64_t _now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* lazy expiry and cache accounting for a lookup that found p */
+static void *_hit_slot(HashMap *m, Slot *p, uint64_t hash_key) {
+    HashMap *expires = get_expires(m);
+    Cache *cache = get_cache(m);
+    if(p && expires && expires->count > 0) {
+        Slot *e = _find_slot_hash(expires, p->key, hash_key);
+        if(e && (uint64_t)(uintptr_t)e->value <= _now_ms()) {
+            remove_hashmap_with_hash(m, p->key, hash_key);
+            p = NULL;
+        }
+    }
+    if(cache) {
+        if(p) {
+            int h = HASH(hash_key, m->slots_size);
+            uint8_t *hot = &cache->hot[h];
+            Slot *prior = NULL;
+            int pos = 0;
+            for(Slot *q = m->slots[h];q != p;prior = q, q = q->next)
+                pos++;
+            if(pos >= *hot && *hot < UINT8_MAX) {
+                if(prior) {
+                    prior->next = p->next;
+                    p->next = m->slots[h];
+                    m->slots[h] = p;
+                }
+                (*hot)++;
+            }
+            cache->stats.hits++;
+        }
+        else
+            cache->stats.misses++;
+    }
+    return p ? p->value : NULL;
+}
+
+static char *_aof_path(const char *path, const char *suffix) {
+    char *full = (char *)malloc(strlen(path) + strlen(suffix) + 1);
+    strcpy(full, path);
+    strcat(full, suffix);
+    return full;
+}
+
+static int _aof_record(AppendLog *log, MapType *type, int op, const void *key, const void *value) {
+    size_t klen = type->serialize_key(key, NULL, 0);
+    size_t vlen = op == AOF_ADD ? type->serialize_val(value, NULL, 0) : 0;
+    size_t need = log->len + AOF_HEADER + klen + vlen;
+    if(need > log->cap) {
+        log->cap = log->cap ? log->cap : AOF_HEADER;
+        while(log->cap < need)
+            log->cap *= 2;
+        log->buf = (char *)realloc(log->buf, log->cap);
+    }
+    char *rec = log->buf + log->len;
+    uint32_t klen32 = (uint32_t)klen, vlen32 = (uint32_t)vlen;
+    rec[0] = (char)op;
+    memcpy(rec + 1, &klen32, sizeof(klen32));
+    memcpy(rec + 5, &vlen32, sizeof(vlen32));
+    type->serialize_key(key, rec + AOF_HEADER, klen);
+    if(vlen)
+        type->serialize_val(value, rec + AOF_HEADER + klen, vlen);
+    log->len = need;
+    if(log->len >= log->group_bytes)
+        return _aof_flush(log);
+    return 1;
+}
+
+/* the map's own log, remembers a failed group commit for sync_hashmap_aof */
+static void _aof_log(HashMap *m, int op, const void *key, const void *value) {
+    if(!_aof_record(get_aof(m), m->type, op, key, value))
+        get_aof(m)->error = 1;
+}
+
+/* group commit, a failed write keeps the unwritten tail for the next try */
+static int _aof_flush(AppendLog *log) {
+    size_t off = 0;
+    while(off < log->len) {
+        ssize_t n = write(log->fd, log->buf + off, log->len - off);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        off += n;
+    }
+    if(off) {
+        memmove(log->buf, log->buf + off, log->len - off);
+        log->len -= off;
+    }
+    if(log->len)
+        return 0;
+    return !log->sync || fdatasync(log->fd) == 0;
+}
+
+/* written to tmp_path and renamed, so path.snap is always whole */
+static int _aof_write_snapshot(HashMap *m) {
+    AppendLog *log = get_aof(m);
+    AppendLog snap;
+    memset(&snap, 0, sizeof(snap));
+    snap.fd = open(log->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(snap.fd < 0)
+        return 0;
+    snap.group_bytes = AOF_SNAPSHOT_BUFFER;
+    uint64_t count = m->count;
+    char header[AOF_MAGIC_LEN + sizeof(count)];
+    memcpy(header, AOF_MAGIC, AOF_MAGIC_LEN);
+    memcpy(header + AOF_MAGIC_LEN, &count, sizeof(count));
+    int ok = write(snap.fd, header, sizeof(header)) == (ssize_t)sizeof(header);
+    for(int i = 0;ok && i < m->slots_size;i++) {
+        for(Slot *p = m->slots[i];ok && p;p = p->next)
+            ok = _aof_record(&snap, m->type, AOF_ADD, p->key, p->value);
+    }
+    ok = ok && _aof_flush(&snap) && fdatasync(snap.fd) == 0;
+    close(snap.fd);
+    free(snap.buf);
+    if(!ok || rename(log->tmp_path, log->snap_path) != 0) {
+        unlink(log->tmp_path);
+        return 0;
+    }
+    return 1;
+}
+
+/* foreground compaction of everything logged so far */
+static int _aof_fold(HashMap *m) {
+    AppendLog *log = get_aof(m);
+    if(!_aof_flush(log) || !_aof_write_snapshot(m))
+        return 0;
+    unlink(log->old_path);
+    return ftruncate(log->fd, 0) == 0;
+}
+
+static void _aof_reap(AppendLog *log, int options) {
+    int status;
+    if(log->child == 0)
+        return;
+    pid_t pid = waitpid(log->child, &status, options);
+    if(pid == 0)
+        return;
+    // on failure path.old stays until the next rewrite folds it
+    if(pid == log->child && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        unlink(log->old_path);
+    log->child = 0;
+}
+
+/*
+ * A torn or corrupt record ends the replay: lengths are bounded by what
+ * is left of the file, so a bad header can not ask for a huge buffer.
+ */
+static void _aof_replay(HashMap *m, const char *path, bool is_snapshot) {
+    MapType *type = m->type;
+    FILE *f = fopen(path, "rb");
+    if(f == NULL)
+        return;
+    struct stat st;
+    if(fstat(fileno(f), &st) != 0) {
+        fclose(f);
+        return;
+    }
+    size_t left = (size_t)st.st_size;
+    if(is_snapshot) {
+        char magic[AOF_MAGIC_LEN];
+        uint64_t count;
+        if(fread(magic, 1, AOF_MAGIC_LEN, f) != AOF_MAGIC_LEN || memcmp(magic, AOF_MAGIC, AOF_MAGIC_LEN) != 0
+                || fread(&count, sizeof(count), 1, f) != 1) {
+            fclose(f);
+            return;
+        }
+        left -= AOF_MAGIC_LEN + sizeof(count);
+        if(count <= left / AOF_HEADER && count <= INT_MAX)
+            reserve_hashmap(m, (int)count);
+    }
+    unsigned char header[AOF_HEADER];
+    char *buf = NULL;
+    size_t cap = 0;
+    while(fread(header, 1, AOF_HEADER, f) == AOF_HEADER) {
+        uint32_t klen, vlen;
+        memcpy(&klen, header + 1, sizeof(klen));
+        memcpy(&vlen, header + 5, sizeof(vlen));
+        size_t len = (size_t)klen + vlen;
+        left -= AOF_HEADER;
+        if((header[0] != AOF_ADD && header[0] != AOF_DEL) || len > left)
+            break;
+        if(len > cap) {
+            char *new_buf = (char *)realloc(buf, len);
+            if(new_buf == NULL)
+                break;
+            buf = new_buf;
+            cap = len;
+        }
+        if(fread(buf, 1, len, f) != len)
+            break;
+        left -= len;
+        void *key = type->deserialize_key(buf, klen);
+        if(header[0] == AOF_ADD) {
+            void *value = type->deserialize_val(buf + klen, vlen);
+            int ret = add_hashmap(m, key, value);
+            if((type->copy_val || ret == FAILED) && type->val_destructor)
+                type->val_destructor(value);
+            if((type->copy_key || ret != ADD) && type->key_destructor)
+                type->key_destructor(key);
+        }
+        else {
+            remove_hashmap(m, key);
+            if(type->key_destructor)
+                type->key_destructor(key);
+        }
+    }
+    free(buf);
+    fclose(f);
+}
+
+/* room for the keys the table holds before its next growth */
+static uint64_t _bloom_capacity(HashMap *m, int slots_size) {
+    return (uint64_t)(slots_size * get_policy(m)->max_load) + 1;
+}
+
+static Slot *_find_slot(HashMap *m, const void *key) {
+    return _find_slot_bloom(m, key, gen_hash_key(m, key));
+}
+
+static Slot *_find_slot_bloom(HashMap *m, const void *key, uint64_t hash_key) {
+    if(get_bloom(m) && !bloom_check(get_bloom(m), hash_key))
+        return NULL;
+    return _find_slot_hash(m, key, hash_key);
+}
+
+static Slot *_find_slot_hash(HashMap *m, const void *key, uint64_t hash_key) {
+    int h = HASH(hash_key, m->slots_size);
+    Slot *p = m->slots[h];
+    while(p){
+        if(key == p->key || cmp_key(m, p->key, key))
+            return p;
+        p = p->next;
+    }
+    return NULL;
+}
+
+static Slot *_find_slot_len(HashMap *m, const char *key, size_t len, uint64_t hash_key) {
+    int h = HASH(hash_key, m->slots_size);
+    Slot *p = m->slots[h];
+    while(p){
+        if(_str_equal_len((const char *)p->key, key, len))
+            return p;
+        p = p->next;
+    }
+    return NULL;
+}
+
+/* str is NUL terminated, key is not, stops at the first difference or NUL */
+static inline bool _str_equal_len(const char *str, const char *key, size_t len) {
+    size_t i = 0;
+    while(i < len && str[i] && str[i] == key[i])
+        i++;
+    return i == len && str[len] == '\0';
+}
+
 static void rehash(HashMap *m, int new_size){
     assert(new_size != m->slots_size);
-    Slot **new_slots = (Slot **)calloc(new_size, sizeof(Slot *));
+    LATENCY_BEGIN(start);
+    Slot **new_slots = m->inline_slots;
+    if(new_size == INIT_SIZE)
+        memset(new_slots, 0, sizeof(m->inline_slots));
+    else
+        new_slots = (Slot **)calloc(new_size, sizeof(Slot *));
+    if(get_bloom(m))
+        bloom_reset(get_bloom(m), _bloom_capacity(m, new_size));
     for(int i = 0;i < m->slots_size;i++){
         Slot *p = m->slots[i];
         Slot *tmp = NULL;
@@ -255,9 +1130,18 @@ static void rehash(HashMap *m, int new_size){
             free(tmp);
         }
     }
-    free(m->slots);
+    if(m->slots != m->inline_slots)
+        free(m->slots);
+    // entries land in other chains, so what was hit is forgotten
+    if(get_cache(m)) {
+        free(get_cache(m)->hot);
+        get_cache(m)->hot = (uint8_t *)calloc(new_size, sizeof(uint8_t));
+    }
+    LATENCY_REHASH(_get_ext(m), start, m->slots_size, new_size, m->count);
     m->slots = new_slots;
     m->slots_size = new_size;
+    if(m->ext)
+        m->ext->evict_idx = 0;
 }
 
 #ifdef TEST_MAIN
@@ -316,6 +1200,10 @@ MapType int_key_hash_type = {
     copy_val_cb,   //copy_val
     free_key_cb,   //key_destructor
     free_val_cb,   //val_destructor
+    NULL,          //serialize_key
+    NULL,          //deserialize_key
+    NULL,          //serialize_val
+    NULL,          //deserialize_val
 };
 
 int compare_str_cb(const void *key1, const void *key2) {
@@ -344,13 +1232,43 @@ void free_str_val_cb(void *val) {
         free(val);
 }
 
+size_t serialize_str_key_cb(const void *key, void *buf, size_t size) {
+    size_t len = strlen((char *)key);
+    if(size >= len)
+        memcpy(buf, key, len);
+    return len;
+}
+
+void *deserialize_str_key_cb(const void *buf, size_t len) {
+    char *key = malloc(len + 1);
+    memcpy(key, buf, len);
+    key[len] = '\0';
+    return (void *)key;
+}
+
+size_t serialize_str_val_cb(const void *val, void *buf, size_t size) {
+    if(size >= sizeof(int))
+        memcpy(buf, val, sizeof(int));
+    return sizeof(int);
+}
+
+void *deserialize_str_val_cb(const void *buf, size_t len) {
+    int *val = malloc(sizeof(int));
+    memcpy(val, buf, sizeof(int));
+    return (void *)val;
+}
+
 MapType str_key_hash_type = {
-    bkdrhash_hashmap,  //hash_function
-    compare_str_cb,    //key_cmp
-    copy_str_key_cb,   //copy_key
-    copy_str_val_cb,   //copy_val
-    free_str_key_cb,   //key_destructor
-    free_str_val_cb,   //val_destructor
+    bkdrhash_hashmap,        //hash_function
+    compare_str_cb,          //key_cmp
+    copy_str_key_cb,         //copy_key
+    copy_str_val_cb,         //copy_val
+    free_str_key_cb,         //key_destructor
+    free_str_val_cb,         //val_destructor
+    serialize_str_key_cb,    //serialize_key
+    deserialize_str_key_cb,  //deserialize_key
+    serialize_str_val_cb,    //serialize_val
+    deserialize_str_val_cb,  //deserialize_val
 };
 
 void test_int_key() {
@@ -408,8 +1326,68 @@ void test_str_key() {
     printf("count:%d,slots_size:%d,load_factor:%lf\n", stats.count, stats.slots_size, stats.load_factor);
 }
 
+void test_aof() {
+    const char *path = "test_hashmap.aof";
+    char key[32];
+    unlink(path);
+    HashMap *m = load_hashmap(&str_key_hash_type, path);
+    open_hashmap_aof(m, path, 4096, 0);
+    for(int i = 0;i < 10000;i++) {
+        sprintf(key, "key%d", i);
+        add_hashmap(m, (void *)key, (void *)&i);
+    }
+    rewrite_hashmap_aof(m);
+    for(int i = 0;i < 10000;i += 2) {
+        sprintf(key, "key%d", i);
+        remove_hashmap(m, (void *)key);
+    }
+    while(poll_hashmap_aof(m) != SUCC)
+        usleep(1000);
+    free_hashmap(m);
+    m = load_hashmap(&str_key_hash_type, path);
+    Stats stats;
+    get_hashmap_stats(m, &stats);
+    printf("reloaded count:%d,slots_size:%d\n", stats.count, stats.slots_size);
+    assert(stats.count == 5000);
+    sprintf(key, "key%d", 9999);
+    assert(*(int *)query_hashmap(m, key) == 9999);
+    free_hashmap(m);
+    unlink(path);
+    sprintf(key, "%s.snap", path);
+    unlink(key);
+
+    // every group commit to /dev/full fails, sync reports it once
+    m = new_hashmap(&str_key_hash_type);
+    int opened = open_hashmap_aof(m, "/dev/full", 0, 0);
+    assert(opened == SUCC);
+    int val = 1;
+    add_hashmap(m, (void *)"lost", (void *)&val);
+    int synced = sync_hashmap_aof(m);
+    assert(synced == FAILED && *(int *)query_hashmap(m, "lost") == 1);
+    free_hashmap(m);
+    (void)opened;
+    (void)synced;
+
+    // a corrupt record claiming a 4GB key ends the replay, the records before it stay
+    m = load_hashmap(&str_key_hash_type, path);
+    open_hashmap_aof(m, path, 0, 0);
+    add_hashmap(m, (void *)"kept", (void *)&val);
+    free_hashmap(m);
+    unsigned char bad[AOF_HEADER] = {AOF_ADD, 0xff, 0xff, 0xff, 0xff, 4, 0, 0, 0};
+    FILE *f = fopen(path, "ab");
+    fwrite(bad, 1, sizeof(bad), f);
+    fwrite("tail", 1, 4, f);
+    fclose(f);
+    m = load_hashmap(&str_key_hash_type, path);
+    get_hashmap_stats(m, &stats);
+    assert(stats.count == 1 && *(int *)query_hashmap(m, "kept") == 1);
+    free_hashmap(m);
+    unlink(path);
+}
+
 void main(){
     srand((unsigned int)time(NULL));
     test_str_key();
+    test_aof();
 }
 #endif
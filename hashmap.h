@@ -2,6 +2,11 @@
 #define _HASHMAP_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "bloom.h"
+#include "latency.h"
 
 #define INIT_SIZE 2
 #define cast(t, exp)    ((t)(exp))
@@ -12,6 +17,12 @@
 #define REPLACE 2
 #define ADD 3
 
+#define FULL_FAIL 0
+#define FULL_EVICT 1
+
+#define TTL_NONE -1
+#define TTL_MISSING -2
+
 #define gen_hash_key(m, key) \
     (m)->type->hash_function((key))
 
@@ -49,39 +60,134 @@ typedef struct {
     void *(*copy_val)(const void *val);
     void (*key_destructor)(void *key);
     void (*val_destructor)(void *val);
+    /*
+     * serializers for the append only log, only needed by maps that open one.
+     * serialize returns the encoded length and writes it out only when it
+     * fits in size. deserialize hands back an object the destructors can free.
+     */
+    size_t (*serialize_key)(const void *key, void *buf, size_t size);
+    void *(*deserialize_key)(const void *buf, size_t len);
+    size_t (*serialize_val)(const void *val, void *buf, size_t size);
+    void *(*deserialize_val)(const void *buf, size_t len);
 } MapType;
 
+typedef struct {
+    double max_load;            // grow once count reaches slots_size * max_load
+    double min_load;            // shrink once count drops below slots_size * min_load, 0 never shrinks
+    double grow_factor;         // slots_size multiplier on growth, must be > 1
+    double shrink_hysteresis;   // a shrink leaves the load at most max_load * (1 - shrink_hysteresis)
+    size_t max_bytes;           // budget for the table structure, 0 is unlimited
+    int full_action;            // FULL_FAIL or FULL_EVICT once max_bytes is reached
+} ResizePolicy;
+
 typedef struct Slot {
     void *key;
     void *value;
     struct Slot *next;
 } Slot;
 
+typedef void(*evict_hook)(const void *key, void *value, void *extra);
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} CacheStats;
+
+typedef struct {
+    int max_entries;            // 0 leaves only the max_bytes budget of the policy
+    evict_hook hook;            // called before the destructors of an evicted entry
+    void *extra;
+    uint8_t *hot;               // per chain, its first hot[i] entries were hit since the hand passed
+    CacheStats stats;
+} Cache;
+
+typedef struct {
+    char *path;                 // live log
+    char *snap_path;            // path.snap, the last compacted state
+    char *old_path;             // path.old, the log a running compaction folds in
+    char *tmp_path;             // path.snap.tmp, snapshot being written
+    int fd;
+    char *buf;                  // records not yet handed to the kernel
+    size_t len;
+    size_t cap;
+    size_t group_bytes;         // group commit threshold, 0 writes every record
+    int sync;                   // fdatasync on every group commit
+    int error;                  // a group commit failed since the last sync_hashmap_aof
+    pid_t child;                // compaction in progress, 0 if none
+} AppendLog;
+
+/* what a plain map does without, allocated on first use */
 typedef struct {
+    ResizePolicy *policy;
+    BloomFilter *bloom;
+    Cache *cache;
+    struct HashMap *expires;
+    AppendLog *aof;
+    int evict_idx;
+    int expire_cursor;
+    LATENCY_FIELD               // only with -DHASH_LATENCY
+} MapExt;
+
+typedef struct HashMap {
     MapType *type;
+    MapExt *ext;
     Slot **slots;
     int count;
     int slots_size;
+    Slot *inline_slots[INIT_SIZE];  // slots while slots_size is INIT_SIZE, no allocation
 } HashMap;
 
 typedef struct {
     int count;
     int slots_size;
     double load_factor;
+    size_t bytes;
+    ResizePolicy policy;
 } Stats;
 
 typedef void(*traverse_hook)(const void *key, void *value, void *extra);
 typedef void(*intersect_hook)(void *key, void *value, void *extra);
+typedef int(*retain_hook)(const void *key, void *value, void *extra);
 
 HashMap *new_hashmap(MapType *type);
 void free_hashmap(HashMap *m);
 int add_hashmap(HashMap *m, void *key, void *value);
+int add_hashmap_len(HashMap *m, const char *key, size_t len, void *value);
+int add_hashmap_with_hash(HashMap *m, void *key, void *value, uint64_t hash_key);
 int remove_hashmap(HashMap *m, const void *key);
+int remove_hashmap_with_hash(HashMap *m, const void *key, uint64_t hash_key);
+int retain_hashmap(HashMap *m, retain_hook pred, void *extra);
 void *query_hashmap(HashMap *m, const void *key);
+void *query_hashmap_len(HashMap *m, const char *key, size_t len);
+void *query_hashmap_with_hash(HashMap *m, const void *key, uint64_t hash_key);
+uint64_t hash_hashmap(HashMap *m, const void *key);
+void query_hashmap_batch(HashMap *m, const void **keys, int n, void **values);
 void traverse_hashmap(HashMap *m, traverse_hook hook, void *extra);
 int is_empty_hashmap(HashMap *m);
 void get_hashmap_stats(HashMap *m, Stats *stats);
+void init_hashmap_policy(ResizePolicy *policy);
+void set_hashmap_policy(HashMap *m, ResizePolicy *policy);
+void enable_hashmap_bloom(HashMap *m, int bits_per_key);
+void disable_hashmap_bloom(HashMap *m);
+void enable_hashmap_cache(HashMap *m, int max_entries, evict_hook hook, void *extra);
+void get_hashmap_cache_stats(HashMap *m, CacheStats *stats);
+int get_hashmap_latency(HashMap *m, LatencyStats *stats);
+void reset_hashmap_latency(HashMap *m);
+int add_hashmap_ttl(HashMap *m, void *key, void *value, uint64_t ttl_ms);
+int expire_hashmap(HashMap *m, const void *key, uint64_t ttl_ms);
+int persist_hashmap(HashMap *m, const void *key);
+int64_t ttl_hashmap(HashMap *m, const void *key);
+int active_expire_hashmap(HashMap *m, int max_samples);
+void reserve_hashmap(HashMap *m, int count);
+HashMap *load_hashmap(MapType *type, const char *path);
+int open_hashmap_aof(HashMap *m, const char *path, size_t group_bytes, int sync);
+int sync_hashmap_aof(HashMap *m);
+int rewrite_hashmap_aof(HashMap *m);
+int poll_hashmap_aof(HashMap *m);
+void close_hashmap_aof(HashMap *m);
 uint64_t bkdrhash_hashmap(const void *key);
+uint64_t bkdrhash_hashmap_len(const char *key, size_t len);
 void intersect_hashmap(HashMap *m1, HashMap *m2, intersect_hook hook, void *extra);
 void dump_hashmap(HashMap *m, int key_type);
 void union_hashmap(HashMap *m1, HashMap *m2, HashMap *union_m);
@@ -0,0 +1,265 @@
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+/*
+ * Per table latency histograms, compiled in with -DHASH_LATENCY.
+ *
+ * Buckets are log-linear ranges of nanoseconds: LATENCY_RANGES powers of
+ * two from 1ns to about 18 minutes, each cut into 2^LATENCY_SUB_BITS equal
+ * steps, and a last one for anything longer. A table only holds a pointer
+ * until its first record, and each bucket array grows up to the slowest
+ * record it has seen, so a million small tables cost about 0.5KB each.
+ * Recording is one clock read and an increment, the tables are not locked
+ * for it and follow the threading rules of the table they belong to.
+ * Without the flag the table has no such field and the hooks expand to
+ * nothing.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef LATENCY_SUB_BITS
+#define LATENCY_SUB_BITS 3U
+#endif
+#define LATENCY_SUB_BUCKETS (1U << LATENCY_SUB_BITS)
+#define LATENCY_RANGES 40U
+#define LATENCY_BUCKETS ((LATENCY_RANGES - LATENCY_SUB_BITS + 1U) * LATENCY_SUB_BUCKETS + 1U)
+#define LATENCY_EVENT_NUM 8U
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[LATENCY_BUCKETS];
+} LatencyHist;
+
+typedef struct {
+    uint64_t old_slots;
+    uint64_t new_slots;
+    uint64_t count;                     // entries moved
+    uint64_t ns;
+} RehashEvent;
+
+typedef struct {
+    LatencyHist add;                    // a rehash the add triggers is part of it
+    LatencyHist remove;
+    LatencyHist rehash;
+    RehashEvent events[LATENCY_EVENT_NUM];  // ring of the latest rehashes
+    uint64_t event_num;                 // rehashes since the last reset
+} LatencyStats;
+
+/* what a table keeps of one histogram, read back as a LatencyHist */
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t *buckets;                  // up to the bucket of max
+    uint32_t bucket_num;
+} LatencyCounts;
+
+typedef struct {
+    LatencyCounts add;
+    LatencyCounts remove;
+    LatencyCounts rehash;
+    RehashEvent *events;                // allocated with the first rehash
+    uint64_t event_num;
+} LatencyTrack;
+
+static inline uint64_t
+latency_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint32_t
+latency_bucket(uint64_t ns) {
+    if(ns < LATENCY_SUB_BUCKETS)
+        return (uint32_t)ns;
+    uint32_t exp = 63U - (uint32_t)__builtin_clzll(ns);
+    if(exp >= LATENCY_RANGES)
+        return LATENCY_BUCKETS - 1U;
+    uint32_t sub = (uint32_t)(ns >> (exp - LATENCY_SUB_BITS)) - LATENCY_SUB_BUCKETS;
+    return (exp - LATENCY_SUB_BITS + 1U) * LATENCY_SUB_BUCKETS + sub;
+}
+
+/* the largest value that lands in bucket */
+static inline uint64_t
+latency_bucket_high(uint32_t bucket) {
+    if(bucket < LATENCY_SUB_BUCKETS)
+        return bucket;
+    if(bucket == LATENCY_BUCKETS - 1U)
+        return UINT64_MAX;
+    uint32_t shift = bucket / LATENCY_SUB_BUCKETS - 1U;
+    uint64_t low = (uint64_t)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS) << shift;
+    return low + ((1ULL << shift) - 1U);
+}
+
+static inline void
+latency_hist_reset(LatencyHist *h) {
+    memset(h, 0, sizeof(LatencyHist));
+    h->min = UINT64_MAX;
+}
+
+static inline void
+latency_hist_record(LatencyHist *h, uint64_t ns) {
+    h->buckets[latency_bucket(ns)]++;
+    h->count++;
+    h->sum += ns;
+    if(ns < h->min)
+        h->min = ns;
+    if(ns > h->max)
+        h->max = ns;
+}
+
+/* upper bound of the bucket holding quantile q, 0 when nothing was recorded */
+static inline uint64_t
+latency_hist_percentile(const LatencyHist *h, double q) {
+    if(!h->count)
+        return 0;
+    uint64_t rank = (uint64_t)(q * (double)h->count + 0.5);
+    rank = rank ? rank : 1;
+    uint64_t seen = 0;
+    for(uint32_t i = 0;i < LATENCY_BUCKETS;i++) {
+        seen += h->buckets[i];
+        if(seen >= rank) {
+            uint64_t high = latency_bucket_high(i);
+            return high < h->max ? high : h->max;
+        }
+    }
+    return h->max;
+}
+
+static inline double
+latency_hist_mean(const LatencyHist *h) {
+    return h->count ? (double)h->sum / (double)h->count : 0.0;
+}
+
+static inline void
+latency_stats_reset(LatencyStats *s) {
+    latency_hist_reset(&s->add);
+    latency_hist_reset(&s->remove);
+    latency_hist_reset(&s->rehash);
+    memset(s->events, 0, sizeof(s->events));
+    s->event_num = 0;
+}
+
+static inline void
+latency_counts_record(LatencyCounts *c, uint64_t ns) {
+    uint32_t bucket = latency_bucket(ns);
+    if(bucket >= c->bucket_num) {
+        uint32_t num = (bucket / LATENCY_SUB_BUCKETS + 1U) * LATENCY_SUB_BUCKETS;
+        num = num < LATENCY_BUCKETS ? num : LATENCY_BUCKETS;
+        uint64_t *buckets = (uint64_t *)realloc(c->buckets, num * sizeof(uint64_t));
+        if(buckets == NULL)
+            return;
+        memset(buckets + c->bucket_num, 0, (num - c->bucket_num) * sizeof(uint64_t));
+        c->buckets = buckets;
+        c->bucket_num = num;
+    }
+    c->buckets[bucket]++;
+    if(!c->count || ns < c->min)
+        c->min = ns;
+    if(ns > c->max)
+        c->max = ns;
+    c->count++;
+    c->sum += ns;
+}
+
+static inline void
+latency_counts_read(const LatencyCounts *c, LatencyHist *h) {
+    latency_hist_reset(h);
+    if(!c->count)
+        return;
+    h->count = c->count;
+    h->sum = c->sum;
+    h->min = c->min;
+    h->max = c->max;
+    memcpy(h->buckets, c->buckets, c->bucket_num * sizeof(uint64_t));
+}
+
+/* the track of a table, allocated on its first record */
+static inline LatencyTrack *
+latency_track_get(LatencyTrack **t) {
+    if(*t == NULL)
+        *t = (LatencyTrack *)calloc(1, sizeof(LatencyTrack));
+    return *t;
+}
+
+static inline void
+latency_track_free(LatencyTrack *t) {
+    if(t == NULL)
+        return;
+    free(t->add.buckets);
+    free(t->remove.buckets);
+    free(t->rehash.buckets);
+    free(t->events);
+    free(t);
+}
+
+static inline void
+latency_track_read(const LatencyTrack *t, LatencyStats *s) {
+    latency_stats_reset(s);
+    if(t == NULL)
+        return;
+    latency_counts_read(&t->add, &s->add);
+    latency_counts_read(&t->remove, &s->remove);
+    latency_counts_read(&t->rehash, &s->rehash);
+    if(t->events)
+        memcpy(s->events, t->events, sizeof(s->events));
+    s->event_num = t->event_num;
+}
+
+static inline void
+latency_record_rehash(LatencyTrack *t, uint64_t old_slots, uint64_t new_slots,
+        uint64_t count, uint64_t ns) {
+    if(t->events == NULL) {
+        t->events = (RehashEvent *)calloc(LATENCY_EVENT_NUM, sizeof(RehashEvent));
+        if(t->events == NULL)
+            return;
+    }
+    RehashEvent *e = &t->events[t->event_num++ % LATENCY_EVENT_NUM];
+    e->old_slots = old_slots;
+    e->new_slots = new_slots;
+    e->count = count;
+    e->ns = ns;
+    latency_counts_record(&t->rehash, ns);
+}
+
+/* the event rehashes ago, 0 is the latest, NULL once it left the ring */
+static inline const RehashEvent *
+latency_rehash_event(const LatencyStats *s, uint64_t ago) {
+    if(ago >= s->event_num || ago >= LATENCY_EVENT_NUM)
+        return NULL;
+    return &s->events[(s->event_num - 1U - ago) % LATENCY_EVENT_NUM];
+}
+
+#ifdef HASH_LATENCY
+#define LATENCY_FIELD LatencyTrack *latency;
+#define LATENCY_INIT(t) ((t)->latency = NULL)
+#define LATENCY_FREE(t) latency_track_free((t)->latency)
+#define LATENCY_BEGIN(start) uint64_t start = latency_now()
+#define LATENCY_END(t, hist, start)                                                       \
+    latency_counts_record(&latency_track_get(&(t)->latency)->hist, latency_now() - (start))
+#define LATENCY_REHASH(t, start, old_slots, new_slots, count)                             \
+    latency_record_rehash(latency_track_get(&(t)->latency), (old_slots), (new_slots),     \
+        (count), latency_now() - (start))
+#define LATENCY_READ(t, stats) (latency_track_read((t)->latency, (stats)), true)
+#define LATENCY_RESET(t) (latency_track_free((t)->latency), (t)->latency = NULL)
+#else
+#define LATENCY_FIELD
+#define LATENCY_INIT(t) ((void)0)
+#define LATENCY_FREE(t) ((void)0)
+#define LATENCY_BEGIN(start) ((void)0)
+#define LATENCY_END(t, hist, start) ((void)0)
+#define LATENCY_REHASH(t, start, old_slots, new_slots, count) ((void)0)
+#define LATENCY_READ(t, stats) ((void)(t), latency_stats_reset(stats), false)
+#define LATENCY_RESET(t) ((void)(t))
+#endif
+
+#endif
@@ -0,0 +1,314 @@
+#ifndef __OA_COW_H__
+#define __OA_COW_H__
+
+/*
+ * Page granular copy on write for the arrays of an OA table.
+ *
+ * Every array lives in its own memfd mapped shared into the table. A
+ * snapshot maps the same files a second time, which costs a few syscalls
+ * whatever the table size. While it is live the writer remaps a page
+ * private right before its first store, the kernel copies it on that
+ * store and the file, hence the snapshot, keeps the old bytes. Releasing
+ * the snapshot writes the private pages back into the file and maps them
+ * shared again, so the next snapshot starts from a clean table.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#define OA_COW_CLOEXEC 1U              // MFD_CLOEXEC
+
+typedef struct {
+    int fd;
+    char *base;                         // the table's view
+    char *view;                         // the snapshot's view, NULL when none is live
+    size_t bytes;                       // file length, a page multiple
+    size_t view_bytes;                  // the table may have been resized since
+    uint8_t *dirty;                     // pages remapped private since the snapshot
+    size_t dirty_num;
+} OaCowArea;
+
+typedef struct {
+    OaCowArea keys;
+    OaCowArea values;
+    OaCowArea hashes;                   // only for tables that store them
+    OaCowArea flags;
+    void *snapshot;                     // at most one per table
+    bool shared;                        // the snapshot still reads the table's files
+    char *garbage;                      // keys dropped while the snapshot is live
+    size_t garbage_len;
+    size_t garbage_cap;
+} OaCow;
+
+static inline size_t
+oa_cow_page_size() {
+    static size_t page_size = 0;
+    if(!page_size)
+        page_size = (size_t)sysconf(_SC_PAGESIZE);
+    return page_size;
+}
+
+static inline size_t
+oa_cow_round(size_t bytes) {
+    size_t page = oa_cow_page_size();
+    bytes = bytes ? bytes : 1;
+    return (bytes + page - 1) / page * page;
+}
+
+static inline int
+oa_cow_memfd() {
+#if defined(__linux__) && defined(SYS_memfd_create)
+    return (int)syscall(SYS_memfd_create, "oa_cow", OA_COW_CLOEXEC);
+#else
+    return -1;
+#endif
+}
+
+/* bytes of zeroes, false when the system has no memfd */
+static inline bool
+oa_cow_area_new(OaCowArea *a, size_t bytes) {
+    memset(a, 0, sizeof(OaCowArea));
+    a->fd = oa_cow_memfd();
+    if(a->fd < 0)
+        return false;
+    a->bytes = oa_cow_round(bytes);
+    if(ftruncate(a->fd, (off_t)a->bytes) != 0) {
+        close(a->fd);
+        return false;
+    }
+    a->base = mmap(NULL, a->bytes, PROT_READ | PROT_WRITE, MAP_SHARED, a->fd, 0);
+    if(a->base == MAP_FAILED) {
+        close(a->fd);
+        return false;
+    }
+    return true;
+}
+
+static inline void
+oa_cow_area_free(OaCowArea *a) {
+    if(a->base)
+        munmap(a->base, a->bytes);
+    if(a->fd >= 0)
+        close(a->fd);
+    free(a->dirty);
+    a->base = NULL;
+    a->fd = -1;
+    a->dirty = NULL;
+}
+
+/* only with no snapshot sharing the file, the contents up to bytes survive */
+static inline void *
+oa_cow_area_resize(OaCowArea *a, size_t bytes) {
+    bytes = oa_cow_round(bytes);
+    if(bytes == a->bytes)
+        return a->base;
+    munmap(a->base, a->bytes);
+    int ret = ftruncate(a->fd, (off_t)bytes);
+    assert(ret == 0);
+    (void)ret;
+    a->base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, a->fd, 0);
+    assert(a->base != MAP_FAILED);
+    a->bytes = bytes;
+    return a->base;
+}
+
+static inline bool
+oa_cow_area_share(OaCowArea *a) {
+    size_t page_num = a->bytes / oa_cow_page_size();
+    a->view = mmap(NULL, a->bytes, PROT_READ, MAP_SHARED, a->fd, 0);
+    if(a->view == MAP_FAILED) {
+        a->view = NULL;
+        return false;
+    }
+    a->view_bytes = a->bytes;
+    a->dirty = calloc(page_num, 1);
+    a->dirty_num = 0;
+    return true;
+}
+
+static inline void
+oa_cow_area_drop_view(OaCowArea *a) {
+    if(a->view)
+        munmap(a->view, a->view_bytes);
+    free(a->dirty);
+    a->view = NULL;
+    a->dirty = NULL;
+}
+
+/* the next len bytes at p are about to be written */
+static inline void
+oa_cow_area_touch(OaCowArea *a, const void *p, size_t len) {
+    size_t page = oa_cow_page_size();
+    size_t first = (size_t)((const char *)p - a->base) / page;
+    size_t last = (size_t)((const char *)p + len - 1 - a->base) / page;
+    for(size_t i = first;i <= last;i++) {
+        if(a->dirty[i])
+            continue;
+        void *addr = mmap(a->base + i * page, page, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_FIXED, a->fd, (off_t)(i * page));
+        assert(addr != MAP_FAILED);
+        (void)addr;
+        a->dirty[i] = 1;
+        a->dirty_num++;
+    }
+}
+
+/* folds the private pages back into the file, one run at a time */
+static inline void
+oa_cow_area_unshare(OaCowArea *a) {
+    size_t page = oa_cow_page_size();
+    size_t page_num = a->bytes / page;
+    for(size_t i = 0;i < page_num && a->dirty_num;) {
+        if(!a->dirty[i]) {
+            i++;
+            continue;
+        }
+        size_t j = i;
+        while(j < page_num && a->dirty[j])
+            j++;
+        size_t off = i * page, len = (j - i) * page;
+        ssize_t n = pwrite(a->fd, a->base + off, len, (off_t)off);
+        assert(n == (ssize_t)len);
+        (void)n;
+        void *addr = mmap(a->base + off, len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED, a->fd, (off_t)off);
+        assert(addr != MAP_FAILED);
+        (void)addr;
+        a->dirty_num -= j - i;
+        i = j;
+    }
+    free(a->dirty);
+    a->dirty = NULL;
+}
+
+/* the table moves to fresh files, the old ones are left to the snapshot */
+static inline void
+oa_cow_area_detach(OaCowArea *a) {
+    OaCowArea fresh;
+    bool ok = oa_cow_area_new(&fresh, a->bytes);
+    assert(ok);
+    (void)ok;
+    memcpy(fresh.base, a->base, a->bytes);
+    munmap(a->base, a->bytes);
+    close(a->fd);
+    free(a->dirty);
+    fresh.view = a->view;
+    fresh.view_bytes = a->view_bytes;
+    *a = fresh;
+}
+
+static inline bool
+oa_cow_new(OaCow *cow, size_t keys_bytes, size_t values_bytes, size_t hashes_bytes,
+        size_t flags_bytes) {
+    memset(cow, 0, sizeof(OaCow));
+    cow->values.fd = -1;
+    cow->hashes.fd = -1;
+    if(!oa_cow_area_new(&cow->keys, keys_bytes))
+        return false;
+    if(values_bytes && !oa_cow_area_new(&cow->values, values_bytes)) {
+        oa_cow_area_free(&cow->keys);
+        return false;
+    }
+    if(hashes_bytes && !oa_cow_area_new(&cow->hashes, hashes_bytes)) {
+        oa_cow_area_free(&cow->keys);
+        oa_cow_area_free(&cow->values);
+        return false;
+    }
+    if(!oa_cow_area_new(&cow->flags, flags_bytes)) {
+        oa_cow_area_free(&cow->keys);
+        oa_cow_area_free(&cow->values);
+        oa_cow_area_free(&cow->hashes);
+        return false;
+    }
+    return true;
+}
+
+static inline void
+oa_cow_free(OaCow *cow) {
+    assert(!cow->snapshot);
+    oa_cow_area_free(&cow->keys);
+    oa_cow_area_free(&cow->values);
+    oa_cow_area_free(&cow->hashes);
+    oa_cow_area_free(&cow->flags);
+    free(cow->garbage);
+}
+
+static inline bool
+oa_cow_share(OaCow *cow) {
+    if(!oa_cow_area_share(&cow->keys))
+        return false;
+    if(cow->values.base && !oa_cow_area_share(&cow->values)) {
+        oa_cow_area_drop_view(&cow->keys);
+        return false;
+    }
+    if(cow->hashes.base && !oa_cow_area_share(&cow->hashes)) {
+        oa_cow_area_drop_view(&cow->keys);
+        oa_cow_area_drop_view(&cow->values);
+        return false;
+    }
+    if(!oa_cow_area_share(&cow->flags)) {
+        oa_cow_area_drop_view(&cow->keys);
+        oa_cow_area_drop_view(&cow->values);
+        oa_cow_area_drop_view(&cow->hashes);
+        return false;
+    }
+    cow->shared = true;
+    return true;
+}
+
+/* a rehash rewrites every page, cheaper to leave the old files behind */
+static inline void
+oa_cow_detach(OaCow *cow) {
+    if(!cow->shared)
+        return;
+    oa_cow_area_detach(&cow->keys);
+    if(cow->values.base)
+        oa_cow_area_detach(&cow->values);
+    if(cow->hashes.base)
+        oa_cow_area_detach(&cow->hashes);
+    oa_cow_area_detach(&cow->flags);
+    cow->shared = false;
+}
+
+static inline void
+oa_cow_unshare(OaCow *cow) {
+    OaCowArea *areas[4] = {&cow->keys, &cow->values, &cow->hashes, &cow->flags};
+    for(int i = 0;i < 4;i++) {
+        if(!areas[i]->base)
+            continue;
+        if(cow->shared)
+            oa_cow_area_unshare(areas[i]);
+        oa_cow_area_drop_view(areas[i]);
+    }
+    cow->shared = false;
+}
+
+/* keeps a key the snapshot may still read until the snapshot is gone */
+static inline void
+oa_cow_defer(OaCow *cow, const void *key, size_t len) {
+    if(cow->garbage_len + len > cow->garbage_cap) {
+        cow->garbage_cap = cow->garbage_cap ? cow->garbage_cap << 1U : 64U * len;
+        cow->garbage = realloc(cow->garbage, cow->garbage_cap);
+        assert(cow->garbage);
+    }
+    memcpy(cow->garbage + cow->garbage_len, key, len);
+    cow->garbage_len += len;
+}
+
+/* cow may be NULL */
+#define oa_cow_live(cow) ((cow) && (cow)->shared)
+#define oa_cow_touch(cow, area, p, len)                                                   \
+    do {                                                                                  \
+        if(oa_cow_live(cow))                                                              \
+            oa_cow_area_touch(&(cow)->area, (p), (len));                                  \
+    } while(0)
+
+#endif
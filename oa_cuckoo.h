@@ -0,0 +1,365 @@
+#ifndef __OA_CUCKOO_H__
+#define __OA_CUCKOO_H__
+
+/*
+ * 2-choice, 4-way bucketized cuckoo hash.
+ *
+ * Every key lives in one of two buckets, a bucket is CUCKOO_BUCKET_WAYS
+ * adjacent slots, so a lookup compares at most two groups of four keys.
+ * Inserts that find both buckets full run a breadth first search for the
+ * shortest chain of displacements ending in a free slot.
+ *
+ * The generated type keeps the slot_size/size/flags/keys/values layout of
+ * oa_hash.h, slot i of bucket b is b * CUCKOO_BUCKET_WAYS + i, so the
+ * oa_hash_* accessors and oa_hash_foreach work on it unchanged.
+ */
+
+#include "oa_hash.h"
+
+#if defined(__AVX2__) || defined(__SSE4_1__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define CUCKOO_BUCKET_WAYS 4U
+#define CUCKOO_BUCKET_INIT_NUM 2U
+#define CUCKOO_MAX_LOAD 0.95
+#define CUCKOO_BFS_MAX_NODES 512
+#define CUCKOO_CACHE_LINE 64U
+
+#define calc_cuckoo_upper_limit(slot_size) (OaHashInt)((slot_size) * CUCKOO_MAX_LOAD)
+
+typedef struct {
+    OaHashInt bucket;
+    int parent;
+    OaHashInt slot;
+} OaCuckooBfsNode;
+
+static inline void *
+oa_cuckoo_alloc(size_t bytes) {
+    size_t align_bytes = (bytes + CUCKOO_CACHE_LINE - 1) & ~(size_t)(CUCKOO_CACHE_LINE - 1);
+    void *p = aligned_alloc(CUCKOO_CACHE_LINE, align_bytes);
+    assert(p);
+    return p;
+}
+
+/* bit i set when slot i of the bucket holds a key */
+static inline unsigned
+oa_cuckoo_exist_mask(const OaFlagsInt *flags, OaHashInt bucket) {
+    unsigned byte = (flags[bucket >> 2U] >> ((bucket & 3U) << 3U)) & 0xffU;
+    unsigned m = ~(byte | (byte >> 1U)) & 0x55U;
+    return (m & 1U) | ((m >> 1U) & 2U) | ((m >> 2U) & 4U) | ((m >> 3U) & 8U);
+}
+
+static inline void
+oa_cuckoo_buckets(uint64_t hash, OaHashInt bucket_num, OaHashInt *b1, OaHashInt *b2) {
+    *b1 = (OaHashInt)hash & (bucket_num - 1);
+    *b2 = (OaHashInt)(hash >> 32U) & (bucket_num - 1);
+    if(*b2 == *b1)
+        *b2 = *b1 ^ 1U;
+}
+
+static inline unsigned
+oa_cuckoo_match_uint64(const uint64_t *bucket_keys, uint64_t key, unsigned exist) {
+#if defined(__AVX2__)
+    __m256i keys = _mm256_loadu_si256((const __m256i *)bucket_keys);
+    __m256i eq = _mm256_cmpeq_epi64(keys, _mm256_set1_epi64x((long long)key));
+    unsigned m = (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(eq));
+#elif defined(__SSE4_1__)
+    __m128i k = _mm_set1_epi64x((long long)key);
+    __m128i lo = _mm_cmpeq_epi64(_mm_loadu_si128((const __m128i *)bucket_keys), k);
+    __m128i hi = _mm_cmpeq_epi64(_mm_loadu_si128((const __m128i *)(bucket_keys + 2)), k);
+    unsigned m = (unsigned)_mm_movemask_pd(_mm_castsi128_pd(lo))
+        | ((unsigned)_mm_movemask_pd(_mm_castsi128_pd(hi)) << 2U);
+#else
+    unsigned m = 0;
+    for(unsigned i = 0;i < CUCKOO_BUCKET_WAYS;i++)
+        m |= (unsigned)(bucket_keys[i] == key) << i;
+#endif
+    return m & exist;
+}
+
+static inline unsigned
+oa_cuckoo_match_uint32(const uint32_t *bucket_keys, uint32_t key, unsigned exist) {
+#if defined(__SSE2__)
+    __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)bucket_keys),
+        _mm_set1_epi32((int)key));
+    unsigned m = (unsigned)_mm_movemask_ps(_mm_castsi128_ps(eq));
+#else
+    unsigned m = 0;
+    for(unsigned i = 0;i < CUCKOO_BUCKET_WAYS;i++)
+        m |= (unsigned)(bucket_keys[i] == key) << i;
+#endif
+    return m & exist;
+}
+
+static inline unsigned
+oa_cuckoo_match_str(const OaStrKey *bucket_keys, OaStrKey key, unsigned exist) {
+    unsigned m = 0;
+    for(unsigned i = 0;i < CUCKOO_BUCKET_WAYS;i++) {
+        if((exist >> i) & 1U && strcmp(bucket_keys[i], key) == 0)
+            m |= 1U << i;
+    }
+    return m;
+}
+
+#define oa_cuckoo_uint64_hash(key) oa_fmix64(key)
+#define oa_cuckoo_uint32_hash(key) oa_fmix64((uint64_t)(key))
+#define oa_cuckoo_str_hash(key) oa_fmix64(oa_hash_string64(key))
+
+#define OA_CUCKOO_TYPE(name, key_t, value_t)                                              \
+    typedef struct {                                                                      \
+        OaHashInt slot_size;                                                              \
+        OaHashInt size;                                                                   \
+        OaHashInt bucket_num;                                                             \
+        OaHashInt upper_limit;                                                            \
+        OaFlagsInt *flags;                                                                \
+        key_t *keys;                                                                      \
+        value_t *values;                                                                  \
+    } OaHash##name;
+
+#define OA_CUCKOO_DEFINE_METHOD(name, SCOPE, key_t, value_t,                              \
+        hash_func, bucket_match, copy_key, need_free_key, key_format, value_format, is_map) \
+    SCOPE void                                                                            \
+    oa_##name##_alloc_slots(OaHash##name *h, OaHashInt bucket_num) {                      \
+        h->bucket_num = bucket_num;                                                       \
+        h->slot_size = bucket_num * CUCKOO_BUCKET_WAYS;                                   \
+        h->size = 0;                                                                      \
+        h->upper_limit = calc_cuckoo_upper_limit(h->slot_size);                           \
+        h->keys = oa_cuckoo_alloc(h->slot_size * sizeof(key_t));                          \
+        if(is_map)                                                                        \
+            h->values = oa_cuckoo_alloc(h->slot_size * sizeof(value_t));                  \
+        else                                                                              \
+            h->values = NULL;                                                             \
+        size_t num = calc_flags_byte_num(h->slot_size);                                   \
+        h->flags = malloc(num);                                                           \
+        assert(h->flags);                                                                 \
+        clear_flags(h->flags, num);                                                       \
+    }                                                                                     \
+    SCOPE OaHash##name *                                                                  \
+    oa_##name##_new() {                                                                   \
+        OaHash##name *h = malloc(sizeof(OaHash##name));                                   \
+        oa_##name##_alloc_slots(h, CUCKOO_BUCKET_INIT_NUM);                               \
+        return h;                                                                         \
+    }                                                                                     \
+    SCOPE void                                                                            \
+    oa_##name##_print(OaHash##name *h) {                                                  \
+        printf("slot_size:%"PRIu32"\n", h->slot_size);                                    \
+        printf("bucket_num:%"PRIu32"\n", h->bucket_num);                                  \
+        printf("size:%"PRIu32"\n", h->size);                                              \
+        for(OaHashInt i = 0;i < h->slot_size;i++) {                                       \
+            if(!IS_EXIST(h->flags, i))                                                    \
+                continue;                                                                 \
+            if(is_map)                                                                    \
+                printf("bucket:%"PRIu32",idx:%"PRIu32",key:%"key_format",value:%"value_format"\n", \
+                    i / CUCKOO_BUCKET_WAYS, i, h->keys[i], h->values[i]);                 \
+            else                                                                          \
+                printf("bucket:%"PRIu32",idx:%"PRIu32",key:%"key_format"\n",              \
+                    i / CUCKOO_BUCKET_WAYS, i, h->keys[i]);                               \
+        }                                                                                 \
+    }                                                                                     \
+    SCOPE void                                                                            \
+    oa_##name##_free_keys(OaHash##name *h) {                                              \
+        if(need_free_key) {                                                               \
+            for(OaHashInt i = 0;i < h->slot_size;i++) {                                   \
+                if(IS_EXIST(h->flags, i))                                                 \
+                    free((void *)(uintptr_t)h->keys[i]);                                  \
+            }                                                                             \
+        }                                                                                 \
+    }                                                                                     \
+    SCOPE void                                                                            \
+    oa_##name##_free(OaHash##name *h) {                                                   \
+        if(h) {                                                                           \
+            oa_##name##_free_keys(h);                                                     \
+            free(h->keys);                                                                \
+            free(h->values);                                                              \
+            free(h->flags);                                                               \
+            free(h);                                                                      \
+        }                                                                                 \
+    }                                                                                     \
+    SCOPE OaHashInt                                                                       \
+    oa_##name##_find(OaHash##name *h, key_t key, uint64_t hash) {                         \
+        OaHashInt b1, b2;                                                                 \
+        oa_cuckoo_buckets(hash, h->bucket_num, &b1, &b2);                                 \
+        unsigned m = bucket_match(h->keys + b1 * CUCKOO_BUCKET_WAYS, key,                 \
+            oa_cuckoo_exist_mask(h->flags, b1));                                          \
+        if(m)                                                                             \
+            return b1 * CUCKOO_BUCKET_WAYS + (OaHashInt)__builtin_ctz(m);                 \
+        m = bucket_match(h->keys + b2 * CUCKOO_BUCKET_WAYS, key,                          \
+            oa_cuckoo_exist_mask(h->flags, b2));                                          \
+        if(m)                                                                             \
+            return b2 * CUCKOO_BUCKET_WAYS + (OaHashInt)__builtin_ctz(m);                 \
+        return h->slot_size;                                                              \
+    }                                                                                     \
+    SCOPE void                                                                            \
+    oa_##name##_move(OaHash##name *h, OaHashInt from, OaHashInt to) {                     \
+        h->keys[to] = h->keys[from];                                                      \
+        if(is_map)                                                                        \
+            h->values[to] = h->values[from];                                              \
+        SET_EXIST(h->flags, to);                                                          \
+        SET_DEL(h->flags, from);                                                          \
+    }                                                                                     \
+    /* returns the free slot the key can be written to, or slot_size */                   \
+    SCOPE OaHashInt                                                                       \
+    oa_##name##_make_room(OaHash##name *h, uint64_t hash) {                               \
+        OaCuckooBfsNode nodes[CUCKOO_BFS_MAX_NODES];                                      \
+        int head = 0, tail = 0;                                                           \
+        OaHashInt b1, b2;                                                                 \
+        oa_cuckoo_buckets(hash, h->bucket_num, &b1, &b2);                                 \
+        nodes[tail++] = (OaCuckooBfsNode){b1, -1, 0};                                     \
+        nodes[tail++] = (OaCuckooBfsNode){b2, -1, 0};                                     \
+        while(head < tail) {                                                              \
+            OaHashInt bucket = nodes[head].bucket;                                        \
+            unsigned exist = oa_cuckoo_exist_mask(h->flags, bucket);                      \
+            if(exist != 0xfU) {                                                           \
+                OaHashInt free_slot = bucket * CUCKOO_BUCKET_WAYS                         \
+                    + (OaHashInt)__builtin_ctz(~exist & 0xfU);                            \
+                for(int n = head;nodes[n].parent >= 0;n = nodes[n].parent) {              \
+                    OaHashInt from = nodes[nodes[n].parent].bucket * CUCKOO_BUCKET_WAYS   \
+                        + nodes[n].slot;                                                  \
+                    oa_##name##_move(h, from, free_slot);                                 \
+                    free_slot = from;                                                     \
+                }                                                                         \
+                return free_slot;                                                         \
+            }                                                                             \
+            for(OaHashInt i = 0;i < CUCKOO_BUCKET_WAYS;i++) {                             \
+                if(tail >= CUCKOO_BFS_MAX_NODES)                                          \
+                    break;                                                                \
+                OaHashInt kb1, kb2;                                                       \
+                oa_cuckoo_buckets(hash_func(h->keys[bucket * CUCKOO_BUCKET_WAYS + i]),    \
+                    h->bucket_num, &kb1, &kb2);                                           \
+                OaHashInt alt = kb1 == bucket ? kb2 : kb1;                                \
+                bool on_path = false;                                                     \
+                for(int n = head;n >= 0;n = nodes[n].parent) {                            \
+                    if(nodes[n].bucket == alt) {                                          \
+                        on_path = true;                                                   \
+                        break;                                                            \
+                    }                                                                     \
+                }                                                                         \
+                if(!on_path)                                                              \
+                    nodes[tail++] = (OaCuckooBfsNode){alt, head, i};                      \
+            }                                                                             \
+            head++;                                                                       \
+        }                                                                                 \
+        return h->slot_size;                                                              \
+    }                                                                                     \
+    SCOPE void                                                                            \
+    oa_##name##_rehash(OaHash##name *h, OaHashInt new_bucket_num) {                       \
+        OaHash##name old = *h;                                                            \
+        while(true) {                                                                     \
+            oa_##name##_alloc_slots(h, new_bucket_num);                                   \
+            OaHashInt i = 0;                                                              \
+            for(;i < old.slot_size;i++) {                                                 \
+                if(!IS_EXIST(old.flags, i))                                               \
+                    continue;                                                             \
+                OaHashInt slot_idx = oa_##name##_make_room(h, hash_func(old.keys[i]));    \
+                if(slot_idx == h->slot_size)                                              \
+                    break;                                                                \
+                h->keys[slot_idx] = old.keys[i];                                          \
+                if(is_map)                                                                \
+                    h->values[slot_idx] = old.values[i];                                  \
+                SET_EXIST(h->flags, slot_idx);                                            \
+                h->size++;                                                                \
+            }                                                                             \
+            if(i == old.slot_size)                                                        \
+                break;                                                                    \
+            free(h->keys);                                                                \
+            free(h->values);                                                              \
+            free(h->flags);                                                               \
+            new_bucket_num <<= 1U;                                                        \
+        }                                                                                 \
+        free(old.keys);                                                                   \
+        free(old.values);                                                                 \
+        free(old.flags);                                                                  \
+    }                                                                                     \
+    SCOPE OaHashInt                                                                       \
+    oa_##name##_add_key(OaHash##name *h, key_t key) {                                     \
+        uint64_t hash = hash_func(key);                                                   \
+        OaHashInt slot_idx = oa_##name##_find(h, key, hash);                              \
+        if(slot_idx != h->slot_size)                                                      \
+            return slot_idx;                                                              \
+        while(true) {                                                                     \
+            if(h->size < h->upper_limit) {                                                \
+                slot_idx = oa_##name##_make_room(h, hash);                                \
+                if(slot_idx != h->slot_size)                                              \
+                    break;                                                                \
+            }                                                                             \
+            if(h->bucket_num > (UINT32_MAX / CUCKOO_BUCKET_WAYS >> 1U))                   \
+                return h->slot_size;                                                      \
+            oa_##name##_rehash(h, h->bucket_num << 1U);                                   \
+        }                                                                                 \
+        h->keys[slot_idx] = copy_key(key);                                                \
+        SET_EXIST(h->flags, slot_idx);                                                    \
+        h->size++;                                                                        \
+        return slot_idx;                                                                  \
+    }                                                                                     \
+    SCOPE bool                                                                            \
+    oa_##name##_map_add(OaHash##name *h, key_t key, value_t value) {                      \
+        assert(is_map);                                                                   \
+        OaHashInt slot_idx = oa_##name##_add_key(h, key);                                 \
+        if(slot_idx == h->slot_size)                                                      \
+            return false;                                                                 \
+        h->values[slot_idx] = value;                                                      \
+        return true;                                                                      \
+    }                                                                                     \
+    SCOPE bool                                                                            \
+    oa_##name##_set_add(OaHash##name *h, key_t key) {                                     \
+        assert(!is_map);                                                                  \
+        OaHashInt slot_idx = oa_##name##_add_key(h, key);                                 \
+        if(slot_idx == h->slot_size)                                                      \
+            return false;                                                                 \
+        return true;                                                                      \
+    }                                                                                     \
+    SCOPE OaHashInt                                                                       \
+    oa_##name##_get(OaHash##name *h, key_t key) {                                         \
+        return oa_##name##_find(h, key, hash_func(key));                                  \
+    }                                                                                     \
+    SCOPE void                                                                            \
+    oa_##name##_delete(OaHash##name *h, key_t key) {                                      \
+        OaHashInt slot_idx = oa_##name##_find(h, key, hash_func(key));                    \
+        if(slot_idx == h->slot_size)                                                      \
+            return;                                                                       \
+        if(need_free_key)                                                                 \
+            free((void *)(uintptr_t)h->keys[slot_idx]);                                   \
+        SET_DEL(h->flags, slot_idx);                                                      \
+        --h->size;                                                                        \
+    }                                                                                     \
+    SCOPE void                                                                            \
+    oa_##name##_clear(OaHash##name *h) {                                                  \
+        if(h && h->flags) {                                                               \
+            oa_##name##_free_keys(h);                                                     \
+            clear_flags(h->flags, calc_flags_byte_num(h->slot_size));                     \
+            h->size = 0;                                                                  \
+        }                                                                                 \
+    }                                                                                     \
+
+#define OA_CUCKOO_MAP_INIT_UINT64(name, value_t, value_format)                            \
+    OA_CUCKOO_TYPE(name, uint64_t, value_t)                                               \
+    OA_CUCKOO_DEFINE_METHOD(name, static inline, uint64_t, value_t,                       \
+        oa_cuckoo_uint64_hash, oa_cuckoo_match_uint64, oa_copy_uint_key, false, PRIu64, value_format, true) \
+
+#define OA_CUCKOO_SET_INIT_UINT64(name)                                                   \
+    OA_CUCKOO_TYPE(name, uint64_t, uint8_t)                                               \
+    OA_CUCKOO_DEFINE_METHOD(name, static inline, uint64_t, uint8_t,                       \
+        oa_cuckoo_uint64_hash, oa_cuckoo_match_uint64, oa_copy_uint_key, false, PRIu64, "c", false) \
+
+#define OA_CUCKOO_MAP_INIT_UINT32(name, value_t, value_format)                            \
+    OA_CUCKOO_TYPE(name, uint32_t, value_t)                                               \
+    OA_CUCKOO_DEFINE_METHOD(name, static inline, uint32_t, value_t,                       \
+        oa_cuckoo_uint32_hash, oa_cuckoo_match_uint32, oa_copy_uint_key, false, PRIu32, value_format, true) \
+
+#define OA_CUCKOO_SET_INIT_UINT32(name)                                                   \
+    OA_CUCKOO_TYPE(name, uint32_t, uint8_t)                                               \
+    OA_CUCKOO_DEFINE_METHOD(name, static inline, uint32_t, uint8_t,                       \
+        oa_cuckoo_uint32_hash, oa_cuckoo_match_uint32, oa_copy_uint_key, false, PRIu32, "c", false) \
+
+#define OA_CUCKOO_MAP_INIT_STR(name, value_t, value_format)                               \
+    OA_CUCKOO_TYPE(name, OaStrKey, value_t)                                               \
+    OA_CUCKOO_DEFINE_METHOD(name, static inline, OaStrKey, value_t,                       \
+        oa_cuckoo_str_hash, oa_cuckoo_match_str, oa_copy_str_key, true, "s", value_format, true) \
+
+#define OA_CUCKOO_SET_INIT_STR(name)                                                      \
+    OA_CUCKOO_TYPE(name, OaStrKey, uint8_t)                                               \
+    OA_CUCKOO_DEFINE_METHOD(name, static inline, OaStrKey, uint8_t,                       \
+        oa_cuckoo_str_hash, oa_cuckoo_match_str, oa_copy_str_key, true, "s", "c", false)  \
+
+#endif
@@ -0,0 +1,703 @@
+#ifndef __OA_FLAT_MAP_HPP__
+#define __OA_FLAT_MAP_HPP__
+
+/*
+ * Header only C++17 front end to the open address tables.
+ *
+ * oa::flat_map and oa::flat_set keep the layout and probing of oa_hash.h:
+ * power of two slots, keys and values in two parallel arrays, two flag
+ * bits per slot packed into 32-bit words (empty, deleted), triangular
+ * probing, and a rehash once live plus deleted slots reach
+ * slot_size * max_load. Hash and Eq are plain functors the compiler can
+ * inline, keys and values are moved in and constructed in place, so any
+ * nothrow movable type works. Trivially copyable keys and values skip
+ * the per slot constructors and destructors at compile time.
+ *
+ * Unlike the C tables an erase never shrinks, so erasing while iterating
+ * is safe, shrink_to_fit() gives the memory back. Any insert may rehash
+ * and invalidates iterators and references.
+ */
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace oa {
+
+namespace detail {
+
+using flags_int = uint32_t;
+
+constexpr uint32_t slot_init_num = 4U;
+constexpr float default_max_load = 0.77f;
+constexpr uint32_t max_slot_num = 1U << 31U;
+
+constexpr size_t word_idx(size_t i) { return i >> 4U; }
+constexpr uint32_t bit_idx(size_t i) { return static_cast<uint32_t>(i & 0xFU) << 1U; }
+constexpr size_t flags_word_num(size_t slot_size) { return word_idx(slot_size - 1) + 1; }
+
+inline bool is_empty(const flags_int *flags, size_t i) { return (flags[word_idx(i)] >> bit_idx(i)) & 2U; }
+inline bool is_del(const flags_int *flags, size_t i) { return (flags[word_idx(i)] >> bit_idx(i)) & 1U; }
+inline bool is_exist(const flags_int *flags, size_t i) { return !((flags[word_idx(i)] >> bit_idx(i)) & 3U); }
+inline void set_del(flags_int *flags, size_t i) { flags[word_idx(i)] |= 1U << bit_idx(i); }
+inline void set_exist(flags_int *flags, size_t i) { flags[word_idx(i)] &= ~(3U << bit_idx(i)); }
+
+/* calc_upper_limit of oa_hash.h, at least one empty slot is always kept */
+constexpr uint32_t upper_limit(uint32_t slot_size, float max_load) {
+    uint32_t limit = static_cast<uint32_t>(slot_size * static_cast<double>(max_load) + 0.5);
+    return limit < slot_size ? limit : slot_size - 1;
+}
+
+/* oa_fmix64 */
+constexpr uint64_t fmix64(uint64_t key) {
+    key ^= key >> 33U;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33U;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33U;
+    return key;
+}
+
+/* oa_hash_string64 over a view, FNV-1a 64 bits wide */
+constexpr uint64_t fnv1a64(std::string_view s) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(char c : s) {
+        h ^= static_cast<uint64_t>(static_cast<unsigned char>(c));
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+template<class T, class = void>
+struct is_transparent : std::false_type {};
+template<class T>
+struct is_transparent<T, std::void_t<typename T::is_transparent>> : std::true_type {};
+
+template<class Hash, class Eq>
+constexpr bool transparent_v = is_transparent<Hash>::value && is_transparent<Eq>::value;
+
+struct no_value {};
+
+/* what *it gives for a map, the key and value live in different arrays */
+template<class K, class V>
+struct pair_ref {
+    const K &first;
+    V &second;
+};
+
+template<class R>
+struct arrow_proxy {
+    R ref;
+    R *operator->() { return &ref; }
+};
+
+template<class K, class V, class Hash, class Eq, class Alloc, bool IsMap>
+class table {
+    static_assert(std::is_nothrow_move_constructible_v<K>, "keys are moved on rehash");
+    static_assert(std::is_nothrow_move_constructible_v<V>, "values are moved on rehash");
+
+protected:
+    using key_alloc = typename std::allocator_traits<Alloc>::template rebind_alloc<K>;
+    using value_alloc = typename std::allocator_traits<Alloc>::template rebind_alloc<V>;
+    using flags_alloc = typename std::allocator_traits<Alloc>::template rebind_alloc<flags_int>;
+    using key_traits = std::allocator_traits<key_alloc>;
+    using value_traits = std::allocator_traits<value_alloc>;
+    using flags_traits = std::allocator_traits<flags_alloc>;
+
+    static constexpr bool trivial_key = std::is_trivially_copyable_v<K>;
+    static constexpr bool trivial_value = !IsMap || std::is_trivially_copyable_v<V>;
+
+public:
+    using key_type = K;
+    using size_type = size_t;
+    using difference_type = ptrdiff_t;
+    using hasher = Hash;
+    using key_equal = Eq;
+    using allocator_type = Alloc;
+
+    template<bool Const>
+    class basic_iterator {
+        friend class table;
+        template<bool> friend class basic_iterator;
+        using owner = std::conditional_t<Const, const table, table>;
+        using mapped = std::conditional_t<Const, const V, V>;
+
+        owner *t_ = nullptr;
+        uint32_t i_ = 0;
+
+        basic_iterator(owner *t, uint32_t i) : t_(t), i_(i) {}
+        void skip() {
+            while(i_ < t_->slot_size_ && !is_exist(t_->flags_, i_))
+                i_++;
+        }
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using difference_type = ptrdiff_t;
+        using value_type = std::conditional_t<IsMap, std::pair<K, V>, K>;
+        using reference = std::conditional_t<IsMap, pair_ref<K, mapped>, const K &>;
+        using pointer = std::conditional_t<IsMap, arrow_proxy<reference>, const K *>;
+
+        basic_iterator() = default;
+        template<bool C = Const, class = std::enable_if_t<C>>
+        basic_iterator(const basic_iterator<false> &other) : t_(other.t_), i_(other.i_) {}
+
+        reference operator*() const {
+            if constexpr(IsMap)
+                return reference{t_->keys_[i_], t_->values_[i_]};
+            else
+                return t_->keys_[i_];
+        }
+        pointer operator->() const {
+            if constexpr(IsMap)
+                return pointer{**this};
+            else
+                return &t_->keys_[i_];
+        }
+        basic_iterator &operator++() {
+            i_++;
+            skip();
+            return *this;
+        }
+        basic_iterator operator++(int) {
+            basic_iterator old = *this;
+            ++*this;
+            return old;
+        }
+        bool operator==(const basic_iterator &other) const { return i_ == other.i_; }
+        bool operator!=(const basic_iterator &other) const { return i_ != other.i_; }
+        /* the slot, as oa_hash_get returns it */
+        uint32_t index() const { return i_; }
+    };
+    using iterator = basic_iterator<false>;
+    using const_iterator = basic_iterator<true>;
+
+    explicit table(size_t n = 0, const Hash &hash = Hash(), const Eq &eq = Eq(),
+            const Alloc &alloc = Alloc())
+        : hash_(hash), eq_(eq), key_alloc_(alloc), value_alloc_(alloc), flags_alloc_(alloc) {
+        alloc_slots(slot_size_for(n));
+    }
+
+    table(const table &other)
+        : max_load_(other.max_load_), hash_(other.hash_), eq_(other.eq_),
+          key_alloc_(key_traits::select_on_container_copy_construction(other.key_alloc_)),
+          value_alloc_(value_traits::select_on_container_copy_construction(other.value_alloc_)),
+          flags_alloc_(flags_traits::select_on_container_copy_construction(other.flags_alloc_)) {
+        alloc_slots(other.slot_size_ ? other.slot_size_ : slot_init_num);
+        try {
+            if(other.size_)
+                copy_slots(other);
+        }
+        catch(...) {
+            free_slots();
+            throw;
+        }
+    }
+
+    /* the source is left empty with no slots, the next insert allocates them */
+    table(table &&other) noexcept
+        : slot_size_(other.slot_size_), size_(other.size_), occupied_size_(other.occupied_size_),
+          upper_limit_(other.upper_limit_), max_load_(other.max_load_),
+          flags_(other.flags_), keys_(other.keys_), values_(other.values_),
+          hash_(std::move(other.hash_)), eq_(std::move(other.eq_)),
+          key_alloc_(std::move(other.key_alloc_)), value_alloc_(std::move(other.value_alloc_)),
+          flags_alloc_(std::move(other.flags_alloc_)) {
+        other.forget_slots();
+    }
+
+    table &operator=(const table &other) {
+        if(this != &other) {
+            table tmp(other);
+            swap(tmp);
+        }
+        return *this;
+    }
+
+    table &operator=(table &&other) noexcept {
+        if(this != &other) {
+            free_slots();
+            slot_size_ = other.slot_size_;
+            size_ = other.size_;
+            occupied_size_ = other.occupied_size_;
+            upper_limit_ = other.upper_limit_;
+            max_load_ = other.max_load_;
+            flags_ = other.flags_;
+            keys_ = other.keys_;
+            values_ = other.values_;
+            hash_ = std::move(other.hash_);
+            eq_ = std::move(other.eq_);
+            key_alloc_ = std::move(other.key_alloc_);
+            value_alloc_ = std::move(other.value_alloc_);
+            flags_alloc_ = std::move(other.flags_alloc_);
+            other.forget_slots();
+        }
+        return *this;
+    }
+
+    ~table() { free_slots(); }
+
+    void swap(table &other) noexcept {
+        using std::swap;
+        swap(slot_size_, other.slot_size_);
+        swap(size_, other.size_);
+        swap(occupied_size_, other.occupied_size_);
+        swap(upper_limit_, other.upper_limit_);
+        swap(max_load_, other.max_load_);
+        swap(flags_, other.flags_);
+        swap(keys_, other.keys_);
+        swap(values_, other.values_);
+        swap(hash_, other.hash_);
+        swap(eq_, other.eq_);
+        swap(key_alloc_, other.key_alloc_);
+        swap(value_alloc_, other.value_alloc_);
+        swap(flags_alloc_, other.flags_alloc_);
+    }
+
+    iterator begin() { iterator it(this, 0); it.skip(); return it; }
+    const_iterator begin() const { const_iterator it(this, 0); it.skip(); return it; }
+    const_iterator cbegin() const { return begin(); }
+    iterator end() { return iterator(this, slot_size_); }
+    const_iterator end() const { return const_iterator(this, slot_size_); }
+    const_iterator cend() const { return end(); }
+
+    bool empty() const { return size_ == 0; }
+    size_t size() const { return size_; }
+    size_t slot_count() const { return slot_size_; }
+    float load_factor() const { return slot_size_ ? static_cast<float>(size_) / slot_size_ : 0.0f; }
+    float max_load_factor() const { return max_load_; }
+    void max_load_factor(float max_load) {
+        max_load_ = max_load;
+        if(slot_size_)
+            upper_limit_ = upper_limit(slot_size_, max_load_);
+    }
+    hasher hash_function() const { return hash_; }
+    key_equal key_eq() const { return eq_; }
+    allocator_type get_allocator() const { return allocator_type(key_alloc_); }
+
+    iterator find(const K &key) { return iterator(this, find_index(key)); }
+    const_iterator find(const K &key) const { return const_iterator(this, find_index(key)); }
+    bool contains(const K &key) const { return find_index(key) != slot_size_; }
+    size_t count(const K &key) const { return contains(key) ? 1 : 0; }
+
+    /* for a transparent Hash and Eq, e.g. a std::string_view against std::string keys */
+    template<class Q, class H = Hash, class E = Eq, class = std::enable_if_t<transparent_v<H, E>>>
+    iterator find(const Q &key) { return iterator(this, find_index(key)); }
+    template<class Q, class H = Hash, class E = Eq, class = std::enable_if_t<transparent_v<H, E>>>
+    const_iterator find(const Q &key) const { return const_iterator(this, find_index(key)); }
+    template<class Q, class H = Hash, class E = Eq, class = std::enable_if_t<transparent_v<H, E>>>
+    bool contains(const Q &key) const { return find_index(key) != slot_size_; }
+    template<class Q, class H = Hash, class E = Eq, class = std::enable_if_t<transparent_v<H, E>>>
+    size_t count(const Q &key) const { return contains(key) ? 1 : 0; }
+
+    size_t erase(const K &key) { return erase_index(find_index(key)); }
+    /* as std, an iterator argument is never taken for a key */
+    template<class Q, class H = Hash, class E = Eq,
+            class = std::enable_if_t<transparent_v<H, E> && !std::is_convertible_v<const Q &, const_iterator>>>
+    size_t erase(const Q &key) { return erase_index(find_index(key)); }
+    iterator erase(const_iterator pos) {
+        iterator it(this, pos.i_);
+        erase_index(pos.i_);
+        return ++it;
+    }
+    iterator erase(iterator pos) { return erase(const_iterator(pos)); }
+    /* keeps the slots, as oa_hash_clear does */
+    void clear() {
+        destroy_slots();
+        if(slot_size_)
+            std::memset(flags_, 0xaa, flags_word_num(slot_size_) * sizeof(flags_int));
+        size_ = 0;
+        occupied_size_ = 0;
+    }
+
+    /* room for n entries without another rehash */
+    void reserve(size_t n) {
+        uint32_t new_num = slot_size_for(n);
+        if(new_num > slot_size_)
+            rehash_slots(new_num);
+    }
+    /* at least n slots and enough for the current size, may shrink */
+    void rehash(size_t n) {
+        uint32_t new_num = slot_size_for(size_);
+        while(new_num < n && new_num < max_slot_num)
+            new_num <<= 1U;
+        if(new_num != slot_size_)
+            rehash_slots(new_num);
+    }
+    void shrink_to_fit() { rehash(0); }
+
+protected:
+    uint32_t slot_size_ = 0;
+    uint32_t size_ = 0;
+    uint32_t occupied_size_ = 0;
+    uint32_t upper_limit_ = 0;
+    float max_load_ = default_max_load;
+    flags_int *flags_ = nullptr;
+    K *keys_ = nullptr;
+    V *values_ = nullptr;
+    Hash hash_;
+    Eq eq_;
+    key_alloc key_alloc_;
+    value_alloc value_alloc_;
+    flags_alloc flags_alloc_;
+
+    uint32_t slot_size_for(size_t n) const {
+        uint32_t new_num = slot_init_num;
+        while(upper_limit(new_num, max_load_) < n) {
+            if(new_num == max_slot_num)
+                throw std::length_error("oa::flat_map too large");
+            new_num <<= 1U;
+        }
+        return new_num;
+    }
+
+    iterator iterator_at(uint32_t slot_idx) { return iterator(this, slot_idx); }
+
+    template<class Q>
+    uint32_t find_index(const Q &key) const {
+        if(!size_)
+            return slot_size_;
+        uint32_t mask = slot_size_ - 1;
+        uint32_t slot_idx = static_cast<uint32_t>(hash_(key)) & mask;
+        uint32_t step = 0;
+        while(!is_empty(flags_, slot_idx)
+                && (is_del(flags_, slot_idx) || !eq_(keys_[slot_idx], key)))
+            slot_idx = (slot_idx + (++step)) & mask;
+        return is_exist(flags_, slot_idx) ? slot_idx : slot_size_;
+    }
+
+    /*
+     * The slot of key and true when it was added. The key is only
+     * converted to K and the value only constructed when the key is new.
+     */
+    template<class KArg, class... Args>
+    std::pair<uint32_t, bool> emplace_index(KArg &&key, Args &&...args) {
+        if(occupied_size_ >= upper_limit_)
+            make_room();
+        uint32_t mask = slot_size_ - 1;
+        uint32_t slot_idx = static_cast<uint32_t>(hash_(key)) & mask;
+        uint32_t del_idx = slot_size_;
+        uint32_t step = 0;
+        while(!is_empty(flags_, slot_idx)) {
+            if(is_del(flags_, slot_idx)) {
+                if(del_idx == slot_size_)
+                    del_idx = slot_idx;
+            }
+            else if(eq_(keys_[slot_idx], key)) {
+                return {slot_idx, false};
+            }
+            slot_idx = (slot_idx + (++step)) & mask;
+        }
+        if(del_idx != slot_size_)
+            slot_idx = del_idx;
+        key_traits::construct(key_alloc_, keys_ + slot_idx, std::forward<KArg>(key));
+        if constexpr(IsMap) {
+            try {
+                value_traits::construct(value_alloc_, values_ + slot_idx, std::forward<Args>(args)...);
+            }
+            catch(...) {
+                key_traits::destroy(key_alloc_, keys_ + slot_idx);
+                throw;
+            }
+        }
+        if(del_idx == slot_size_)
+            occupied_size_++;
+        set_exist(flags_, slot_idx);
+        size_++;
+        return {slot_idx, true};
+    }
+
+    size_t erase_index(uint32_t slot_idx) {
+        if(slot_idx == slot_size_)
+            return 0;
+        destroy_slot(slot_idx);
+        set_del(flags_, slot_idx);
+        size_--;
+        return 1;
+    }
+
+    void destroy_slot(uint32_t i) {
+        if constexpr(!std::is_trivially_destructible_v<K>)
+            key_traits::destroy(key_alloc_, keys_ + i);
+        if constexpr(IsMap && !std::is_trivially_destructible_v<V>)
+            value_traits::destroy(value_alloc_, values_ + i);
+    }
+
+    void destroy_slots() {
+        if constexpr(!std::is_trivially_destructible_v<K> || (IsMap && !std::is_trivially_destructible_v<V>)) {
+            for(uint32_t i = 0;i < slot_size_;i++) {
+                if(is_exist(flags_, i))
+                    destroy_slot(i);
+            }
+        }
+    }
+
+    void alloc_slots(uint32_t slot_size) {
+        size_t words = flags_word_num(slot_size);
+        flags_ = flags_traits::allocate(flags_alloc_, words);
+        std::memset(flags_, 0xaa, words * sizeof(flags_int));
+        keys_ = key_traits::allocate(key_alloc_, slot_size);
+        if constexpr(IsMap)
+            values_ = value_traits::allocate(value_alloc_, slot_size);
+        slot_size_ = slot_size;
+        size_ = 0;
+        occupied_size_ = 0;
+        upper_limit_ = upper_limit(slot_size, max_load_);
+    }
+
+    void free_slots() {
+        if(!slot_size_)
+            return;
+        destroy_slots();
+        flags_traits::deallocate(flags_alloc_, flags_, flags_word_num(slot_size_));
+        key_traits::deallocate(key_alloc_, keys_, slot_size_);
+        if constexpr(IsMap)
+            value_traits::deallocate(value_alloc_, values_, slot_size_);
+        forget_slots();
+    }
+
+    void forget_slots() {
+        slot_size_ = size_ = occupied_size_ = upper_limit_ = 0;
+        flags_ = nullptr;
+        keys_ = nullptr;
+        values_ = nullptr;
+    }
+
+    /* the arrays of a trivially copyable table go over in one memcpy each */
+    void copy_slots(const table &other) {
+        if constexpr(trivial_key && trivial_value) {
+            std::memcpy(flags_, other.flags_, flags_word_num(slot_size_) * sizeof(flags_int));
+            std::memcpy(keys_, other.keys_, slot_size_ * sizeof(K));
+            if constexpr(IsMap)
+                std::memcpy(values_, other.values_, slot_size_ * sizeof(V));
+            size_ = other.size_;
+            occupied_size_ = other.occupied_size_;
+        }
+        else {
+            for(uint32_t i = 0;i < other.slot_size_;i++) {
+                // same slots, so deleted ones stay deleted to keep the probe chains
+                if(is_del(other.flags_, i)) {
+                    set_exist(flags_, i);
+                    set_del(flags_, i);
+                }
+                if(!is_exist(other.flags_, i))
+                    continue;
+                key_traits::construct(key_alloc_, keys_ + i, other.keys_[i]);
+                if constexpr(IsMap) {
+                    try {
+                        value_traits::construct(value_alloc_, values_ + i, other.values_[i]);
+                    }
+                    catch(...) {
+                        key_traits::destroy(key_alloc_, keys_ + i);
+                        throw;
+                    }
+                }
+                set_exist(flags_, i);
+                size_++;
+            }
+            occupied_size_ = other.occupied_size_;
+        }
+    }
+
+    /* oa_##name##_expand, grows when at least half full and otherwise drops the deleted slots */
+    void make_room() {
+        if(!slot_size_) {
+            alloc_slots(slot_init_num);
+            return;
+        }
+        uint32_t new_num = slot_size_;
+        if(size_ >= (slot_size_ >> 1U) || size_ >= upper_limit_ / 3U * 2U) {
+            if(new_num == max_slot_num)
+                throw std::length_error("oa::flat_map too large");
+            new_num <<= 1U;
+        }
+        rehash_slots(new_num);
+    }
+
+    void rehash_slots(uint32_t new_num) {
+        flags_int *old_flags = flags_;
+        K *old_keys = keys_;
+        V *old_values = values_;
+        uint32_t old_num = slot_size_;
+        uint32_t size = size_;
+        alloc_slots(new_num);
+        uint32_t mask = new_num - 1;
+        for(uint32_t i = 0;i < old_num;i++) {
+            if(!is_exist(old_flags, i))
+                continue;
+            uint32_t slot_idx = static_cast<uint32_t>(hash_(old_keys[i])) & mask;
+            uint32_t step = 0;
+            while(!is_empty(flags_, slot_idx))
+                slot_idx = (slot_idx + (++step)) & mask;
+            if constexpr(trivial_key) {
+                std::memcpy(static_cast<void *>(keys_ + slot_idx), old_keys + i, sizeof(K));
+            }
+            else {
+                key_traits::construct(key_alloc_, keys_ + slot_idx, std::move(old_keys[i]));
+                key_traits::destroy(key_alloc_, old_keys + i);
+            }
+            if constexpr(IsMap && trivial_value) {
+                std::memcpy(static_cast<void *>(values_ + slot_idx), old_values + i, sizeof(V));
+            }
+            else if constexpr(IsMap) {
+                value_traits::construct(value_alloc_, values_ + slot_idx, std::move(old_values[i]));
+                value_traits::destroy(value_alloc_, old_values + i);
+            }
+            set_exist(flags_, slot_idx);
+        }
+        size_ = occupied_size_ = size;
+        if(old_num) {
+            flags_traits::deallocate(flags_alloc_, old_flags, flags_word_num(old_num));
+            key_traits::deallocate(key_alloc_, old_keys, old_num);
+            if constexpr(IsMap)
+                value_traits::deallocate(value_alloc_, old_values, old_num);
+        }
+    }
+};
+
+} // namespace detail
+
+/* integers go through fmix64, the low bits index the table */
+template<class K, class = void>
+struct hash : std::hash<K> {};
+
+template<class K>
+struct hash<K, std::enable_if_t<std::is_integral_v<K> || std::is_enum_v<K>>> {
+    constexpr size_t operator()(K key) const noexcept {
+        return static_cast<size_t>(detail::fmix64(static_cast<uint64_t>(key)));
+    }
+};
+
+/* transparent, std::string, std::string_view and C strings hash alike */
+struct string_hash {
+    using is_transparent = void;
+    constexpr size_t operator()(std::string_view s) const noexcept {
+        return static_cast<size_t>(detail::fnv1a64(s));
+    }
+};
+
+template<>
+struct hash<std::string> : string_hash {};
+template<>
+struct hash<std::string_view> : string_hash {};
+
+template<class K, class V, class Hash = oa::hash<K>, class Eq = std::equal_to<>,
+        class Alloc = std::allocator<std::pair<const K, V>>>
+class flat_map : public detail::table<K, V, Hash, Eq, Alloc, true> {
+    using base = detail::table<K, V, Hash, Eq, Alloc, true>;
+
+public:
+    using mapped_type = V;
+    using value_type = std::pair<K, V>;
+    using typename base::iterator;
+    using typename base::const_iterator;
+    using base::base;
+
+    template<class... Args>
+    std::pair<iterator, bool> try_emplace(const K &key, Args &&...args) {
+        return wrap(this->emplace_index(key, std::forward<Args>(args)...));
+    }
+    template<class... Args>
+    std::pair<iterator, bool> try_emplace(K &&key, Args &&...args) {
+        return wrap(this->emplace_index(std::move(key), std::forward<Args>(args)...));
+    }
+    /* the key and the arguments of the value, unlike std the value is not built on a hit */
+    template<class KArg, class... Args>
+    std::pair<iterator, bool> emplace(KArg &&key, Args &&...args) {
+        if constexpr(std::is_same_v<std::decay_t<KArg>, K>)
+            return try_emplace(std::forward<KArg>(key), std::forward<Args>(args)...);
+        else
+            return try_emplace(K(std::forward<KArg>(key)), std::forward<Args>(args)...);
+    }
+    std::pair<iterator, bool> insert(const value_type &kv) { return try_emplace(kv.first, kv.second); }
+    std::pair<iterator, bool> insert(value_type &&kv) {
+        return try_emplace(std::move(kv.first), std::move(kv.second));
+    }
+    template<class M>
+    std::pair<iterator, bool> insert_or_assign(const K &key, M &&obj) {
+        auto ret = wrap(this->emplace_index(key, std::forward<M>(obj)));
+        if(!ret.second)
+            ret.first->second = std::forward<M>(obj);
+        return ret;
+    }
+    template<class M>
+    std::pair<iterator, bool> insert_or_assign(K &&key, M &&obj) {
+        auto ret = wrap(this->emplace_index(std::move(key), std::forward<M>(obj)));
+        if(!ret.second)
+            ret.first->second = std::forward<M>(obj);
+        return ret;
+    }
+
+    /* the slot first, the insert may move the values */
+    V &operator[](const K &key) {
+        uint32_t slot_idx = this->emplace_index(key).first;
+        return this->values_[slot_idx];
+    }
+    V &operator[](K &&key) {
+        uint32_t slot_idx = this->emplace_index(std::move(key)).first;
+        return this->values_[slot_idx];
+    }
+
+    V &at(const K &key) { return this->values_[checked(this->find_index(key))]; }
+    const V &at(const K &key) const { return this->values_[checked(this->find_index(key))]; }
+    template<class Q, class H = Hash, class E = Eq,
+            class = std::enable_if_t<detail::transparent_v<H, E>>>
+    V &at(const Q &key) { return this->values_[checked(this->find_index(key))]; }
+    template<class Q, class H = Hash, class E = Eq,
+            class = std::enable_if_t<detail::transparent_v<H, E>>>
+    const V &at(const Q &key) const { return this->values_[checked(this->find_index(key))]; }
+
+    void swap(flat_map &other) noexcept { base::swap(other); }
+
+private:
+    std::pair<iterator, bool> wrap(std::pair<uint32_t, bool> ret) {
+        return {this->iterator_at(ret.first), ret.second};
+    }
+    uint32_t checked(uint32_t slot_idx) const {
+        if(slot_idx == this->slot_size_)
+            throw std::out_of_range("oa::flat_map::at");
+        return slot_idx;
+    }
+};
+
+template<class K, class Hash = oa::hash<K>, class Eq = std::equal_to<>, class Alloc = std::allocator<K>>
+class flat_set : public detail::table<K, detail::no_value, Hash, Eq, Alloc, false> {
+    using base = detail::table<K, detail::no_value, Hash, Eq, Alloc, false>;
+
+public:
+    using value_type = K;
+    using typename base::iterator;
+    using typename base::const_iterator;
+    using base::base;
+
+    std::pair<iterator, bool> insert(const K &key) { return wrap(this->emplace_index(key)); }
+    std::pair<iterator, bool> insert(K &&key) { return wrap(this->emplace_index(std::move(key))); }
+    template<class... Args>
+    std::pair<iterator, bool> emplace(Args &&...args) {
+        return wrap(this->emplace_index(K(std::forward<Args>(args)...)));
+    }
+
+    void swap(flat_set &other) noexcept { base::swap(other); }
+
+private:
+    std::pair<iterator, bool> wrap(std::pair<uint32_t, bool> ret) {
+        return {this->iterator_at(ret.first), ret.second};
+    }
+};
+
+template<class K, class V, class H, class E, class A>
+void swap(flat_map<K, V, H, E, A> &a, flat_map<K, V, H, E, A> &b) noexcept { a.swap(b); }
+
+template<class K, class H, class E, class A>
+void swap(flat_set<K, H, E, A> &a, flat_set<K, H, E, A> &b) noexcept { a.swap(b); }
+
+} // namespace oa
+
+#endif
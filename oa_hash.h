@@ -10,11 +10,17 @@
 #include <inttypes.h>
 #include <string.h>
 
+#include "bloom.h"
+#include "oa_cow.h"
+#include "latency.h"
+
 typedef uint32_t OaHashInt;
 typedef uint32_t OaFlagsInt;
 typedef const char *OaStrKey;
 
 #define SLOT_INIT_NUM 4
+#define OA_FULL_FAIL 0
+#define OA_FULL_EVICT 1
 
 #define WORD_IDX(i) ((i) >> 4U)
 #define BIT_IDX(i) (0xFU & (i))
@@ -23,8 +29,129 @@ typedef const char *OaStrKey;
 #define SET_EXIST(flags, i) CLEAR_BOTH_DEL_EMPTY(flags, i)
 #define IS_DEL_OR_EMPTY(flags, i) ((flags[WORD_IDX(i)] >> (BIT_IDX(i) << 1U)) & 3U)
 #define IS_EXIST(flags, i) (!IS_DEL_OR_EMPTY(flags, i))
+#define IS_EMPTY(flags, i) ((flags[WORD_IDX(i)] >> (BIT_IDX(i) << 1U)) & 2U)
+#define IS_DEL(flags, i) ((flags[WORD_IDX(i)] >> (BIT_IDX(i) << 1U)) & 1U)
+
+typedef struct {
+    double max_load;            // grow or compact once occupied slots reach slot_size * max_load
+    double min_load;            // shrink once size drops to slot_size * min_load, 0 never shrinks
+    double grow_factor;         // rounded up to a power of two
+    double shrink_hysteresis;   // a shrink leaves the load at most max_load * (1 - shrink_hysteresis)
+    size_t max_bytes;           // budget for the table structure, 0 is unlimited
+    int full_action;            // OA_FULL_FAIL or OA_FULL_EVICT once max_bytes is reached
+} OaResizePolicy;
+
+typedef struct {
+    OaHashInt size;
+    OaHashInt slot_size;
+    OaHashInt occupied_size;
+    double load_factor;
+    size_t bytes;
+    OaResizePolicy policy;
+} OaHashStats;
+
+static const OaResizePolicy oa_default_policy = {
+    0.77,           //max_load
+    0.125,          //min_load
+    2.0,            //grow_factor
+    0.5,            //shrink_hysteresis
+    0,              //max_bytes
+    OA_FULL_FAIL,   //full_action
+};
+
+/*
+ * What a plain table does without: allocated on first use, so the header
+ * is the sizes, the arrays and this pointer.
+ */
+typedef struct {
+    const OaResizePolicy *policy;
+    BloomFilter *bloom;
+    OaCow *cow;
+    OaHashInt *hashes;          // with store_hash, once the table is on the heap
+    OaHashInt evict_idx;
+    int lock;                   // taken by inserts of the atomic counters
+    LATENCY_FIELD               // only with -DHASH_LATENCY
+} OaHashExt;
+
+static inline OaHashExt *
+oa_ext_get(OaHashExt **ext) {
+    if(!*ext) {
+        *ext = (OaHashExt *)calloc(1, sizeof(OaHashExt));
+        assert(*ext);
+    }
+    return *ext;
+}
+
+/* oa_ext_get for threads racing to the first use */
+static inline OaHashExt *
+oa_ext_get_atomic(OaHashExt **ext) {
+    OaHashExt *cur = __atomic_load_n(ext, __ATOMIC_ACQUIRE);
+    if(!cur) {
+        OaHashExt *fresh = (OaHashExt *)calloc(1, sizeof(OaHashExt));
+        assert(fresh);
+        if(__atomic_compare_exchange_n(ext, &cur, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            cur = fresh;
+        else
+            free(fresh);
+    }
+    return cur;
+}
+
+/* the cow arrays own hashes when there are any */
+static inline void
+oa_ext_free(OaHashExt *ext) {
+    if(ext) {
+        if(ext->cow) {
+            oa_cow_free(ext->cow);
+            free(ext->cow);
+        }
+        else
+            free(ext->hashes);
+        bloom_free(ext->bloom);
+        LATENCY_FREE(ext);
+        free(ext);
+    }
+}
+
+#define oa_ext(h) oa_ext_get(&(h)->ext)
+#define oa_policy(h) ((h)->ext && (h)->ext->policy ? (h)->ext->policy : &oa_default_policy)
+#define oa_bloom(h) ((h)->ext ? (h)->ext->bloom : NULL)
+#define oa_cow(h) ((h)->ext ? (h)->ext->cow : NULL)
+
+/* at least one empty slot is always kept so probing terminates */
+static inline OaHashInt
+calc_upper_limit(OaHashInt slot_size, double max_load) {
+    OaHashInt limit = (OaHashInt)(slot_size * max_load + 0.5);
+    return limit < slot_size ? limit : slot_size - 1;
+}
+
+/* slots for the heap arrays of an inline table, with room for one more key */
+static inline OaHashInt
+calc_spill_num(OaHashInt size, double max_load) {
+    OaHashInt slot_size = SLOT_INIT_NUM;
+    while(calc_upper_limit(slot_size, max_load) <= size)
+        slot_size <<= 1U;
+    return slot_size;
+}
+#define OA_BATCH_SIZE 64U
+
+#define oa_free_owned_key(key) free((void *)(uintptr_t)(key))
+#define oa_free_borrowed_key(key) ((void)(key))
+#define oa_cow_realloc(h, area, p, bytes)                                                 \
+    (oa_cow(h) ? oa_cow_area_resize(&(h)->ext->cow->area, (bytes)) : realloc((p), (bytes)))
+
+/*
+ * Tables instantiated while OA_INLINE_NUM is a power of two up to 16 keep
+ * their first OA_INLINE_NUM entries in the header: no allocation besides
+ * the header, lookups scan the slots without hashing. The first key that
+ * does not fit moves them into hashed heap arrays, as do reserve, bloom
+ * and cow. An inline table must not be copied by value.
+ */
+#ifndef OA_INLINE_NUM
+#define OA_INLINE_NUM 0
+#endif
+#define oa_is_inline(h) (OA_INLINE_NUM && (h)->flags == (h)->inline_flags)
 
-#define calc_upper_limit(slot_size) (OaHashInt)((slot_size) * 0.77 + 0.5)
 #define calc_flags_byte_num(slot_size) (WORD_IDX((slot_size) - 1) + 1) * sizeof(OaFlagsInt)
 #define clear_flags(flags, byte_num) (memset((flags), 0xaa, (byte_num)))
 
@@ -34,13 +161,34 @@ typedef const char *OaStrKey;
         OaHashInt size;                                                                   \
         OaHashInt occupied_size;                                                          \
         OaHashInt upper_limit;                                                            \
+        OaHashExt *ext;                                                                   \
         OaFlagsInt *flags;                                                                \
         key_t *keys;                                                                      \
         value_t *values;                                                                  \
+        OaFlagsInt inline_flags[OA_INLINE_NUM ? 1 : 0];                                   \
+        key_t inline_keys[OA_INLINE_NUM];                                                 \
+        value_t inline_values[OA_INLINE_NUM];                                             \
     } OaHash##name;
 
-#define OA_HASH_DEFINE_METHOD(name, SCOPE, key_t, value_t,                                \
-        hash_func, hash_equal, copy_key, need_free_key, key_format, value_format, is_map) \
+/*
+ * OA_HASH_DEFINE_CORE takes how to free and print a key as callables, for
+ * keys that are neither integers nor owned C strings.
+ * With store_hash the full hash of every key is kept in hashes[], probes
+ * compare it before touching the key and a rehash never hashes again.
+ * Worth it only when hash_equal or hash_func has to chase a pointer.
+ */
+#define OA_HASH_DEFINE_METHOD(name, SCOPE, key_t, value_t, hash_func, hash_equal,         \
+        copy_key, need_free_key, key_format, value_format, is_map, store_hash)            \
+    SCOPE void                                                                            \
+    oa_##name##_print_key(key_t key) {                                                    \
+        printf("%"key_format, key);                                                       \
+    }                                                                                     \
+    OA_HASH_DEFINE_CORE(name, SCOPE, key_t, value_t, hash_func, hash_equal, copy_key,     \
+        need_free_key, oa_free_owned_key, oa_##name##_print_key, value_format, is_map,    \
+        store_hash)                                                                       \
+
+#define OA_HASH_DEFINE_CORE(name, SCOPE, key_t, value_t, hash_func, hash_equal, copy_key, \
+        need_free_key, free_key, print_key, value_format, is_map, store_hash)             \
     SCOPE OaFlagsInt *                                                                    \
     oa_##name##_init_flags(OaHashInt slot_size) {                                         \
         size_t num = calc_flags_byte_num(slot_size);                                      \
@@ -50,16 +198,30 @@ typedef const char *OaStrKey;
     }                                                                                     \
     SCOPE OaHash##name *                                                                  \
     oa_##name##_new() {                                                                   \
+        _Static_assert(OA_INLINE_NUM <= 16 && !(OA_INLINE_NUM & (OA_INLINE_NUM - 1)),     \
+            "OA_INLINE_NUM is 0 or a power of two up to 16");                             \
         OaHash##name *h = malloc(sizeof(OaHash##name));                                   \
         h->slot_size = SLOT_INIT_NUM;                                                     \
         h->size = 0;                                                                      \
         h->occupied_size = 0;                                                             \
-        h->upper_limit = calc_upper_limit(h->slot_size);                                  \
+        h->ext = NULL;                                                                    \
+        if(OA_INLINE_NUM) {                                                               \
+            h->slot_size = OA_INLINE_NUM;                                                 \
+            h->upper_limit = OA_INLINE_NUM;                                               \
+            h->keys = h->inline_keys;                                                     \
+            h->values = is_map ? h->inline_values : NULL;                                 \
+            h->flags = h->inline_flags;                                                   \
+            clear_flags(h->flags, sizeof(OaFlagsInt));                                    \
+            return h;                                                                     \
+        }                                                                                 \
+        h->upper_limit = calc_upper_limit(h->slot_size, oa_default_policy.max_load);      \
         h->keys = calloc(h->slot_size, sizeof(key_t));                                    \
         if(is_map)                                                                        \
             h->values = calloc(h->slot_size, sizeof(value_t));                            \
         else                                                                              \
             h->values = NULL;                                                             \
+        if(store_hash)                                                                    \
+            oa_ext(h)->hashes = calloc(h->slot_size, sizeof(OaHashInt));                  \
         h->flags = oa_##name##_init_flags(h->slot_size);                                  \
         return h;                                                                         \
     }                                                                                     \
@@ -73,12 +235,11 @@ typedef const char *OaStrKey;
             printf(" %#x\n", h->flags[i]);                                                \
         }                                                                                 \
         for(OaHashInt i = 0;i < h->slot_size;i++) {                                       \
+            printf("idx:%"PRIu32",key:", i);                                              \
+            print_key(h->keys[i]);                                                        \
             if(is_map)                                                                    \
-                printf("idx:%"PRIu32",key:%"key_format",value:%"value_format",flag:%u\n", \
-                    i, h->keys[i], h->values[i], IS_EXIST(h->flags, i));                  \
-            else                                                                          \
-                printf("idx:%"PRIu32",key:%"key_format",flag:%u\n", \
-                    i, h->keys[i], IS_EXIST(h->flags, i));                  \
+                printf(",value:%"value_format, h->values[i]);                             \
+            printf(",flag:%u\n", IS_EXIST(h->flags, i));                                  \
         }                                                                                 \
     }                                                                                     \
     SCOPE void                                                                            \
@@ -89,25 +250,65 @@ typedef const char *OaStrKey;
                     if(IS_DEL_OR_EMPTY(h->flags, i)) {                                    \
                         continue;                                                         \
                     }                                                                     \
-                    free((void *)h->keys[i]);                                                     \
+                    free_key(h->keys[i]);                                                 \
                 }                                                                         \
             }                                                                             \
-            free(h->keys);                                                                \
-            free(h->values);                                                              \
+            if(!oa_cow(h) && !oa_is_inline(h)) {                                          \
+                free(h->keys);                                                            \
+                free(h->values);                                                          \
+                free(h->flags);                                                           \
+            }                                                                             \
+            oa_ext_free(h->ext);                                                          \
             free(h);                                                                      \
         }                                                                                 \
     }                                                                                     \
+    /* the header's slots move to the heap as they are, a rehash then hashes them */      \
+    SCOPE void                                                                            \
+    oa_##name##_spill(OaHash##name *h) {                                                  \
+        h->keys = memcpy(malloc(OA_INLINE_NUM * sizeof(key_t)), h->keys,                  \
+            OA_INLINE_NUM * sizeof(key_t));                                               \
+        if(is_map)                                                                        \
+            h->values = memcpy(malloc(OA_INLINE_NUM * sizeof(value_t)), h->values,        \
+                OA_INLINE_NUM * sizeof(value_t));                                         \
+        if(store_hash) {                                                                  \
+            OaHashInt *hashes = calloc(OA_INLINE_NUM, sizeof(OaHashInt));                 \
+            for(OaHashInt i = 0;i != OA_INLINE_NUM;i++) {                                 \
+                if(IS_EXIST(h->flags, i))                                                 \
+                    hashes[i] = hash_func(h->keys[i], 0U);                                \
+            }                                                                             \
+            oa_ext(h)->hashes = hashes;                                                   \
+        }                                                                                 \
+        h->flags = memcpy(malloc(sizeof(OaFlagsInt)), h->flags, sizeof(OaFlagsInt));      \
+    }                                                                                     \
     SCOPE void                                                                            \
     oa_##name##_rehash(OaHash##name *h, OaHashInt new_num) {                              \
+        LATENCY_BEGIN(start);                                                             \
+        if(oa_is_inline(h))                                                               \
+            oa_##name##_spill(h);                                                         \
         OaFlagsInt *new_flags = oa_##name##_init_flags(new_num);                          \
         assert(new_flags);                                                                \
+        if(oa_cow_live(oa_cow(h))) {                                                      \
+            OaCow *cow = h->ext->cow;                                                     \
+            oa_cow_detach(cow);                                                           \
+            h->keys = (key_t *)cow->keys.base;                                            \
+            h->values = is_map ? (value_t *)cow->values.base : NULL;                      \
+            h->ext->hashes = store_hash ? (OaHashInt *)cow->hashes.base : NULL;           \
+            h->flags = (OaFlagsInt *)cow->flags.base;                                     \
+        }                                                                                 \
+        BloomFilter *bloom = oa_bloom(h);                                                 \
+        if(bloom)                                                                         \
+            bloom_reset(bloom, calc_upper_limit(new_num, oa_policy(h)->max_load));        \
         if(new_num > h->slot_size) {                                                      \
-            h->keys = realloc(h->keys, new_num * sizeof(key_t));                          \
+            h->keys = oa_cow_realloc(h, keys, h->keys, new_num * sizeof(key_t));          \
             assert(h->keys);                                                              \
             if(is_map) {                                                                  \
-                h->values = realloc(h->values, new_num * sizeof(value_t));                \
+                h->values = oa_cow_realloc(h, values, h->values, new_num * sizeof(value_t)); \
                 assert(h->values);                                                        \
             }                                                                             \
+            if(store_hash) {                                                              \
+                h->ext->hashes = oa_cow_realloc(h, hashes, h->ext->hashes, new_num * sizeof(OaHashInt)); \
+                assert(h->ext->hashes);                                                   \
+            }                                                                             \
         }                                                                                 \
         for(OaHashInt i = 0;i < h->slot_size;i++) {                                       \
             if(IS_DEL_OR_EMPTY(h->flags, i)) {                                            \
@@ -117,9 +318,14 @@ typedef const char *OaStrKey;
             value_t old_value;                                                            \
             if(is_map)                                                                    \
                 old_value = h->values[i];                                                 \
+            OaHashInt hash = store_hash ? h->ext->hashes[i] : 0U;                         \
             SET_DEL(h->flags, i);                                                         \
             while(true) {                                                                 \
-                OaHashInt new_slot_idx = hash_func(old_key, new_num);                     \
+                if(!store_hash)                                                           \
+                    hash = hash_func(old_key, 0U);                                        \
+                OaHashInt new_slot_idx = hash & (new_num - 1);                            \
+                if(bloom)                                                                 \
+                    bloom_add(bloom, hash);                                               \
                 OaHashInt step = 0;                                                       \
                 while(IS_EXIST(new_flags, new_slot_idx)) {                                \
                     new_slot_idx = (new_slot_idx + (++step)) & (new_num - 1);             \
@@ -129,84 +335,244 @@ typedef const char *OaStrKey;
                     value_t tmp_value;                                                    \
                     if(is_map)                                                            \
                         tmp_value = h->values[new_slot_idx];                              \
+                    OaHashInt tmp_hash = store_hash ? h->ext->hashes[new_slot_idx] : 0U;  \
                     h->keys[new_slot_idx] = old_key;                                      \
                     if(is_map)                                                            \
                         h->values[new_slot_idx] = old_value;                              \
+                    if(store_hash)                                                        \
+                        h->ext->hashes[new_slot_idx] = hash;                              \
                     SET_DEL(h->flags, new_slot_idx);                                      \
                     SET_EXIST(new_flags, new_slot_idx);                                   \
                     old_key = tmp_key;                                                    \
                     if(is_map)                                                            \
                         old_value = tmp_value;                                            \
+                    hash = tmp_hash;                                                      \
                     continue;                                                             \
                 }                                                                         \
                 h->keys[new_slot_idx] = old_key;                                          \
                 if(is_map)                                                                \
                     h->values[new_slot_idx] = old_value;                                  \
+                if(store_hash)                                                            \
+                    h->ext->hashes[new_slot_idx] = hash;                                  \
                 SET_EXIST(new_flags, new_slot_idx);                                       \
                 break;                                                                    \
             }                                                                             \
         }                                                                                 \
         if(new_num < h->slot_size) {                                                      \
-            h->keys = realloc(h->keys, new_num * sizeof(key_t));                          \
+            h->keys = oa_cow_realloc(h, keys, h->keys, new_num * sizeof(key_t));          \
             if(is_map)                                                                    \
-                h->values = realloc(h->values,new_num * sizeof(value_t));                 \
+                h->values = oa_cow_realloc(h, values, h->values, new_num * sizeof(value_t)); \
+            if(store_hash)                                                                \
+                h->ext->hashes = oa_cow_realloc(h, hashes, h->ext->hashes, new_num * sizeof(OaHashInt)); \
         }                                                                                 \
-        free(h->flags);                                                                   \
-        h->flags = new_flags;                                                             \
+        if(oa_cow(h)) {                                                                   \
+            size_t num = calc_flags_byte_num(new_num);                                    \
+            h->flags = oa_cow_area_resize(&h->ext->cow->flags, num);                      \
+            memcpy(h->flags, new_flags, num);                                             \
+            free(new_flags);                                                              \
+        }                                                                                 \
+        else {                                                                            \
+            free(h->flags);                                                               \
+            h->flags = new_flags;                                                         \
+        }                                                                                 \
+        LATENCY_REHASH(oa_ext(h), start, h->slot_size, new_num, h->size);                 \
         h->slot_size = new_num;                                                           \
         h->occupied_size = h->size;                                                       \
-        h->upper_limit = calc_upper_limit(h->slot_size);                                  \
+        h->upper_limit = calc_upper_limit(h->slot_size, oa_policy(h)->max_load);          \
+        if(h->ext)                                                                        \
+            h->ext->evict_idx = 0;                                                        \
+    }                                                                                     \
+    SCOPE size_t                                                                          \
+    oa_##name##_bytes(OaHashInt slot_size) {                                              \
+        return sizeof(OaHash##name) + calc_flags_byte_num(slot_size)                      \
+            + (size_t)slot_size * (sizeof(key_t) + (is_map ? sizeof(value_t) : 0)         \
+            + (store_hash ? sizeof(OaHashInt) : 0));                                      \
     }                                                                                     \
+    /* a live snapshot may still read the key */                                          \
+    SCOPE void                                                                            \
+    oa_##name##_drop_key(OaHash##name *h, key_t key) {                                    \
+        if(oa_cow(h) && h->ext->cow->snapshot)                                            \
+            oa_cow_defer(h->ext->cow, &key, sizeof(key_t));                               \
+        else                                                                              \
+            free_key(key);                                                                \
+    }                                                                                     \
+    SCOPE void                                                                            \
+    oa_##name##_evict(OaHash##name *h, OaHashInt num) {                                   \
+        OaHashExt *ext = oa_ext(h);                                                       \
+        OaHashInt start = ext->evict_idx;                                                 \
+        for(OaHashInt n = 0;n < h->slot_size && num > 0 && h->size > 0;n++) {             \
+            OaHashInt i = (start + n) & (h->slot_size - 1);                               \
+            if(!IS_EXIST(h->flags, i))                                                    \
+                continue;                                                                 \
+            if(need_free_key)                                                             \
+                oa_##name##_drop_key(h, h->keys[i]);                                      \
+            oa_cow_touch(oa_cow(h), flags, &h->flags[WORD_IDX(i)], sizeof(OaFlagsInt));   \
+            SET_DEL(h->flags, i);                                                         \
+            --h->size;                                                                    \
+            --num;                                                                        \
+            ext->evict_idx = (i + 1) & (h->slot_size - 1);                                \
+        }                                                                                 \
+    }                                                                                     \
+    SCOPE OaHashInt oa_##name##_get(OaHash##name *h, key_t key);                          \
     SCOPE OaHashInt                                                                       \
-    oa_##name##_add_key(OaHash##name *h, key_t key) {                                     \
-        if(h->occupied_size >= h->upper_limit) {                                          \
-            if(h->size >= (h->slot_size >> 1U)) {                                         \
-                if(h->slot_size > (UINT32_MAX >> 1U)) {                                   \
-                    return h->slot_size;                                                  \
-                }                                                                         \
-                oa_##name##_rehash(h, h->slot_size << 1U);                                \
+    oa_##name##_inline_find(OaHash##name *h, key_t key) {                                 \
+        for(OaHashInt i = 0;i != OA_INLINE_NUM;i++) {                                     \
+            if(IS_EXIST(h->flags, i) && hash_equal(key, h->keys[i]))                      \
+                return i;                                                                 \
+        }                                                                                 \
+        return h->slot_size;                                                              \
+    }                                                                                     \
+    SCOPE OaHashInt                                                                       \
+    oa_##name##_inline_free(OaHash##name *h) {                                            \
+        for(OaHashInt i = 0;i != OA_INLINE_NUM;i++) {                                     \
+            if(IS_DEL_OR_EMPTY(h->flags, i))                                              \
+                return i;                                                                 \
+        }                                                                                 \
+        return h->slot_size;                                                              \
+    }                                                                                     \
+    /* slot_size once the header is full and key is not in it */                          \
+    SCOPE OaHashInt                                                                       \
+    oa_##name##_inline_add(OaHash##name *h, key_t key) {                                  \
+        OaHashInt slot_idx = oa_##name##_inline_find(h, key);                             \
+        if(slot_idx != h->slot_size)                                                      \
+            return slot_idx;                                                              \
+        slot_idx = oa_##name##_inline_free(h);                                            \
+        if(slot_idx == h->slot_size)                                                      \
+            return slot_idx;                                                              \
+        if(IS_EMPTY(h->flags, slot_idx))                                                  \
+            h->occupied_size++;                                                           \
+        h->keys[slot_idx] = copy_key(key);                                                \
+        SET_EXIST(h->flags, slot_idx);                                                    \
+        h->size++;                                                                        \
+        return slot_idx;                                                                  \
+    }                                                                                     \
+    /* the hash the wrappers hand down, none while the entries are in the header */       \
+    SCOPE OaHashInt                                                                       \
+    oa_##name##_probe_hash(OaHash##name *h, key_t key) {                                  \
+        return oa_is_inline(h) ? 0U : hash_func(key, 0U);                                 \
+    }                                                                                     \
+    /* the hash every *_with_hash call of this table type expects */                      \
+    SCOPE OaHashInt                                                                       \
+    oa_##name##_hash(key_t key) {                                                         \
+        return hash_func(key, 0U);                                                        \
+    }                                                                                     \
+    /* makes room for one more key, false when the budget forbids it */                   \
+    SCOPE bool                                                                            \
+    oa_##name##_expand(OaHash##name *h, key_t key) {                                      \
+        const OaResizePolicy *policy = oa_policy(h);                                      \
+        if(h->size >= (h->slot_size >> 1U) || h->size >= h->upper_limit / 3U * 2U) {      \
+            OaHashInt new_num = h->slot_size;                                             \
+            while(new_num <= (UINT32_MAX >> 1U) && new_num < h->slot_size * policy->grow_factor) \
+                new_num <<= 1U;                                                           \
+            if(new_num > h->slot_size                                                     \
+                    && (!policy->max_bytes || oa_##name##_bytes(new_num) <= policy->max_bytes)) { \
+                oa_##name##_rehash(h, new_num);                                           \
+                return true;                                                              \
             }                                                                             \
-            else {                                                                        \
-                oa_##name##_rehash(h, h->slot_size);                                      \
+        }                                                                                 \
+        if(h->size >= h->upper_limit) {                                                   \
+            if(oa_##name##_get(h, key) != h->slot_size)                                   \
+                return true;                                                              \
+            if(policy->full_action != OA_FULL_EVICT)                                      \
+                return false;                                                             \
+            oa_##name##_evict(h, (h->upper_limit >> 5U) + 1U);                            \
+        }                                                                                 \
+        oa_##name##_rehash(h, h->slot_size);                                              \
+        return true;                                                                      \
+    }                                                                                     \
+    SCOPE OaHashInt                                                                       \
+    oa_##name##_add_key_with_hash(OaHash##name *h, key_t key, OaHashInt hash) {           \
+        LATENCY_BEGIN(start);                                                             \
+        if(oa_is_inline(h)) {                                                             \
+            OaHashInt inline_idx = oa_##name##_inline_add(h, key);                        \
+            if(inline_idx != h->slot_size) {                                              \
+                LATENCY_END(oa_ext(h), add, start);                                       \
+                return inline_idx;                                                        \
+            }                                                                             \
+            oa_##name##_rehash(h, calc_spill_num(h->size, oa_policy(h)->max_load));       \
+            hash = hash_func(key, 0U);                                                    \
+        }                                                                                 \
+        if(h->occupied_size >= h->upper_limit) {                                          \
+            if(!oa_##name##_expand(h, key)) {                                             \
+                LATENCY_END(oa_ext(h), add, start);                                       \
+                return h->slot_size;                                                      \
             }                                                                             \
         }                                                                                 \
                                                                                           \
-        OaHashInt slot_idx = hash_func(key, h->slot_size);                                \
+        OaHashInt slot_idx = hash & (h->slot_size - 1);                                   \
+        OaHashInt del_idx = h->slot_size;                                                 \
         OaHashInt step = 0;                                                               \
-        while(IS_EXIST(h->flags, slot_idx) && !hash_equal(key, h->keys[slot_idx])) {      \
+        while(!IS_EMPTY(h->flags, slot_idx)) {                                            \
+            if(IS_DEL(h->flags, slot_idx)) {                                              \
+                if(del_idx == h->slot_size)                                               \
+                    del_idx = slot_idx;                                                   \
+            }                                                                             \
+            else if((!store_hash || h->ext->hashes[slot_idx] == hash)                     \
+                    && hash_equal(key, h->keys[slot_idx])) {                              \
+                break;                                                                    \
+            }                                                                             \
             slot_idx = (slot_idx + (++step)) & (h->slot_size - 1);                        \
         }                                                                                 \
-        bool is_key_exist = IS_EXIST(h->flags, slot_idx);                                 \
-        h->keys[slot_idx] = copy_key(key);                                                \
-        SET_EXIST(h->flags, slot_idx);                                                    \
-        if(!is_key_exist) {                                                               \
-            h->size++;                                                                    \
+        if(IS_EXIST(h->flags, slot_idx)) {                                                \
+            LATENCY_END(oa_ext(h), add, start);                                           \
+            return slot_idx;                                                              \
+        }                                                                                 \
+        if(del_idx != h->slot_size)                                                       \
+            slot_idx = del_idx;                                                           \
+        else                                                                              \
             h->occupied_size++;                                                           \
+        oa_cow_touch(oa_cow(h), keys, &h->keys[slot_idx], sizeof(key_t));                 \
+        oa_cow_touch(oa_cow(h), flags, &h->flags[WORD_IDX(slot_idx)], sizeof(OaFlagsInt)); \
+        h->keys[slot_idx] = copy_key(key);                                                \
+        if(store_hash) {                                                                  \
+            oa_cow_touch(oa_cow(h), hashes, &h->ext->hashes[slot_idx], sizeof(OaHashInt)); \
+            h->ext->hashes[slot_idx] = hash;                                              \
         }                                                                                 \
+        SET_EXIST(h->flags, slot_idx);                                                    \
+        h->size++;                                                                        \
+        if(oa_bloom(h))                                                                   \
+            bloom_add(h->ext->bloom, hash);                                               \
+        LATENCY_END(oa_ext(h), add, start);                                               \
         return slot_idx;                                                                  \
     }                                                                                     \
+    SCOPE OaHashInt                                                                       \
+    oa_##name##_add_key(OaHash##name *h, key_t key) {                                     \
+        return oa_##name##_add_key_with_hash(h, key, oa_##name##_probe_hash(h, key));     \
+    }                                                                                     \
     SCOPE bool                                                                            \
-    oa_##name##_map_add(OaHash##name *h, key_t key, value_t value) {                      \
+    oa_##name##_map_add_with_hash(OaHash##name *h, key_t key, value_t value, OaHashInt hash) { \
         assert(is_map);                                                                   \
-        OaHashInt slot_idx = oa_##name##_add_key(h, key);                                 \
+        OaHashInt slot_idx = oa_##name##_add_key_with_hash(h, key, hash);                 \
         if(slot_idx == h->slot_size)                                                      \
             return false;                                                                 \
+        oa_cow_touch(oa_cow(h), values, &h->values[slot_idx], sizeof(value_t));           \
         h->values[slot_idx] = value;                                                      \
         return true;                                                                      \
     }                                                                                     \
     SCOPE bool                                                                            \
-    oa_##name##_set_add(OaHash##name *h, key_t key) {                                     \
+    oa_##name##_map_add(OaHash##name *h, key_t key, value_t value) {                      \
+        return oa_##name##_map_add_with_hash(h, key, value, oa_##name##_probe_hash(h, key)); \
+    }                                                                                     \
+    SCOPE bool                                                                            \
+    oa_##name##_set_add_with_hash(OaHash##name *h, key_t key, OaHashInt hash) {           \
         assert(!is_map);                                                                  \
-        OaHashInt slot_idx = oa_##name##_add_key(h, key);                                 \
+        OaHashInt slot_idx = oa_##name##_add_key_with_hash(h, key, hash);                 \
         if(slot_idx == h->slot_size)                                                      \
             return false;                                                                 \
         return true;                                                                      \
     }                                                                                     \
+    SCOPE bool                                                                            \
+    oa_##name##_set_add(OaHash##name *h, key_t key) {                                     \
+        return oa_##name##_set_add_with_hash(h, key, oa_##name##_probe_hash(h, key));     \
+    }                                                                                     \
+    /* the probe of a heap table, without the bloom filter */                             \
     SCOPE OaHashInt                                                                       \
-    oa_##name##_get(OaHash##name *h, key_t key) {                                         \
-        OaHashInt slot_idx = hash_func(key, h->slot_size);                                \
+    oa_##name##_find(OaHash##name *h, key_t key, OaHashInt hash) {                        \
+        OaHashInt slot_idx = hash & (h->slot_size - 1);                                   \
         OaHashInt step = 0;                                                               \
-        while(IS_EXIST(h->flags, slot_idx) && !hash_equal(key, h->keys[slot_idx])) {      \
+        while(!IS_EMPTY(h->flags, slot_idx) && (IS_DEL(h->flags, slot_idx)                \
+                || (store_hash && h->ext->hashes[slot_idx] != hash)                       \
+                || !hash_equal(key, h->keys[slot_idx]))) {                                \
             slot_idx = (slot_idx + (++step)) & (h->slot_size - 1);                        \
         }                                                                                 \
         if(!IS_EXIST(h->flags, slot_idx)) {                                               \
@@ -214,27 +580,254 @@ typedef const char *OaStrKey;
         }                                                                                 \
         return slot_idx;                                                                  \
     }                                                                                     \
+    SCOPE OaHashInt                                                                       \
+    oa_##name##_get_with_hash(OaHash##name *h, key_t key, OaHashInt hash) {               \
+        if(oa_is_inline(h))                                                               \
+            return oa_##name##_inline_find(h, key);                                       \
+        if(oa_bloom(h) && !bloom_check(h->ext->bloom, hash))                              \
+            return h->slot_size;                                                          \
+        return oa_##name##_find(h, key, hash);                                            \
+    }                                                                                     \
+    SCOPE OaHashInt                                                                       \
+    oa_##name##_get(OaHash##name *h, key_t key) {                                         \
+        return oa_##name##_get_with_hash(h, key, oa_##name##_probe_hash(h, key));         \
+    }                                                                                     \
     SCOPE void                                                                            \
-    oa_##name##_delete(OaHash##name *h, key_t key) {                                      \
-        OaHashInt slot_idx = hash_func(key, h->slot_size);                                \
-        if(!IS_EXIST(h->flags, slot_idx))                                                 \
+    oa_##name##_shrink(OaHash##name *h) {                                                 \
+        const OaResizePolicy *policy = oa_policy(h);                                      \
+        double limit = policy->max_load * (1 - policy->shrink_hysteresis);                \
+        OaHashInt new_num = h->slot_size;                                                 \
+        while(new_num > SLOT_INIT_NUM && h->size <= (new_num >> 1U) * limit)              \
+            new_num >>= 1U;                                                               \
+        if(new_num != h->slot_size)                                                       \
+            oa_##name##_rehash(h, new_num);                                               \
+    }                                                                                     \
+    SCOPE void                                                                            \
+    oa_##name##_delete_with_hash(OaHash##name *h, key_t key, OaHashInt hash) {            \
+        LATENCY_BEGIN(start);                                                             \
+        OaHashInt slot_idx = oa_##name##_get_with_hash(h, key, hash);                     \
+        if(slot_idx == h->slot_size) {                                                    \
+            LATENCY_END(oa_ext(h), remove, start);                                        \
             return;                                                                       \
+        }                                                                                 \
+        if(need_free_key)                                                                 \
+            oa_##name##_drop_key(h, h->keys[slot_idx]);                                   \
+        oa_cow_touch(oa_cow(h), flags, &h->flags[WORD_IDX(slot_idx)], sizeof(OaFlagsInt)); \
         SET_DEL(h->flags, slot_idx);                                                      \
         --h->size;                                                                        \
-        OaHashInt shrink_limit = h->slot_size >> 3U;                                      \
-        if(shrink_limit > 0 && h->size <= shrink_limit)                                   \
-            oa_##name##_rehash(h, h->slot_size >> 1U);                                    \
+        if(!oa_is_inline(h) && h->size < h->slot_size * oa_policy(h)->min_load)           \
+            oa_##name##_shrink(h);                                                        \
+        LATENCY_END(oa_ext(h), remove, start);                                            \
+    }                                                                                     \
+    SCOPE void                                                                            \
+    oa_##name##_delete(OaHash##name *h, key_t key) {                                      \
+        oa_##name##_delete_with_hash(h, key, oa_##name##_probe_hash(h, key));             \
+    }                                                                                     \
+    /*                                                                                    \
+     * Deletes every key pred returns false for in one pass, then shrinks at most         \
+     * once. value is NULL for sets, pred must leave the table alone. Returns the         \
+     * number of keys deleted.                                                            \
+     */                                                                                   \
+    SCOPE OaHashInt                                                                       \
+    oa_##name##_retain(OaHash##name *h,                                                   \
+            bool (*pred)(key_t key, value_t *value, void *extra), void *extra) {          \
+        OaHashInt size = h->size;                                                         \
+        for(OaHashInt i = 0;i < h->slot_size;i++) {                                       \
+            if(!IS_EXIST(h->flags, i))                                                    \
+                continue;                                                                 \
+            if(pred(h->keys[i], is_map ? &h->values[i] : NULL, extra))                    \
+                continue;                                                                 \
+            if(need_free_key)                                                             \
+                oa_##name##_drop_key(h, h->keys[i]);                                      \
+            oa_cow_touch(oa_cow(h), flags, &h->flags[WORD_IDX(i)], sizeof(OaFlagsInt));   \
+            SET_DEL(h->flags, i);                                                         \
+            --h->size;                                                                    \
+        }                                                                                 \
+        if(!oa_is_inline(h) && h->size < h->slot_size * oa_policy(h)->min_load)           \
+            oa_##name##_shrink(h);                                                        \
+        return size - h->size;                                                            \
     }                                                                                     \
     SCOPE void                                                                            \
     oa_##name##_clear(OaHash##name *h) {                                                  \
         if(h && h->flags) {                                                               \
-            size_t num = calc_flags_byte_num(h->slot_size);                                   \
+            size_t num = calc_flags_byte_num(h->slot_size);                               \
+            oa_cow_touch(oa_cow(h), flags, h->flags, num);                                \
             clear_flags(h->flags, num);                                                   \
             h->size = 0;                                                                  \
             h->occupied_size = 0;                                                         \
+            if(oa_bloom(h))                                                               \
+                bloom_clear(h->ext->bloom);                                               \
+        }                                                                                 \
+    }                                                                                     \
+    SCOPE void                                                                            \
+    oa_##name##_enable_bloom(OaHash##name *h, uint32_t bits_per_key) {                    \
+        if(oa_is_inline(h))                                                               \
+            oa_##name##_rehash(h, calc_spill_num(h->size, oa_policy(h)->max_load));       \
+        OaHashExt *ext = oa_ext(h);                                                       \
+        bloom_free(ext->bloom);                                                           \
+        ext->bloom = bloom_new(h->upper_limit, bits_per_key);                             \
+        for(OaHashInt i = 0;i < h->slot_size;i++) {                                       \
+            if(IS_EXIST(h->flags, i))                                                     \
+                bloom_add(ext->bloom, store_hash ? ext->hashes[i] : hash_func(h->keys[i], 0U)); \
+        }                                                                                 \
+    }                                                                                     \
+    SCOPE void                                                                            \
+    oa_##name##_disable_bloom(OaHash##name *h) {                                          \
+        if(h->ext) {                                                                      \
+            bloom_free(h->ext->bloom);                                                    \
+            h->ext->bloom = NULL;                                                         \
+        }                                                                                 \
+    }                                                                                     \
+    /*                                                                                    \
+     * out[i] is the slot of keys[i], or slot_size. The keys the filter lets              \
+     * through have their first probe slot prefetched before any is probed.               \
+     */                                                                                   \
+    SCOPE void                                                                            \
+    oa_##name##_get_batch(OaHash##name *h, const key_t *keys, size_t n, OaHashInt *out) { \
+        uint64_t hashes[OA_BATCH_SIZE];                                                   \
+        bool maybe[OA_BATCH_SIZE];                                                        \
+        for(size_t base = 0;base < n;base += OA_BATCH_SIZE) {                             \
+            size_t num = n - base < OA_BATCH_SIZE ? n - base : OA_BATCH_SIZE;             \
+            if(oa_is_inline(h)) {                                                         \
+                for(size_t i = 0;i < num;i++)                                             \
+                    out[base + i] = oa_##name##_inline_find(h, keys[base + i]);           \
+                continue;                                                                 \
+            }                                                                             \
+            for(size_t i = 0;i < num;i++)                                                 \
+                hashes[i] = hash_func(keys[base + i], 0U);                                \
+            if(oa_bloom(h))                                                               \
+                bloom_check_batch(h->ext->bloom, hashes, num, maybe);                     \
+            else                                                                          \
+                memset(maybe, true, num);                                                 \
+            for(size_t i = 0;i < num;i++) {                                               \
+                OaHashInt slot_idx = (OaHashInt)hashes[i] & (h->slot_size - 1);           \
+                if(!maybe[i])                                                             \
+                    continue;                                                             \
+                __builtin_prefetch(&h->flags[WORD_IDX(slot_idx)]);                        \
+                if(store_hash)                                                            \
+                    __builtin_prefetch(&h->ext->hashes[slot_idx]);                        \
+                else                                                                      \
+                    __builtin_prefetch(&h->keys[slot_idx]);                               \
+            }                                                                             \
+            for(size_t i = 0;i < num;i++)                                                 \
+                out[base + i] = maybe[i] ? oa_##name##_find(h, keys[base + i], (OaHashInt)hashes[i]) \
+                    : h->slot_size;                                                       \
+        }                                                                                 \
+    }                                                                                     \
+    SCOPE void                                                                            \
+    oa_##name##_set_policy(OaHash##name *h, const OaResizePolicy *policy) {               \
+        assert(policy == NULL || (policy->max_load > 0 && policy->grow_factor > 1         \
+            && policy->min_load < policy->max_load));                                     \
+        oa_ext(h)->policy = policy;                                                       \
+        if(!oa_is_inline(h))                                                              \
+            h->upper_limit = calc_upper_limit(h->slot_size, oa_policy(h)->max_load);      \
+    }                                                                                     \
+    SCOPE void                                                                            \
+    oa_##name##_stats(OaHash##name *h, OaHashStats *stats) {                              \
+        stats->size = h->size;                                                            \
+        stats->slot_size = h->slot_size;                                                  \
+        stats->occupied_size = h->occupied_size;                                          \
+        stats->load_factor = (double)h->size / h->slot_size;                              \
+        stats->bytes = oa_is_inline(h) ? sizeof(OaHash##name)                             \
+            : oa_##name##_bytes(h->slot_size);                                            \
+        stats->policy = *oa_policy(h);                                                    \
+    }                                                                                     \
+    /* false when built without HASH_LATENCY */                                           \
+    SCOPE bool                                                                            \
+    oa_##name##_latency(OaHash##name *h, LatencyStats *stats) {                           \
+        return LATENCY_READ(oa_ext(h), stats);                                            \
+    }                                                                                     \
+    SCOPE void                                                                            \
+    oa_##name##_reset_latency(OaHash##name *h) {                                          \
+        LATENCY_RESET(oa_ext(h));                                                         \
+    }                                                                                     \
+    /* room for n keys without another rehash */                                          \
+    SCOPE void                                                                            \
+    oa_##name##_reserve(OaHash##name *h, OaHashInt n) {                                   \
+        OaHashInt new_num = h->slot_size;                                                 \
+        while(new_num <= (UINT32_MAX >> 1U)                                               \
+                && calc_upper_limit(new_num, oa_policy(h)->max_load) < n)                 \
+            new_num <<= 1U;                                                               \
+        if(new_num > h->slot_size)                                                        \
+            oa_##name##_rehash(h, new_num);                                               \
+    }                                                                                     \
+    /* moves the arrays onto memfd pages, false when the system has none */               \
+    SCOPE bool                                                                            \
+    oa_##name##_enable_cow(OaHash##name *h) {                                             \
+        if(oa_cow(h))                                                                     \
+            return true;                                                                  \
+        if(oa_is_inline(h))                                                               \
+            oa_##name##_rehash(h, calc_spill_num(h->size, oa_policy(h)->max_load));       \
+        size_t keys_bytes = (size_t)h->slot_size * sizeof(key_t);                         \
+        size_t values_bytes = is_map ? (size_t)h->slot_size * sizeof(value_t) : 0;        \
+        size_t hashes_bytes = store_hash ? (size_t)h->slot_size * sizeof(OaHashInt) : 0;  \
+        size_t flags_bytes = calc_flags_byte_num(h->slot_size);                           \
+        OaCow *cow = malloc(sizeof(OaCow));                                               \
+        if(!oa_cow_new(cow, keys_bytes, values_bytes, hashes_bytes, flags_bytes)) {       \
+            free(cow);                                                                    \
+            return false;                                                                 \
+        }                                                                                 \
+        memcpy(cow->keys.base, h->keys, keys_bytes);                                      \
+        free(h->keys);                                                                    \
+        h->keys = (key_t *)cow->keys.base;                                                \
+        if(is_map) {                                                                      \
+            memcpy(cow->values.base, h->values, values_bytes);                            \
+            free(h->values);                                                              \
+            h->values = (value_t *)cow->values.base;                                      \
+        }                                                                                 \
+        if(store_hash) {                                                                  \
+            memcpy(cow->hashes.base, h->ext->hashes, hashes_bytes);                       \
+            free(h->ext->hashes);                                                         \
+            h->ext->hashes = (OaHashInt *)cow->hashes.base;                               \
         }                                                                                 \
+        memcpy(cow->flags.base, h->flags, flags_bytes);                                   \
+        free(h->flags);                                                                   \
+        h->flags = (OaFlagsInt *)cow->flags.base;                                         \
+        oa_ext(h)->cow = cow;                                                             \
+        return true;                                                                      \
+    }                                                                                     \
+    /*                                                                                    \
+     * Read only view of the table as it is now, for the usual get and foreach.           \
+     * NULL unless cow is enabled and no other snapshot is live.                          \
+     */                                                                                   \
+    SCOPE OaHash##name *                                                                  \
+    oa_##name##_snapshot(OaHash##name *h) {                                               \
+        OaCow *cow = oa_cow(h);                                                           \
+        if(!cow || cow->snapshot || !oa_cow_share(cow))                                   \
+            return NULL;                                                                  \
+        OaHash##name *s = malloc(sizeof(OaHash##name));                                   \
+        *s = *h;                                                                          \
+        s->ext = NULL;                                                                    \
+        oa_ext(s)->policy = h->ext->policy;                                               \
+        s->ext->hashes = store_hash ? (OaHashInt *)cow->hashes.view : NULL;               \
+        s->keys = (key_t *)cow->keys.view;                                                \
+        s->values = is_map ? (value_t *)cow->values.view : NULL;                          \
+        s->flags = (OaFlagsInt *)cow->flags.view;                                         \
+        cow->snapshot = s;                                                                \
+        return s;                                                                         \
+    }                                                                                     \
+    SCOPE void                                                                            \
+    oa_##name##_release_snapshot(OaHash##name *h, OaHash##name *s) {                      \
+        OaCow *cow = oa_cow(h);                                                           \
+        assert(cow && cow->snapshot == s);                                                \
+        oa_cow_unshare(cow);                                                              \
+        for(size_t off = 0;need_free_key && off < cow->garbage_len;off += sizeof(key_t)) { \
+            key_t key;                                                                    \
+            memcpy(&key, cow->garbage + off, sizeof(key_t));                              \
+            free_key(key);                                                                \
+        }                                                                                 \
+        cow->garbage_len = 0;                                                             \
+        cow->snapshot = NULL;                                                             \
+        /* the hashes view belongs to cow */                                              \
+        LATENCY_FREE(s->ext);                                                             \
+        free(s->ext);                                                                     \
+        free(s);                                                                          \
     }                                                                                     \
 
+/*
+ * Hash functions all have the form h(key) & (slot_size - 1), passing 0U as
+ * slot_size yields the full 32-bit hash.
+ */
 #define oa_uint32_hash_func(key, slot_size) (((OaHashInt)(key)) & ((slot_size) - 1))
 #define oa_uint32_hash_equal(key1, key2) ((key1) == (key2))
 #define oa_uint64_hash_func(key, slot_size) (((OaHashInt)((key)>>33^(key)^(key)<<11)) & ((slot_size) - 1))
@@ -252,6 +845,28 @@ OaHashInt oa_hash_string(const char *s)
 #define oa_str_hash_func(key, slot_size) (oa_hash_string(key) & ((slot_size) - 1))
 #define oa_str_hash_equal(key1, key2) (strcmp(key1, key2) == 0)
 
+/* oa_hash_string of the first len bytes, which need no NUL */
+static inline OaHashInt
+oa_hash_string_len(const char *s, size_t len)
+{
+    OaHashInt h = 0;
+    if(len) {
+        h = (OaHashInt)*s;
+        for(size_t i = 1;i < len;i++)
+            h = (h << 5) - h + (OaHashInt)s[i];
+    }
+    return h;
+}
+
+/* str is NUL terminated, key is not, stops at the first difference or NUL */
+static inline bool
+oa_str_equal_len(const char *str, const char *key, size_t len) {
+    size_t i = 0;
+    while(i < len && str[i] && str[i] == key[i])
+        i++;
+    return i == len && str[len] == '\0';
+}
+
 static inline OaHashInt
 oa_Wang_hash_uint32(OaHashInt key)
 {
@@ -278,15 +893,69 @@ oa_Wang_hash_uint64(uint64_t key) {
 }
 #define oa_uint64_Wang_hash_func(key, slot_size) (oa_Wang_hash_uint64(key) & ((slot_size) - 1))
 
+/* murmur3 finalizer, every output bit depends on every input bit */
+static inline uint64_t
+oa_fmix64(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static inline uint64_t
+oa_fmix64_inverse(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0x9cb4b2f8129337dbULL;
+    key ^= key >> 33;
+    key *= 0x4f74430c22a54005ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+/* FNV-1a, 64 bits wide */
+static inline uint64_t
+oa_hash_string64(const char *s) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(;*s;++s) {
+        h ^= (uint64_t)(unsigned char)*s;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
 #define oa_hash_t(name) OaHash##name
 #define oa_hash_new(name) oa_##name##_new()
 #define oa_hash_free(name, h) oa_##name##_free(h)
 #define oa_hash_map_add(name, h, key, value) oa_##name##_map_add(h, key, value)
 #define oa_hash_set_add(name, h, key) oa_##name##_set_add(h, key)
 #define oa_hash_delete(name, h, key) oa_##name##_delete(h, key)
+#define oa_hash_retain(name, h, pred, extra) oa_##name##_retain(h, pred, extra)
 #define oa_hash_clear(name, h) oa_##name##_clear(h)
 #define oa_hash_print(name, h) oa_##name##_print(h)
 #define oa_hash_get(name, h, key) oa_##name##_get(h, key)
+#define oa_hash_get_len(name, h, key, len) oa_##name##_get_len(h, key, len)
+#define oa_hash_key_hash(name, key) oa_##name##_hash(key)
+#define oa_hash_get_with_hash(name, h, key, hash) oa_##name##_get_with_hash(h, key, hash)
+#define oa_hash_map_add_with_hash(name, h, key, value, hash) oa_##name##_map_add_with_hash(h, key, value, hash)
+#define oa_hash_set_add_with_hash(name, h, key, hash) oa_##name##_set_add_with_hash(h, key, hash)
+#define oa_hash_delete_with_hash(name, h, key, hash) oa_##name##_delete_with_hash(h, key, hash)
+#define oa_hash_map_add_len(name, h, key, len, value) oa_##name##_map_add_len(h, key, len, value)
+#define oa_hash_set_add_len(name, h, key, len) oa_##name##_set_add_len(h, key, len)
+#define oa_hash_set_policy(name, h, policy) oa_##name##_set_policy(h, policy)
+#define oa_hash_stats(name, h, stats) oa_##name##_stats(h, stats)
+#define oa_hash_latency(name, h, stats) oa_##name##_latency(h, stats)
+#define oa_hash_reset_latency(name, h) oa_##name##_reset_latency(h)
+#define oa_hash_enable_bloom(name, h, bits_per_key) oa_##name##_enable_bloom(h, bits_per_key)
+#define oa_hash_get_batch(name, h, keys, n, out) oa_##name##_get_batch(h, keys, n, out)
+#define oa_hash_reserve(name, h, n) oa_##name##_reserve(h, n)
+#define oa_hash_add_delta(name, h, key, delta) oa_##name##_add_delta(h, key, delta)
+#define oa_hash_atomic_add_delta(name, h, key, delta) oa_##name##_atomic_add_delta(h, key, delta)
+#define oa_hash_atomic_value(name, h, key) oa_##name##_atomic_value(h, key)
+#define oa_hash_enable_cow(name, h) oa_##name##_enable_cow(h)
+#define oa_hash_snapshot(name, h) oa_##name##_snapshot(h)
+#define oa_hash_release_snapshot(name, h, s) oa_##name##_release_snapshot(h, s)
 #define oa_hash_begin(h) (OaHashInt)0U
 #define oa_hash_end(h) ((h)->slot_size)
 #define oa_hash_key(h, i) ((h)->keys[i])
@@ -322,51 +991,740 @@ oa_copy_str_key(const char *key) {
 #define OA_MAP_INIT_UINT64(name, value_t, value_format)                                   \
     OA_HASH_TYPE(name, uint64_t, value_t)                                                 \
     OA_HASH_DEFINE_METHOD(name, static inline, uint64_t, value_t,                         \
-        oa_uint64_hash_func, oa_uint64_hash_equal, oa_copy_uint_key, false, PRIu64, value_format, true)            \
+        oa_uint64_hash_func, oa_uint64_hash_equal, oa_copy_uint_key, false, PRIu64, value_format, true, false) \
 
 #define OA_SET_INIT_UINT64(name)                                                          \
     OA_HASH_TYPE(name, uint64_t, uint8_t)                                                 \
     OA_HASH_DEFINE_METHOD(name, static inline, uint64_t, uint8_t,                         \
-        oa_uint64_hash_func, oa_uint64_hash_equal, oa_copy_uint_key, false, PRIu64, "c", false)                    \
+        oa_uint64_hash_func, oa_uint64_hash_equal, oa_copy_uint_key, false, PRIu64, "c", false, false) \
 
 #define OA_MAP_INIT_UINT64_WANG_HASH(name, value_t, value_format)                                   \
     OA_HASH_TYPE(name, uint64_t, value_t)                                                 \
     OA_HASH_DEFINE_METHOD(name, static inline, uint64_t, value_t,                         \
-        oa_uint64_Wang_hash_func, oa_uint64_hash_equal, oa_copy_uint_key, false, PRIu64, value_format, true)            \
+        oa_uint64_Wang_hash_func, oa_uint64_hash_equal, oa_copy_uint_key, false, PRIu64, value_format, true, false) \
 
 #define OA_SET_INIT_UINT64_WANG_HASH(name)                                                          \
     OA_HASH_TYPE(name, uint64_t, uint8_t)                                                 \
     OA_HASH_DEFINE_METHOD(name, static inline, uint64_t, uint8_t,                         \
-        oa_uint64_Wang_hash_func, oa_uint64_hash_equal, oa_copy_uint_key, false, PRIu64, "c", false)                    \
+        oa_uint64_Wang_hash_func, oa_uint64_hash_equal, oa_copy_uint_key, false, PRIu64, "c", false, false) \
 
 #define OA_MAP_INIT_UINT32(name, value_t, value_format)                                   \
     OA_HASH_TYPE(name, uint32_t, value_t)                                                 \
     OA_HASH_DEFINE_METHOD(name, static inline, uint32_t, value_t,                         \
-        oa_uint32_hash_func, oa_uint32_hash_equal, oa_copy_uint_key, false, PRIu32, value_format, true)            \
+        oa_uint32_hash_func, oa_uint32_hash_equal, oa_copy_uint_key, false, PRIu32, value_format, true, false) \
 
 #define OA_SET_INIT_UINT32(name)                                                          \
     OA_HASH_TYPE(name, uint32_t, uint8_t)                                                 \
     OA_HASH_DEFINE_METHOD(name, static inline, uint32_t, uint8_t,                         \
-        oa_uint32_hash_func, oa_uint32_hash_equal, oa_copy_uint_key, false, PRIu32, "c", false)                    \
+        oa_uint32_hash_func, oa_uint32_hash_equal, oa_copy_uint_key, false, PRIu32, "c", false, false) \
 
 #define OA_MAP_INIT_UINT32_WANG_HASH(name, value_t, value_format)                                   \
     OA_HASH_TYPE(name, uint32_t, value_t)                                                 \
     OA_HASH_DEFINE_METHOD(name, static inline, uint32_t, value_t,                         \
-        oa_uint32_Wang_hash_func, oa_uint32_hash_equal, oa_copy_uint_key, false, PRIu32, value_format, true)            \
+        oa_uint32_Wang_hash_func, oa_uint32_hash_equal, oa_copy_uint_key, false, PRIu32, value_format, true, false) \
 
 #define OA_SET_INIT_UINT32_WANG_HASH(name)                                                          \
     OA_HASH_TYPE(name, uint32_t, uint8_t)                                                 \
     OA_HASH_DEFINE_METHOD(name, static inline, uint32_t, uint8_t,                         \
-        oa_uint32_Wang_hash_func, oa_uint32_hash_equal, oa_copy_uint_key, false, PRIu32, "c", false)                    \
+        oa_uint32_Wang_hash_func, oa_uint32_hash_equal, oa_copy_uint_key, false, PRIu32, "c", false, false) \
+
+/*
+ * Lookup and insert for C string tables with the key given as pointer and
+ * length, e.g. straight out of a network buffer. A NUL terminated copy is
+ * made only when the key is new.
+ */
+#define OA_STR_DEFINE_LEN_METHOD(name, SCOPE, value_t, is_map)                            \
+    SCOPE OaHashInt                                                                       \
+    oa_##name##_find_len(OaHash##name *h, const char *key, size_t len, OaHashInt hash) {  \
+        if(oa_is_inline(h)) {                                                             \
+            for(OaHashInt i = 0;i != OA_INLINE_NUM;i++) {                                 \
+                if(IS_EXIST(h->flags, i) && oa_str_equal_len(h->keys[i], key, len))       \
+                    return i;                                                             \
+            }                                                                             \
+            return h->slot_size;                                                          \
+        }                                                                                 \
+        OaHashInt slot_idx = hash & (h->slot_size - 1);                                   \
+        OaHashInt step = 0;                                                               \
+        while(!IS_EMPTY(h->flags, slot_idx) && (IS_DEL(h->flags, slot_idx)                \
+                || h->ext->hashes[slot_idx] != hash                                       \
+                || !oa_str_equal_len(h->keys[slot_idx], key, len))) {                     \
+            slot_idx = (slot_idx + (++step)) & (h->slot_size - 1);                        \
+        }                                                                                 \
+        return IS_EXIST(h->flags, slot_idx) ? slot_idx : h->slot_size;                    \
+    }                                                                                     \
+    SCOPE OaHashInt                                                                       \
+    oa_##name##_get_len(OaHash##name *h, const char *key, size_t len) {                   \
+        if(oa_is_inline(h))                                                               \
+            return oa_##name##_find_len(h, key, len, 0U);                                 \
+        OaHashInt hash = oa_hash_string_len(key, len);                                    \
+        if(oa_bloom(h) && !bloom_check(h->ext->bloom, hash))                              \
+            return h->slot_size;                                                          \
+        return oa_##name##_find_len(h, key, len, hash);                                   \
+    }                                                                                     \
+    SCOPE OaHashInt                                                                       \
+    oa_##name##_add_key_len(OaHash##name *h, const char *key, size_t len) {               \
+        LATENCY_BEGIN(start);                                                             \
+        OaHashInt hash = oa_hash_string_len(key, len);                                    \
+        OaHashInt slot_idx = oa_##name##_find_len(h, key, len, hash);                     \
+        if(slot_idx != h->slot_size) {                                                    \
+            LATENCY_END(oa_ext(h), add, start);                                           \
+            return slot_idx;                                                              \
+        }                                                                                 \
+        char *new_key = malloc(len + 1);                                                  \
+        memcpy(new_key, key, len);                                                        \
+        new_key[len] = '\0';                                                              \
+        if(oa_is_inline(h)) {                                                             \
+            slot_idx = oa_##name##_inline_free(h);                                        \
+            if(slot_idx == h->slot_size)                                                  \
+                oa_##name##_rehash(h, calc_spill_num(h->size, oa_policy(h)->max_load));   \
+        }                                                                                 \
+        if(!oa_is_inline(h)) {                                                            \
+            if(h->occupied_size >= h->upper_limit && !oa_##name##_expand(h, new_key)) {   \
+                free(new_key);                                                            \
+                LATENCY_END(oa_ext(h), add, start);                                       \
+                return h->slot_size;                                                      \
+            }                                                                             \
+            slot_idx = hash & (h->slot_size - 1);                                         \
+            OaHashInt step = 0;                                                           \
+            while(IS_EXIST(h->flags, slot_idx))                                           \
+                slot_idx = (slot_idx + (++step)) & (h->slot_size - 1);                    \
+            oa_cow_touch(oa_cow(h), hashes, &h->ext->hashes[slot_idx], sizeof(OaHashInt)); \
+            h->ext->hashes[slot_idx] = hash;                                              \
+        }                                                                                 \
+        if(IS_EMPTY(h->flags, slot_idx))                                                  \
+            h->occupied_size++;                                                           \
+        oa_cow_touch(oa_cow(h), keys, &h->keys[slot_idx], sizeof(OaStrKey));              \
+        oa_cow_touch(oa_cow(h), flags, &h->flags[WORD_IDX(slot_idx)], sizeof(OaFlagsInt)); \
+        h->keys[slot_idx] = new_key;                                                      \
+        SET_EXIST(h->flags, slot_idx);                                                    \
+        h->size++;                                                                        \
+        if(oa_bloom(h))                                                                   \
+            bloom_add(h->ext->bloom, hash);                                               \
+        LATENCY_END(oa_ext(h), add, start);                                               \
+        return slot_idx;                                                                  \
+    }                                                                                     \
+    SCOPE bool                                                                            \
+    oa_##name##_map_add_len(OaHash##name *h, const char *key, size_t len, value_t value) { \
+        assert(is_map);                                                                   \
+        OaHashInt slot_idx = oa_##name##_add_key_len(h, key, len);                        \
+        if(slot_idx == h->slot_size)                                                      \
+            return false;                                                                 \
+        oa_cow_touch(oa_cow(h), values, &h->values[slot_idx], sizeof(value_t));           \
+        h->values[slot_idx] = value;                                                      \
+        return true;                                                                      \
+    }                                                                                     \
+    SCOPE bool                                                                            \
+    oa_##name##_set_add_len(OaHash##name *h, const char *key, size_t len) {               \
+        assert(!is_map);                                                                  \
+        return oa_##name##_add_key_len(h, key, len) != h->slot_size;                      \
+    }                                                                                     \
 
 #define OA_MAP_INIT_STR(name, value_t, value_format)                                      \
     OA_HASH_TYPE(name, OaStrKey, value_t)                                                 \
     OA_HASH_DEFINE_METHOD(name, static inline, OaStrKey, value_t,                         \
-        oa_str_hash_func, oa_str_hash_equal, oa_copy_str_key, true, "s", value_format, true)                     \
+        oa_str_hash_func, oa_str_hash_equal, oa_copy_str_key, true, "s", value_format, true, true) \
+    OA_STR_DEFINE_LEN_METHOD(name, static inline, value_t, true)                          \
 
 #define OA_SET_INIT_STR(name, value_t, value_format)                                      \
     OA_HASH_TYPE(name, OaStrKey, value_t)                                                 \
     OA_HASH_DEFINE_METHOD(name, static inline, OaStrKey, value_t,                         \
-        oa_str_hash_func, oa_str_hash_equal, oa_copy_str_key, true, "s", value_format, false)                     \
+        oa_str_hash_func, oa_str_hash_equal, oa_copy_str_key, true, "s", value_format, false, true) \
+    OA_STR_DEFINE_LEN_METHOD(name, static inline, value_t, false)                         \
+
+/*
+ * String keys given as pointer and length, borrowed rather than copied, so
+ * they may point straight into a mmapped file. The bytes must outlive the
+ * table.
+ */
+typedef struct {
+    const char *ptr;
+    size_t len;
+} OaStrSlice;
+
+#define oa_str_slice(p, n) ((OaStrSlice){(p), (n)})
+
+/*
+ * Eight bytes per multiply. The last chunk overlaps the one before it and
+ * short keys are read as two overlapping halves, so no byte loop is left
+ * and nothing outside the slice is touched. The length goes into the seed.
+ */
+static inline uint64_t
+oa_hash_slice_mix(uint64_t h, uint64_t word) {
+    h = (h ^ word) * 0xff51afd7ed558ccdULL;
+    return h ^ (h >> 32);
+}
+
+static inline OaHashInt
+oa_hash_slice(OaStrSlice s) {
+    const unsigned char *p = (const unsigned char *)s.ptr;
+    size_t len = s.len;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+    uint64_t word;
+    if(len > sizeof(uint64_t)) {
+        for(size_t i = 0;i + sizeof(uint64_t) < len;i += sizeof(uint64_t)) {
+            memcpy(&word, p + i, sizeof(word));
+            h = oa_hash_slice_mix(h, word);
+        }
+        memcpy(&word, p + len - sizeof(word), sizeof(word));
+    }
+    else if(len >= sizeof(uint32_t)) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, sizeof(lo));
+        memcpy(&hi, p + len - sizeof(hi), sizeof(hi));
+        word = (uint64_t)hi << 32U | lo;
+    }
+    else if(len)
+        word = (uint64_t)p[0] << 16U | (uint64_t)p[len >> 1U] << 8U | p[len - 1];
+    else
+        word = 0;
+    return (OaHashInt)oa_hash_slice_mix(h, word);
+}
+
+static inline void
+oa_print_slice_key(OaStrSlice key) {
+    printf("%.*s", (int)key.len, key.ptr);
+}
+
+#define oa_slice_hash_func(key, slot_size) (oa_hash_slice(key) & ((slot_size) - 1))
+#define oa_slice_hash_equal(key1, key2)                                                   \
+    ((key1).len == (key2).len && memcmp((key1).ptr, (key2).ptr, (key1).len) == 0)
+#define oa_copy_slice_key(key) (key)
+
+#define OA_MAP_INIT_STR_SLICE(name, value_t, value_format)                                \
+    OA_HASH_TYPE(name, OaStrSlice, value_t)                                               \
+    OA_HASH_DEFINE_CORE(name, static inline, OaStrSlice, value_t,                         \
+        oa_slice_hash_func, oa_slice_hash_equal, oa_copy_slice_key, false,                \
+        oa_free_borrowed_key, oa_print_slice_key, value_format, true, true)               \
+
+#define OA_SET_INIT_STR_SLICE(name)                                                       \
+    OA_HASH_TYPE(name, OaStrSlice, uint8_t)                                               \
+    OA_HASH_DEFINE_CORE(name, static inline, OaStrSlice, uint8_t,                         \
+        oa_slice_hash_func, oa_slice_hash_equal, oa_copy_slice_key, false,                \
+        oa_free_borrowed_key, oa_print_slice_key, "c", false, true)                       \
+
+/*
+ * Counters.
+ *
+ * add_delta finds or creates the slot with a single probe and adds to its
+ * value in place. The atomic variants let many threads share one table:
+ * hits are a lock free probe plus a relaxed atomic add on values[], only a
+ * key that is not there yet takes the table lock, and its flag is published with
+ * a release store after key and value are written. The table never grows
+ * under them, so reserve the capacity up front; an insert past it fails.
+ * Deletes, rehashes and the bloom filter are for single threaded phases.
+ * value_t must be an integer type.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#define oa_cpu_relax() __builtin_ia32_pause()
+#else
+#define oa_cpu_relax() ((void)0)
+#endif
+
+static inline void
+oa_spin_lock(int *lock) {
+    while(__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        while(__atomic_load_n(lock, __ATOMIC_RELAXED))
+            oa_cpu_relax();
+    }
+}
+
+static inline void
+oa_spin_unlock(int *lock) {
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+#define oa_atomic_flag(flags, i)                                                          \
+    ((__atomic_load_n(&(flags)[WORD_IDX(i)], __ATOMIC_ACQUIRE) >> (BIT_IDX(i) << 1U)) & 3U)
+#define oa_atomic_set_exist(flags, i)                                                     \
+    __atomic_store_n(&(flags)[WORD_IDX(i)],                                               \
+        (flags)[WORD_IDX(i)] & ~(3U << (BIT_IDX(i) << 1U)), __ATOMIC_RELEASE)
+
+#define OA_COUNTER_DEFINE_METHOD(name, SCOPE, key_t, value_t, hash_func, hash_equal,      \
+        copy_key, store_hash)                                                             \
+    SCOPE bool                                                                            \
+    oa_##name##_add_delta(OaHash##name *h, key_t key, value_t delta) {                    \
+        OaHashInt size = h->size;                                                         \
+        OaHashInt slot_idx = oa_##name##_add_key(h, key);                                 \
+        if(slot_idx == h->slot_size)                                                      \
+            return false;                                                                 \
+        oa_cow_touch(oa_cow(h), values, &h->values[slot_idx], sizeof(value_t));           \
+        if(h->size != size)                                                               \
+            h->values[slot_idx] = delta;                                                  \
+        else                                                                              \
+            h->values[slot_idx] += delta;                                                 \
+        return true;                                                                      \
+    }                                                                                     \
+    /* lock free probe, slot_size when the key is not published yet */                    \
+    SCOPE OaHashInt                                                                       \
+    oa_##name##_atomic_get(OaHash##name *h, key_t key, OaHashInt hash) {                  \
+        if(oa_is_inline(h)) {                                                             \
+            for(OaHashInt i = 0;i != OA_INLINE_NUM;i++) {                                 \
+                if(!oa_atomic_flag(h->flags, i) && hash_equal(key, h->keys[i]))           \
+                    return i;                                                             \
+            }                                                                             \
+            return h->slot_size;                                                          \
+        }                                                                                 \
+        OaHashInt slot_idx = hash & (h->slot_size - 1);                                   \
+        OaHashInt step = 0;                                                               \
+        while(true) {                                                                     \
+            OaHashInt flag = oa_atomic_flag(h->flags, slot_idx);                          \
+            if(flag & 2U)                                                                 \
+                return h->slot_size;                                                      \
+            if(!flag && (!store_hash || h->ext->hashes[slot_idx] == hash)                 \
+                    && hash_equal(key, h->keys[slot_idx]))                                \
+                return slot_idx;                                                          \
+            slot_idx = (slot_idx + (++step)) & (h->slot_size - 1);                        \
+        }                                                                                 \
+    }                                                                                     \
+    /* called with the table lock held, other writers are out so flags read plainly */    \
+    SCOPE bool                                                                            \
+    oa_##name##_atomic_insert(OaHash##name *h, key_t key, value_t delta, OaHashInt hash) { \
+        OaHashInt slot_idx = hash & (h->slot_size - 1);                                   \
+        OaHashInt del_idx = h->slot_size;                                                 \
+        OaHashInt step = 0;                                                               \
+        if(oa_is_inline(h)) {                                                             \
+            slot_idx = oa_##name##_inline_find(h, key);                                   \
+            if(slot_idx != h->slot_size) {                                                \
+                __atomic_fetch_add(&h->values[slot_idx], delta, __ATOMIC_RELAXED);        \
+                return true;                                                              \
+            }                                                                             \
+            del_idx = oa_##name##_inline_free(h);                                         \
+            if(del_idx == h->slot_size)                                                   \
+                return false;                                                             \
+            slot_idx = del_idx;                                                           \
+        }                                                                                 \
+        while(!oa_is_inline(h) && !IS_EMPTY(h->flags, slot_idx)) {                        \
+            if(IS_DEL(h->flags, slot_idx)) {                                              \
+                if(del_idx == h->slot_size)                                               \
+                    del_idx = slot_idx;                                                   \
+            }                                                                             \
+            else if((!store_hash || h->ext->hashes[slot_idx] == hash)                     \
+                    && hash_equal(key, h->keys[slot_idx])) {                              \
+                __atomic_fetch_add(&h->values[slot_idx], delta, __ATOMIC_RELAXED);        \
+                return true;                                                              \
+            }                                                                             \
+            slot_idx = (slot_idx + (++step)) & (h->slot_size - 1);                        \
+        }                                                                                 \
+        if(del_idx != h->slot_size && !IS_EMPTY(h->flags, del_idx))                       \
+            slot_idx = del_idx;                                                           \
+        else if(h->occupied_size >= h->upper_limit)                                       \
+            return false;                                                                 \
+        else                                                                              \
+            h->occupied_size++;                                                           \
+        h->keys[slot_idx] = copy_key(key);                                                \
+        if(store_hash && !oa_is_inline(h))                                                \
+            h->ext->hashes[slot_idx] = hash;                                              \
+        __atomic_store_n(&h->values[slot_idx], delta, __ATOMIC_RELAXED);                  \
+        oa_atomic_set_exist(h->flags, slot_idx);                                          \
+        h->size++;                                                                        \
+        return true;                                                                      \
+    }                                                                                     \
+    SCOPE bool                                                                            \
+    oa_##name##_atomic_add_delta(OaHash##name *h, key_t key, value_t delta) {             \
+        OaHashExt *ext = oa_ext_get_atomic(&h->ext);                                      \
+        assert(!ext->bloom && !oa_cow_live(ext->cow));                                    \
+        OaHashInt hash = hash_func(key, 0U);                                              \
+        OaHashInt slot_idx = oa_##name##_atomic_get(h, key, hash);                        \
+        if(slot_idx != h->slot_size) {                                                    \
+            __atomic_fetch_add(&h->values[slot_idx], delta, __ATOMIC_RELAXED);            \
+            return true;                                                                  \
+        }                                                                                 \
+        oa_spin_lock(&ext->lock);                                                         \
+        bool ret = oa_##name##_atomic_insert(h, key, delta, hash);                        \
+        oa_spin_unlock(&ext->lock);                                                       \
+        return ret;                                                                       \
+    }                                                                                     \
+    SCOPE value_t                                                                         \
+    oa_##name##_atomic_value(OaHash##name *h, key_t key) {                                \
+        OaHashInt slot_idx = oa_##name##_atomic_get(h, key, hash_func(key, 0U));          \
+        if(slot_idx == h->slot_size)                                                      \
+            return 0;                                                                     \
+        return __atomic_load_n(&h->values[slot_idx], __ATOMIC_RELAXED);                   \
+    }                                                                                     \
+
+#define OA_COUNTER_INIT_UINT64(name, value_t, value_format)                               \
+    OA_MAP_INIT_UINT64(name, value_t, value_format)                                       \
+    OA_COUNTER_DEFINE_METHOD(name, static inline, uint64_t, value_t,                      \
+        oa_uint64_hash_func, oa_uint64_hash_equal, oa_copy_uint_key, false)               \
+
+#define OA_COUNTER_INIT_UINT64_WANG_HASH(name, value_t, value_format)                     \
+    OA_MAP_INIT_UINT64_WANG_HASH(name, value_t, value_format)                             \
+    OA_COUNTER_DEFINE_METHOD(name, static inline, uint64_t, value_t,                      \
+        oa_uint64_Wang_hash_func, oa_uint64_hash_equal, oa_copy_uint_key, false)          \
+
+#define OA_COUNTER_INIT_UINT32(name, value_t, value_format)                               \
+    OA_MAP_INIT_UINT32(name, value_t, value_format)                                       \
+    OA_COUNTER_DEFINE_METHOD(name, static inline, uint32_t, value_t,                      \
+        oa_uint32_hash_func, oa_uint32_hash_equal, oa_copy_uint_key, false)               \
+
+#define OA_COUNTER_INIT_STR(name, value_t, value_format)                                  \
+    OA_MAP_INIT_STR(name, value_t, value_format)                                          \
+    OA_COUNTER_DEFINE_METHOD(name, static inline, OaStrKey, value_t,                      \
+        oa_str_hash_func, oa_str_hash_equal, oa_copy_str_key, true)                       \
+
+#define OA_COUNTER_INIT_STR_SLICE(name, value_t, value_format)                            \
+    OA_MAP_INIT_STR_SLICE(name, value_t, value_format)                                    \
+    OA_COUNTER_DEFINE_METHOD(name, static inline, OaStrSlice, value_t,                    \
+        oa_slice_hash_func, oa_slice_hash_equal, oa_copy_slice_key, true)                 \
+
+/*
+ * Compact uint64 set.
+ *
+ * Keys go through the invertible oa_fmix64, the low quotient_bits of the
+ * result pick the home bucket and only the remaining high bits are stored.
+ * A bucket is one cache line: a 32-bit header, then the low byte of every
+ * cell as a tag, then the rest of the cells, as many entry_bytes wide
+ * cells as fit, entry_bytes shrinking as the table grows. The header has
+ * a bit per cell for keys at home and one for keys away: a key that finds
+ * its home bucket full goes to home ^ oa_compact_alt(remainder), kicking
+ * resident keys to their other buckets if need be, so the key is rebuilt
+ * from its cell with oa_fmix64_inverse. A home bucket that ever sent a key
+ * away has its overflow bit set, lookups of others stop after one line.
+ * A lookup matches the tags a word at a time and reads the cells of
+ * matching tags only.
+ *
+ * The table fills to OA_COMPACT_MAX_LOAD of its cells. 1M random keys take
+ * 2^17 buckets of ten 6-byte cells at 76% load, 8.4MB against 17.3MB for
+ * OA_SET_INIT_UINT64, for lookups about 1.5x slower: 40ns against 27ns a
+ * hit and 35-43ns against 26ns a miss, 19% of buckets having overflowed.
+ */
+#define OA_COMPACT_LINE 64U
+#define OA_COMPACT_META_BYTES 4U
+#define OA_COMPACT_TAG_BYTES 16U        // read for the tags of up to 15 cells
+#define OA_COMPACT_CELL_BITS 4U         // slot index is bucket << 4 | cell
+#define OA_COMPACT_AWAY_SHIFT 16U
+#define OA_COMPACT_OVERFLOW (1U << 31U)
+#define OA_COMPACT_EMPTY 0U
+#define OA_COMPACT_HOME 1U
+#define OA_COMPACT_AWAY 2U
+#define OA_COMPACT_MAX_LOAD 0.9
+#define OA_COMPACT_MAX_KICKS 128U
+#define OA_COMPACT_INIT_NUM 8U          // buckets
+
+/* bytes little endian bytes, the 8 - bytes after them are read and written back */
+static inline uint64_t
+oa_compact_load(const uint8_t *p, OaHashInt bytes) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return bytes == 8U ? v : v & ((1ULL << (bytes << 3U)) - 1U);
+}
+
+static inline void
+oa_compact_store(uint8_t *p, OaHashInt bytes, uint64_t entry) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    uint64_t mask = bytes == 8U ? ~0ULL : (1ULL << (bytes << 3U)) - 1U;
+    v = (v & ~mask) | entry;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline uint32_t
+oa_compact_meta(const uint8_t *bucket) {
+    uint32_t meta;
+    memcpy(&meta, bucket, sizeof(meta));
+    return meta;
+}
+
+static inline void
+oa_compact_set_meta(uint8_t *bucket, uint32_t meta) {
+    memcpy(bucket, &meta, sizeof(meta));
+}
+
+/* the header bit of a cell in state, none for OA_COMPACT_EMPTY */
+#define oa_compact_state_bit(state, cell)                                                 \
+    (((state) & 1U) << (cell) | ((state) >> 1U) << ((cell) + OA_COMPACT_AWAY_SHIFT))
+#define oa_compact_state(meta, cell)                                                      \
+    (((meta) >> (cell) & 1U) | ((meta) >> ((cell) + OA_COMPACT_AWAY_SHIFT) & 1U) << 1U)
+
+/* a bit per tag byte equal to tag, with a few false positives past a match */
+static inline uint32_t
+oa_compact_tag_match(const uint8_t *tags, uint8_t tag) {
+    uint32_t bits = 0;
+    for(uint32_t w = 0;w < OA_COMPACT_TAG_BYTES / 8U;w++) {
+        uint64_t x;
+        memcpy(&x, tags + w * 8U, sizeof(x));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        x = __builtin_bswap64(x);
+#endif
+        x ^= tag * 0x0101010101010101ULL;
+        x = (x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL;
+        bits |= (uint32_t)((x >> 7U) * 0x0102040810204080ULL >> 56U) << (w * 8U);
+    }
+    return bits;
+}
+
+/* xor of the two buckets of a remainder, odd so they always differ */
+static inline OaHashInt
+oa_compact_alt(uint64_t remainder, OaHashInt bucket_num) {
+    return ((OaHashInt)(remainder * 0x9e3779b97f4a7c15ULL >> 32U) & (bucket_num - 1U)) | 1U;
+}
+
+#define OA_COMPACT_SET_TYPE(name)                                                         \
+    typedef struct {                                                                      \
+        OaHashInt slot_size;            /* bucket_num << OA_COMPACT_CELL_BITS */          \
+        OaHashInt size;                                                                   \
+        OaHashInt upper_limit;                                                            \
+        OaHashInt bucket_num;                                                             \
+        OaHashInt quotient_bits;                                                          \
+        OaHashInt entry_bytes;                                                            \
+        OaHashInt cell_num;             /* per bucket, the slots past it stay empty */    \
+        uint8_t *buckets;                                                                 \
+    } OaHash##name;
+
+#define OA_COMPACT_SET_DEFINE_METHOD(name, SCOPE)                                         \
+    SCOPE void                                                                            \
+    oa_##name##_alloc_slots(OaHash##name *h, OaHashInt bucket_num) {                      \
+        h->bucket_num = bucket_num;                                                       \
+        h->slot_size = bucket_num << OA_COMPACT_CELL_BITS;                                \
+        h->size = 0;                                                                      \
+        h->quotient_bits = (OaHashInt)__builtin_ctz(bucket_num);                          \
+        h->entry_bytes = (64U - h->quotient_bits + 7U) >> 3U;                             \
+        h->cell_num = (OA_COMPACT_LINE - OA_COMPACT_META_BYTES) / h->entry_bytes;         \
+        h->upper_limit = (OaHashInt)((double)bucket_num * h->cell_num * OA_COMPACT_MAX_LOAD); \
+        /* a spare line for the bytes the last cell reads past itself */                  \
+        size_t bytes = ((size_t)bucket_num + 1U) * OA_COMPACT_LINE;                       \
+        h->buckets = aligned_alloc(OA_COMPACT_LINE, bytes);                               \
+        assert(h->buckets);                                                               \
+        memset(h->buckets, 0, bytes);                                                     \
+    }                                                                                     \
+    SCOPE OaHash##name *                                                                  \
+    oa_##name##_new() {                                                                   \
+        OaHash##name *h = malloc(sizeof(OaHash##name));                                   \
+        oa_##name##_alloc_slots(h, OA_COMPACT_INIT_NUM);                                  \
+        return h;                                                                         \
+    }                                                                                     \
+    SCOPE void                                                                            \
+    oa_##name##_free(OaHash##name *h) {                                                   \
+        if(h) {                                                                           \
+            free(h->buckets);                                                             \
+            free(h);                                                                      \
+        }                                                                                 \
+    }                                                                                     \
+    SCOPE size_t                                                                          \
+    oa_##name##_bytes(OaHashInt slot_size) {                                              \
+        return sizeof(OaHash##name)                                                       \
+            + ((size_t)(slot_size >> OA_COMPACT_CELL_BITS) + 1U) * OA_COMPACT_LINE;       \
+    }                                                                                     \
+    SCOPE uint8_t *                                                                       \
+    oa_##name##_bucket(OaHash##name *h, OaHashInt bucket) {                               \
+        return h->buckets + (size_t)bucket * OA_COMPACT_LINE;                             \
+    }                                                                                     \
+    /* the bytes of a cell past its tag */                                                \
+    SCOPE uint8_t *                                                                       \
+    oa_##name##_body(OaHash##name *h, uint8_t *bucket, OaHashInt cell) {                  \
+        return bucket + OA_COMPACT_META_BYTES + h->cell_num + cell * (h->entry_bytes - 1U); \
+    }                                                                                     \
+    SCOPE uint64_t                                                                        \
+    oa_##name##_remainder(OaHash##name *h, uint8_t *bucket, OaHashInt cell) {             \
+        uint64_t high = oa_compact_load(oa_##name##_body(h, bucket, cell), h->entry_bytes - 1U); \
+        return high << 8U | bucket[OA_COMPACT_META_BYTES + cell];                         \
+    }                                                                                     \
+    SCOPE bool                                                                            \
+    oa_##name##_exist(OaHash##name *h, OaHashInt i) {                                     \
+        OaHashInt cell = i & ((1U << OA_COMPACT_CELL_BITS) - 1U);                         \
+        return cell < h->cell_num && oa_compact_state(oa_compact_meta(                    \
+            oa_##name##_bucket(h, i >> OA_COMPACT_CELL_BITS)), cell) != OA_COMPACT_EMPTY; \
+    }                                                                                     \
+    /* mixed key of the entry in slot i */                                                \
+    SCOPE uint64_t                                                                        \
+    oa_##name##_mixed_key(OaHash##name *h, OaHashInt i) {                                 \
+        OaHashInt bucket = i >> OA_COMPACT_CELL_BITS;                                     \
+        OaHashInt cell = i & ((1U << OA_COMPACT_CELL_BITS) - 1U);                         \
+        uint8_t *p = oa_##name##_bucket(h, bucket);                                       \
+        uint64_t remainder = oa_##name##_remainder(h, p, cell);                           \
+        if(oa_compact_state(oa_compact_meta(p), cell) == OA_COMPACT_AWAY)                 \
+            bucket ^= oa_compact_alt(remainder, h->bucket_num);                           \
+        return remainder << h->quotient_bits | bucket;                                    \
+    }                                                                                     \
+    SCOPE uint64_t                                                                        \
+    oa_##name##_key(OaHash##name *h, OaHashInt i) {                                       \
+        return oa_fmix64_inverse(oa_##name##_mixed_key(h, i));                            \
+    }                                                                                     \
+    SCOPE void                                                                            \
+    oa_##name##_print(OaHash##name *h) {                                                  \
+        printf("slot_size:%"PRIu32"\n", h->slot_size);                                    \
+        printf("size:%"PRIu32"\n", h->size);                                              \
+        printf("entry_bytes:%"PRIu32"\n", h->entry_bytes);                                \
+        for(OaHashInt i = 0;i < h->slot_size;i++) {                                       \
+            if(oa_##name##_exist(h, i))                                                   \
+                printf("idx:%"PRIu32",key:%"PRIu64"\n", i, oa_##name##_key(h, i));        \
+        }                                                                                 \
+    }                                                                                     \
+    /* cell of bucket holding the remainder in the given state, or cell_num */            \
+    SCOPE OaHashInt                                                                       \
+    oa_##name##_scan(OaHash##name *h, OaHashInt bucket, uint64_t remainder, uint32_t state) { \
+        uint8_t *p = oa_##name##_bucket(h, bucket);                                       \
+        uint32_t meta = oa_compact_meta(p);                                               \
+        uint32_t match = oa_compact_tag_match(p + OA_COMPACT_META_BYTES, (uint8_t)remainder) \
+            & (state == OA_COMPACT_HOME ? meta : meta >> OA_COMPACT_AWAY_SHIFT)           \
+            & ((1U << h->cell_num) - 1U);                                                 \
+        while(match) {                                                                    \
+            OaHashInt cell = (OaHashInt)__builtin_ctz(match);                             \
+            if(oa_compact_load(oa_##name##_body(h, p, cell), h->entry_bytes - 1U) == remainder >> 8U) \
+                return cell;                                                              \
+            match &= match - 1U;                                                          \
+        }                                                                                 \
+        return h->cell_num;                                                               \
+    }                                                                                     \
+    /* slot of the mixed key, or slot_size */                                             \
+    SCOPE OaHashInt                                                                       \
+    oa_##name##_find(OaHash##name *h, uint64_t mixed) {                                   \
+        OaHashInt home = (OaHashInt)mixed & (h->bucket_num - 1U);                         \
+        uint64_t remainder = mixed >> h->quotient_bits;                                   \
+        OaHashInt cell = oa_##name##_scan(h, home, remainder, OA_COMPACT_HOME);           \
+        if(cell != h->cell_num)                                                           \
+            return home << OA_COMPACT_CELL_BITS | cell;                                   \
+        if(!(oa_compact_meta(oa_##name##_bucket(h, home)) & OA_COMPACT_OVERFLOW))         \
+            return h->slot_size;                                                          \
+        OaHashInt away = home ^ oa_compact_alt(remainder, h->bucket_num);                 \
+        cell = oa_##name##_scan(h, away, remainder, OA_COMPACT_AWAY);                     \
+        return cell != h->cell_num ? away << OA_COMPACT_CELL_BITS | cell : h->slot_size;  \
+    }                                                                                     \
+    /* writes the entry into slot i, marking its home when it lands away */               \
+    SCOPE void                                                                            \
+    oa_##name##_write(OaHash##name *h, OaHashInt i, uint64_t remainder, uint32_t state) { \
+        OaHashInt bucket = i >> OA_COMPACT_CELL_BITS;                                     \
+        OaHashInt cell = i & ((1U << OA_COMPACT_CELL_BITS) - 1U);                         \
+        uint8_t *p = oa_##name##_bucket(h, bucket);                                       \
+        p[OA_COMPACT_META_BYTES + cell] = (uint8_t)remainder;                             \
+        oa_compact_store(oa_##name##_body(h, p, cell), h->entry_bytes - 1U, remainder >> 8U); \
+        uint32_t meta = oa_compact_meta(p) & ~oa_compact_state_bit(3U, cell);             \
+        oa_compact_set_meta(p, meta | oa_compact_state_bit(state, cell));                 \
+        if(state == OA_COMPACT_AWAY) {                                                    \
+            bucket ^= oa_compact_alt(remainder, h->bucket_num);                           \
+            uint8_t *home = oa_##name##_bucket(h, bucket);                                \
+            oa_compact_set_meta(home, oa_compact_meta(home) | OA_COMPACT_OVERFLOW);       \
+        }                                                                                 \
+    }                                                                                     \
+    SCOPE bool                                                                            \
+    oa_##name##_put(OaHash##name *h, OaHashInt bucket, uint64_t remainder, uint32_t state) { \
+        uint32_t meta = oa_compact_meta(oa_##name##_bucket(h, bucket));                   \
+        uint32_t empty = ~(meta | meta >> OA_COMPACT_AWAY_SHIFT) & ((1U << h->cell_num) - 1U); \
+        if(!empty)                                                                        \
+            return false;                                                                 \
+        OaHashInt cell = (OaHashInt)__builtin_ctz(empty);                                 \
+        oa_##name##_write(h, bucket << OA_COMPACT_CELL_BITS | cell, remainder, state);    \
+        return true;                                                                      \
+    }                                                                                     \
+    /* exchanges the entry in slot i with the one carried */                              \
+    SCOPE void                                                                            \
+    oa_##name##_swap(OaHash##name *h, OaHashInt i, uint64_t *remainder, uint32_t *state) { \
+        uint8_t *p = oa_##name##_bucket(h, i >> OA_COMPACT_CELL_BITS);                    \
+        OaHashInt cell = i & ((1U << OA_COMPACT_CELL_BITS) - 1U);                         \
+        uint64_t old_remainder = oa_##name##_remainder(h, p, cell);                       \
+        uint32_t old_state = oa_compact_state(oa_compact_meta(p), cell);                  \
+        oa_##name##_write(h, i, *remainder, *state);                                      \
+        *remainder = old_remainder;                                                       \
+        *state = old_state;                                                               \
+    }                                                                                     \
+    /*                                                                                    \
+     * Stores a mixed key known to be absent. With both buckets full, resident            \
+     * keys are kicked to their other bucket along a path of at most                      \
+     * OA_COMPACT_MAX_KICKS; false, with the path undone, when it runs out.               \
+     */                                                                                   \
+    SCOPE bool                                                                            \
+    oa_##name##_insert(OaHash##name *h, uint64_t mixed) {                                 \
+        OaHashInt bucket = (OaHashInt)mixed & (h->bucket_num - 1U);                       \
+        uint64_t remainder = mixed >> h->quotient_bits;                                   \
+        uint32_t state = OA_COMPACT_HOME;                                                 \
+        OaHashInt path[OA_COMPACT_MAX_KICKS];                                             \
+        OaHashInt kick = 0;                                                               \
+        bool stored = oa_##name##_put(h, bucket, remainder, state);                       \
+        while(!stored) {                                                                  \
+            /* the carried key tries its other bucket, else takes a cell there */         \
+            bucket ^= oa_compact_alt(remainder, h->bucket_num);                           \
+            state ^= OA_COMPACT_HOME | OA_COMPACT_AWAY;                                   \
+            stored = oa_##name##_put(h, bucket, remainder, state);                        \
+            if(stored || kick == OA_COMPACT_MAX_KICKS)                                    \
+                break;                                                                    \
+            OaHashInt cell = (OaHashInt)((remainder + kick) % h->cell_num);               \
+            path[kick] = bucket << OA_COMPACT_CELL_BITS | cell;                           \
+            oa_##name##_swap(h, path[kick++], &remainder, &state);                        \
+        }                                                                                 \
+        if(stored) {                                                                      \
+            h->size++;                                                                    \
+            return true;                                                                  \
+        }                                                                                 \
+        while(kick-- > 0) {                                                               \
+            state ^= OA_COMPACT_HOME | OA_COMPACT_AWAY;                                   \
+            oa_##name##_swap(h, path[kick], &remainder, &state);                          \
+        }                                                                                 \
+        return false;                                                                     \
+    }                                                                                     \
+    SCOPE void                                                                            \
+    oa_##name##_rehash(OaHash##name *h, OaHashInt new_num) {                              \
+        OaHash##name old = *h;                                                            \
+        while(true) {                                                                     \
+            oa_##name##_alloc_slots(h, new_num);                                          \
+            OaHashInt i = 0;                                                              \
+            for(;i < old.slot_size;i++) {                                                 \
+                if(oa_##name##_exist(&old, i)                                             \
+                        && !oa_##name##_insert(h, oa_##name##_mixed_key(&old, i)))        \
+                    break;                                                                \
+            }                                                                             \
+            if(i == old.slot_size)                                                        \
+                break;                                                                    \
+            free(h->buckets);                                                             \
+            new_num <<= 1U;                                                               \
+        }                                                                                 \
+        free(old.buckets);                                                                \
+    }                                                                                     \
+    SCOPE bool                                                                            \
+    oa_##name##_set_add(OaHash##name *h, uint64_t key) {                                  \
+        uint64_t mixed = oa_fmix64(key);                                                  \
+        if(oa_##name##_find(h, mixed) != h->slot_size)                                    \
+            return true;                                                                  \
+        while(h->size >= h->upper_limit || !oa_##name##_insert(h, mixed)) {               \
+            if(h->bucket_num > (UINT32_MAX >> (OA_COMPACT_CELL_BITS + 1U)))               \
+                return false;                                                             \
+            oa_##name##_rehash(h, h->bucket_num << 1U);                                   \
+        }                                                                                 \
+        return true;                                                                      \
+    }                                                                                     \
+    SCOPE OaHashInt                                                                       \
+    oa_##name##_get(OaHash##name *h, uint64_t key) {                                      \
+        return oa_##name##_find(h, oa_fmix64(key));                                       \
+    }                                                                                     \
+    SCOPE void                                                                            \
+    oa_##name##_delete(OaHash##name *h, uint64_t key) {                                   \
+        OaHashInt slot_idx = oa_##name##_find(h, oa_fmix64(key));                         \
+        if(slot_idx == h->slot_size)                                                      \
+            return;                                                                       \
+        uint8_t *p = oa_##name##_bucket(h, slot_idx >> OA_COMPACT_CELL_BITS);             \
+        OaHashInt cell = slot_idx & ((1U << OA_COMPACT_CELL_BITS) - 1U);                  \
+        oa_compact_set_meta(p, oa_compact_meta(p) & ~oa_compact_state_bit(3U, cell));     \
+        --h->size;                                                                        \
+        if(h->bucket_num > OA_COMPACT_INIT_NUM && h->size <= (h->upper_limit >> 3U))      \
+            oa_##name##_rehash(h, h->bucket_num >> 1U);                                   \
+    }                                                                                     \
+    SCOPE void                                                                            \
+    oa_##name##_clear(OaHash##name *h) {                                                  \
+        if(h && h->buckets) {                                                             \
+            memset(h->buckets, 0, (size_t)h->bucket_num * OA_COMPACT_LINE);               \
+            h->size = 0;                                                                  \
+        }                                                                                 \
+    }                                                                                     \
+
+#define OA_SET_INIT_UINT64_COMPACT(name)                                                  \
+    OA_COMPACT_SET_TYPE(name)                                                             \
+    OA_COMPACT_SET_DEFINE_METHOD(name, static inline)                                     \
+
+#define oa_compact_key(name, h, i) oa_##name##_key(h, i)
+#define oa_compact_foreach(name, h, key_var, code) do {                                   \
+    for(OaHashInt i = oa_hash_begin(h);i < oa_hash_end(h);i++) {                          \
+        if(!oa_##name##_exist(h, i)) continue;                                            \
+        (key_var) = oa_compact_key(name, h, i);                                           \
+        code;                                                                             \
+    }                                                                                     \
+} while(0)
 
 #endif
@@ -0,0 +1,364 @@
+#ifndef __OA_SHM_H__
+#define __OA_SHM_H__
+
+/*
+ * OA table in one shared memory segment, for many processes reading the
+ * same data.
+ *
+ * The segment is a header followed by the flags, keys and values arrays
+ * at offsets the header records, so it holds no pointers and maps at any
+ * address. It is a named POSIX shm object, or a memfd handed to workers
+ * across fork or over a unix socket. Readers attach read only and never
+ * load anything, the page cache is shared by all of them.
+ *
+ * There is one writer. Every update runs inside a sequence lock: the
+ * counter in the header is odd while slots change, a reader probes
+ * without locking and starts over when the counter moved under it.
+ * write_begin/write_end put a batch of updates under one odd period.
+ * The capacity is fixed when the segment is created, a put past it
+ * fails, deleted slots are reclaimed by compacting in place.
+ * Keys and values are copied bytewise, so they must not hold pointers.
+ */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "oa_hash.h"
+
+#define OA_SHM_MAGIC 0x6f615f73686d0001ULL    // "oa_shm", layout version 1
+#define OA_SHM_ALIGN 64U
+
+typedef struct {
+    uint64_t magic;                     // set last by the creator
+    uint64_t bytes;                     // whole segment
+    uint32_t key_size;
+    uint32_t value_size;
+    uint32_t seq;                       // odd while the writer is mid update
+    OaHashInt slot_size;
+    OaHashInt size;
+    OaHashInt occupied_size;
+    OaHashInt upper_limit;
+    uint64_t flags_off;                 // from the start of the segment
+    uint64_t keys_off;
+    uint64_t values_off;
+} OaShmHeader;
+
+#define oa_shm_align(off) (((off) + OA_SHM_ALIGN - 1) & ~(uint64_t)(OA_SHM_ALIGN - 1))
+
+/* the header of a segment laid out for n keys */
+static inline OaShmHeader
+oa_shm_layout(OaHashInt n, size_t key_size, size_t value_size) {
+    OaShmHeader hdr;
+    memset(&hdr, 0, sizeof(OaShmHeader));
+    hdr.key_size = (uint32_t)key_size;
+    hdr.value_size = (uint32_t)value_size;
+    hdr.slot_size = SLOT_INIT_NUM;
+    while(hdr.slot_size <= (UINT32_MAX >> 1U)
+            && calc_upper_limit(hdr.slot_size, oa_default_policy.max_load) < n)
+        hdr.slot_size <<= 1U;
+    hdr.upper_limit = calc_upper_limit(hdr.slot_size, oa_default_policy.max_load);
+    hdr.flags_off = oa_shm_align(sizeof(OaShmHeader));
+    hdr.keys_off = oa_shm_align(hdr.flags_off + calc_flags_byte_num(hdr.slot_size));
+    hdr.values_off = oa_shm_align(hdr.keys_off + (uint64_t)hdr.slot_size * key_size);
+    hdr.bytes = oa_shm_align(hdr.values_off + (uint64_t)hdr.slot_size * value_size);
+    return hdr;
+}
+
+/* fd of a fresh segment, a memfd when shm_name is NULL */
+static inline int
+oa_shm_open_new(const char *shm_name) {
+    if(!shm_name)
+        return oa_cow_memfd();
+    return shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+}
+
+/* maps fd read only and checks it holds a finished segment of this layout */
+static inline OaShmHeader *
+oa_shm_map(int fd, size_t key_size, size_t value_size) {
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(OaShmHeader))
+        return NULL;
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(p == MAP_FAILED)
+        return NULL;
+    OaShmHeader *hdr = p;
+    if(__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != OA_SHM_MAGIC
+            || hdr->bytes != (uint64_t)st.st_size
+            || hdr->key_size != key_size || hdr->value_size != value_size) {
+        munmap(p, (size_t)st.st_size);
+        return NULL;
+    }
+    return hdr;
+}
+
+static inline void
+oa_shm_write_lock(OaShmHeader *hdr) {
+    __atomic_store_n(&hdr->seq, hdr->seq + 1U, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+oa_shm_write_unlock(OaShmHeader *hdr) {
+    __atomic_store_n(&hdr->seq, hdr->seq + 1U, __ATOMIC_RELEASE);
+}
+
+/* an even sequence to read under, spins while the writer is busy */
+static inline uint32_t
+oa_shm_read_begin(const OaShmHeader *hdr) {
+    uint32_t seq;
+    while((seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE)) & 1U)
+        oa_cpu_relax();
+    return seq;
+}
+
+/* true when nothing was written since oa_shm_read_begin returned seq */
+static inline bool
+oa_shm_read_valid(const OaShmHeader *hdr, uint32_t seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/* flags, keys and values are hdr plus its offsets, valid in this process only */
+#define OA_SHM_TYPE(name, key_t, value_t)                                                 \
+    typedef struct {                                                                      \
+        OaShmHeader *hdr;                                                                 \
+        OaFlagsInt *flags;                                                                \
+        key_t *keys;                                                                      \
+        value_t *values;                                                                  \
+        OaHashInt slot_size;                                                              \
+        int fd;                                                                           \
+        bool writer;                                                                      \
+        int batch;                                                                        \
+    } OaShm##name;
+
+#define OA_SHM_DEFINE_METHOD(name, SCOPE, key_t, value_t, hash_func, hash_equal)          \
+    SCOPE OaShm##name *                                                                   \
+    oa_##name##_shm_wrap(int fd, OaShmHeader *hdr, bool writer) {                         \
+        OaShm##name *h = malloc(sizeof(OaShm##name));                                     \
+        h->hdr = hdr;                                                                     \
+        h->flags = (OaFlagsInt *)((char *)hdr + hdr->flags_off);                          \
+        h->keys = (key_t *)((char *)hdr + hdr->keys_off);                                 \
+        h->values = (value_t *)((char *)hdr + hdr->values_off);                           \
+        h->slot_size = hdr->slot_size;                                                    \
+        h->fd = fd;                                                                       \
+        h->writer = writer;                                                               \
+        h->batch = 0;                                                                     \
+        return h;                                                                         \
+    }                                                                                     \
+    /* the writer's handle on a new segment for n keys, NULL on failure */                \
+    SCOPE OaShm##name *                                                                   \
+    oa_##name##_shm_create(const char *shm_name, OaHashInt n) {                           \
+        OaShmHeader layout = oa_shm_layout(n, sizeof(key_t), sizeof(value_t));            \
+        int fd = oa_shm_open_new(shm_name);                                               \
+        if(fd < 0)                                                                        \
+            return NULL;                                                                  \
+        void *p = MAP_FAILED;                                                             \
+        if(ftruncate(fd, (off_t)layout.bytes) == 0)                                       \
+            p = mmap(NULL, layout.bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);      \
+        if(p == MAP_FAILED) {                                                             \
+            if(shm_name)                                                                  \
+                shm_unlink(shm_name);                                                     \
+            close(fd);                                                                    \
+            return NULL;                                                                  \
+        }                                                                                 \
+        OaShmHeader *hdr = p;                                                             \
+        *hdr = layout;                                                                    \
+        clear_flags((char *)hdr + hdr->flags_off, calc_flags_byte_num(hdr->slot_size));   \
+        __atomic_store_n(&hdr->magic, OA_SHM_MAGIC, __ATOMIC_RELEASE);                    \
+        return oa_##name##_shm_wrap(fd, hdr, true);                                       \
+    }                                                                                     \
+    /* a reader's handle, NULL unless fd holds a finished segment of this type */         \
+    SCOPE OaShm##name *                                                                   \
+    oa_##name##_shm_attach_fd(int fd) {                                                   \
+        OaShmHeader *hdr = oa_shm_map(fd, sizeof(key_t), sizeof(value_t));               \
+        return hdr ? oa_##name##_shm_wrap(fd, hdr, false) : NULL;                         \
+    }                                                                                     \
+    SCOPE OaShm##name *                                                                   \
+    oa_##name##_shm_attach(const char *shm_name) {                                        \
+        int fd = shm_open(shm_name, O_RDONLY, 0);                                         \
+        if(fd < 0)                                                                        \
+            return NULL;                                                                  \
+        OaShm##name *h = oa_##name##_shm_attach_fd(fd);                                   \
+        if(!h)                                                                            \
+            close(fd);                                                                    \
+        return h;                                                                         \
+    }                                                                                     \
+    /* unmaps and closes, the segment lives on until its name and fds are gone */         \
+    SCOPE void                                                                            \
+    oa_##name##_shm_detach(OaShm##name *h) {                                              \
+        if(h) {                                                                           \
+            assert(!h->batch);                                                            \
+            munmap(h->hdr, h->hdr->bytes);                                                \
+            close(h->fd);                                                                 \
+            free(h);                                                                      \
+        }                                                                                 \
+    }                                                                                     \
+    /* copies the value out, false when key is not there */                               \
+    SCOPE bool                                                                            \
+    oa_##name##_shm_get(OaShm##name *h, key_t key, value_t *value) {                      \
+        OaHashInt mask = h->slot_size - 1;                                                \
+        OaHashInt hash = hash_func(key, 0U);                                              \
+        while(true) {                                                                     \
+            uint32_t seq = oa_shm_read_begin(h->hdr);                                     \
+            OaHashInt slot_idx = hash & mask;                                             \
+            bool found = false;                                                           \
+            value_t found_value = {0};                                                    \
+            for(OaHashInt step = 0;step < h->slot_size;) {                                \
+                if(IS_EMPTY(h->flags, slot_idx))                                          \
+                    break;                                                                \
+                if(!IS_DEL(h->flags, slot_idx) && hash_equal(key, h->keys[slot_idx])) {   \
+                    found_value = h->values[slot_idx];                                    \
+                    found = true;                                                         \
+                    break;                                                                \
+                }                                                                         \
+                slot_idx = (slot_idx + (++step)) & mask;                                  \
+            }                                                                             \
+            if(oa_shm_read_valid(h->hdr, seq)) {                                          \
+                if(found)                                                                 \
+                    *value = found_value;                                                 \
+                return found;                                                             \
+            }                                                                             \
+        }                                                                                 \
+    }                                                                                     \
+    SCOPE OaHashInt                                                                       \
+    oa_##name##_shm_size(OaShm##name *h) {                                                \
+        return __atomic_load_n(&h->hdr->size, __ATOMIC_RELAXED);                          \
+    }                                                                                     \
+    /* readers wait from here to write_end, one odd period for many updates */            \
+    SCOPE void                                                                            \
+    oa_##name##_shm_write_begin(OaShm##name *h) {                                         \
+        assert(h->writer);                                                                \
+        if(!h->batch++)                                                                   \
+            oa_shm_write_lock(h->hdr);                                                    \
+    }                                                                                     \
+    SCOPE void                                                                            \
+    oa_##name##_shm_write_end(OaShm##name *h) {                                           \
+        assert(h->batch > 0);                                                             \
+        if(!--h->batch)                                                                   \
+            oa_shm_write_unlock(h->hdr);                                                  \
+    }                                                                                     \
+    /* same size rehash in place, drops the deleted slots */                              \
+    SCOPE void                                                                            \
+    oa_##name##_shm_compact(OaShm##name *h) {                                             \
+        OaHashInt mask = h->slot_size - 1;                                                \
+        size_t flags_bytes = calc_flags_byte_num(h->slot_size);                           \
+        OaFlagsInt *new_flags = malloc(flags_bytes);                                      \
+        assert(new_flags);                                                                \
+        clear_flags(new_flags, flags_bytes);                                              \
+        oa_##name##_shm_write_begin(h);                                                   \
+        for(OaHashInt i = 0;i < h->slot_size;i++) {                                       \
+            if(IS_DEL_OR_EMPTY(h->flags, i))                                              \
+                continue;                                                                 \
+            key_t old_key = h->keys[i];                                                   \
+            value_t old_value = h->values[i];                                             \
+            SET_DEL(h->flags, i);                                                         \
+            while(true) {                                                                 \
+                OaHashInt new_slot_idx = hash_func(old_key, 0U) & mask;                   \
+                OaHashInt step = 0;                                                       \
+                while(IS_EXIST(new_flags, new_slot_idx))                                  \
+                    new_slot_idx = (new_slot_idx + (++step)) & mask;                      \
+                key_t tmp_key = h->keys[new_slot_idx];                                    \
+                value_t tmp_value = h->values[new_slot_idx];                              \
+                bool displaced = IS_EXIST(h->flags, new_slot_idx);                        \
+                h->keys[new_slot_idx] = old_key;                                          \
+                h->values[new_slot_idx] = old_value;                                      \
+                SET_DEL(h->flags, new_slot_idx);                                          \
+                SET_EXIST(new_flags, new_slot_idx);                                       \
+                if(!displaced)                                                            \
+                    break;                                                                \
+                old_key = tmp_key;                                                        \
+                old_value = tmp_value;                                                    \
+            }                                                                             \
+        }                                                                                 \
+        memcpy(h->flags, new_flags, flags_bytes);                                         \
+        free(new_flags);                                                                  \
+        h->hdr->occupied_size = h->hdr->size;                                             \
+        oa_##name##_shm_write_end(h);                                                     \
+    }                                                                                     \
+    /* inserts or overwrites, false once the capacity is used up */                       \
+    SCOPE bool                                                                            \
+    oa_##name##_shm_put(OaShm##name *h, key_t key, value_t value) {                       \
+        OaShmHeader *hdr = h->hdr;                                                        \
+        OaHashInt mask = h->slot_size - 1;                                                \
+        OaHashInt hash = hash_func(key, 0U);                                              \
+        oa_##name##_shm_write_begin(h);                                                   \
+        while(true) {                                                                     \
+            OaHashInt slot_idx = hash & mask;                                             \
+            OaHashInt del_idx = h->slot_size;                                             \
+            OaHashInt step = 0;                                                           \
+            while(!IS_EMPTY(h->flags, slot_idx)) {                                        \
+                if(IS_DEL(h->flags, slot_idx)) {                                          \
+                    if(del_idx == h->slot_size)                                           \
+                        del_idx = slot_idx;                                               \
+                }                                                                         \
+                else if(hash_equal(key, h->keys[slot_idx])) {                             \
+                    h->values[slot_idx] = value;                                          \
+                    oa_##name##_shm_write_end(h);                                         \
+                    return true;                                                          \
+                }                                                                         \
+                slot_idx = (slot_idx + (++step)) & mask;                                  \
+            }                                                                             \
+            if(del_idx == h->slot_size && hdr->occupied_size >= hdr->upper_limit) {       \
+                if(hdr->size >= hdr->upper_limit) {                                       \
+                    oa_##name##_shm_write_end(h);                                         \
+                    return false;                                                         \
+                }                                                                         \
+                oa_##name##_shm_compact(h);                                               \
+                continue;                                                                 \
+            }                                                                             \
+            if(del_idx != h->slot_size)                                                   \
+                slot_idx = del_idx;                                                       \
+            else                                                                          \
+                hdr->occupied_size++;                                                     \
+            h->keys[slot_idx] = key;                                                      \
+            h->values[slot_idx] = value;                                                  \
+            SET_EXIST(h->flags, slot_idx);                                                \
+            hdr->size++;                                                                  \
+            oa_##name##_shm_write_end(h);                                                 \
+            return true;                                                                  \
+        }                                                                                 \
+    }                                                                                     \
+    SCOPE void                                                                            \
+    oa_##name##_shm_delete(OaShm##name *h, key_t key) {                                   \
+        OaHashInt mask = h->slot_size - 1;                                                \
+        OaHashInt slot_idx = hash_func(key, 0U) & mask;                                   \
+        OaHashInt step = 0;                                                               \
+        oa_##name##_shm_write_begin(h);                                                   \
+        while(!IS_EMPTY(h->flags, slot_idx)) {                                            \
+            if(!IS_DEL(h->flags, slot_idx) && hash_equal(key, h->keys[slot_idx])) {       \
+                SET_DEL(h->flags, slot_idx);                                              \
+                h->hdr->size--;                                                           \
+                break;                                                                    \
+            }                                                                             \
+            slot_idx = (slot_idx + (++step)) & mask;                                      \
+        }                                                                                 \
+        oa_##name##_shm_write_end(h);                                                     \
+    }                                                                                     \
+
+#define oa_shm_t(name) OaShm##name
+#define oa_shm_create(name, shm_name, n) oa_##name##_shm_create(shm_name, n)
+#define oa_shm_attach(name, shm_name) oa_##name##_shm_attach(shm_name)
+#define oa_shm_attach_fd(name, fd) oa_##name##_shm_attach_fd(fd)
+#define oa_shm_detach(name, h) oa_##name##_shm_detach(h)
+#define oa_shm_get(name, h, key, value) oa_##name##_shm_get(h, key, value)
+#define oa_shm_put(name, h, key, value) oa_##name##_shm_put(h, key, value)
+#define oa_shm_delete(name, h, key) oa_##name##_shm_delete(h, key)
+#define oa_shm_compact(name, h) oa_##name##_shm_compact(h)
+#define oa_shm_write_begin(name, h) oa_##name##_shm_write_begin(h)
+#define oa_shm_write_end(name, h) oa_##name##_shm_write_end(h)
+#define oa_shm_size(name, h) oa_##name##_shm_size(h)
+#define oa_shm_fd(h) ((h)->fd)
+
+#define OA_SHM_MAP_INIT_UINT64(name, value_t)                                             \
+    OA_SHM_TYPE(name, uint64_t, value_t)                                                  \
+    OA_SHM_DEFINE_METHOD(name, static inline, uint64_t, value_t,                          \
+        oa_uint64_hash_func, oa_uint64_hash_equal)                                        \
+
+#define OA_SHM_MAP_INIT_UINT32(name, value_t)                                             \
+    OA_SHM_TYPE(name, uint32_t, value_t)                                                  \
+    OA_SHM_DEFINE_METHOD(name, static inline, uint32_t, value_t,                          \
+        oa_uint32_hash_func, oa_uint32_hash_equal)                                        \
+
+#endif
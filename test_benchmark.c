@@ -1,19 +1,161 @@
 #include <time.h>
+#include <math.h>
 #include "oa_hash.h"
+#include "oa_cuckoo.h"
+#include "oa_shm.h"
 #include "hashmap.h"
+#include "composite_map.h"
+#include "wordcount.h"
+#include "extcount.h"
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/wait.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
 
 #define MAX_LINE_LEN 1024
 
 OA_MAP_INIT_UINT64(map64, uint64_t, PRIu64)
 OA_MAP_INIT_STR(mapstr, const char *, "s")
+OA_MAP_INIT_STR(mapstr64, uint64_t, PRIu64)
 OA_MAP_INIT_UINT64_WANG_HASH(map64wang, uint64_t, PRIu64)
+OA_CUCKOO_MAP_INIT_UINT64(map64cuckoo, uint64_t, PRIu64)
+OA_COUNTER_INIT_UINT64(count64, uint64_t, PRIu64)
+OA_COUNTER_INIT_STR(count_str, uint64_t, PRIu64)
+OA_SHM_MAP_INIT_UINT64(shm64, uint64_t)
+OA_SET_INIT_UINT64(set64)
+OA_SET_INIT_UINT64_COMPACT(set64compact)
+#undef OA_INLINE_NUM
+#define OA_INLINE_NUM 4
+OA_MAP_INIT_UINT64(small64, uint64_t, PRIu64)
+#undef OA_INLINE_NUM
+#define OA_INLINE_NUM 0
+
+/*
+ * Hardware counters around a phase, read with perf_event_open when
+ * BENCH_PERF is set. Each counter is opened on its own, so one the CPU or
+ * the container refuses shows as n/a while the timings stay as they are.
+ * The counters are inherited, threads a phase starts count towards it.
+ */
+#define PERF_EVENT_NUM 5
+
+typedef struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} PerfEvent;
+
+#if defined(__linux__)
+#define PERF_CACHE_MISS(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8U) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16U))
+
+static const PerfEvent perf_events[PERF_EVENT_NUM] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"llc-misses", PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_LL)},
+    {"dtlb-misses", PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+#endif
+
+static int perf_fds[PERF_EVENT_NUM] = {-1, -1, -1, -1, -1};
+static double perf_counts[PERF_EVENT_NUM];
+static bool perf_on = false;
+
+static void
+perf_init() {
+    if(!getenv("BENCH_PERF"))
+        return;
+#if defined(__linux__)
+    for(int i = 0;i < PERF_EVENT_NUM;i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_events[i].type;
+        attr.config = perf_events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.inherit = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        perf_fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        perf_on |= perf_fds[i] >= 0;
+    }
+    if(!perf_on)
+        printf("perf counters unavailable:%s\n", strerror(errno));
+#else
+    printf("perf counters unavailable:not linux\n");
+#endif
+}
+
+static void
+perf_begin() {
+#if defined(__linux__)
+    for(int i = 0;perf_on && i < PERF_EVENT_NUM;i++) {
+        if(perf_fds[i] < 0)
+            continue;
+        ioctl(perf_fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+/* counts scaled up for the time a counter was multiplexed out, -1 if unread */
+static void
+perf_end() {
+#if defined(__linux__)
+    for(int i = 0;perf_on && i < PERF_EVENT_NUM;i++) {
+        uint64_t values[3];
+        perf_counts[i] = -1;
+        if(perf_fds[i] < 0)
+            continue;
+        ioctl(perf_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        if(read(perf_fds[i], values, sizeof(values)) == sizeof(values) && values[2])
+            perf_counts[i] = (double)values[0] * values[1] / values[2];
+    }
+#endif
+}
+
+static void
+perf_report(uint64_t ops) {
+    if(!perf_on || !ops)
+        return;
+    printf("    per op");
+    for(int i = 0;i < PERF_EVENT_NUM;i++) {
+#if defined(__linux__)
+        if(perf_counts[i] < 0)
+            printf(",%s:n/a", perf_events[i].name);
+        else
+            printf(",%s:%0.2f", perf_events[i].name, perf_counts[i] / ops);
+#endif
+    }
+    if(perf_counts[0] > 0 && perf_counts[1] >= 0)
+        printf(",ipc:%0.2f", perf_counts[1] / perf_counts[0]);
+    printf("\n");
+}
+
+static double
+wall_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
 
 static void
 test_open_address_hash() {
     oa_hash_t(mapstr) *map_str2 = oa_hash_new(mapstr);
     FILE *f = fopen("oliver_twist_word.txt", "r");
     unsigned char buffer[MAX_LINE_LEN];
+    uint64_t inserts = 0;
     clock_t t1 = clock();
+    perf_begin();
     while(fgets(buffer, MAX_LINE_LEN, f) != NULL) {
         size_t len = strlen(buffer);
         if(buffer[len - 1] == '\n') {
@@ -21,13 +163,16 @@ test_open_address_hash() {
             char *value = malloc(len*sizeof(unsigned char));
             strcpy(value, buffer);
             oa_hash_map_add(mapstr, map_str2, buffer, (const char *)value);
+            inserts++;
         }
         else
             printf("too long line\n");
     }
     clock_t t2 = clock();
+    perf_end();
     double dur = 1000.0*(t2-t1)/CLOCKS_PER_SEC;
     printf("open address hash with string key,insert CPU time used:%0.2fms\n", dur);
+    perf_report(inserts);
     fclose(f);
 
     f = fopen("oliver_twist_word.txt", "r");
@@ -49,20 +194,31 @@ test_open_address_hash() {
     oa_hash_free(mapstr, map_str2);
 
     t1 = clock();
+    perf_begin();
     oa_hash_t(map64) *map = oa_hash_new(map64);
     for(uint64_t i = 0;i < 1000000;i++) {
         oa_hash_map_add(map64, map, i, i+1);
     }
     t2 = clock();
+    perf_end();
     dur = 1000.0*(t2-t1)/CLOCKS_PER_SEC;
     printf("open address hash with uint64_t key,insert CPU time used:%0.2fms\n", dur);
-    for(uint64_t i = 0;i < 1000000;i++) {
-        assert(oa_hash_get(map64, map, i) != oa_hash_end(map));
-        assert(oa_hash_value(map, oa_hash_get(map64, map, i)) == i+1);
-    }
+    perf_report(1000000);
+    uint64_t sum = 0;
+    t1 = clock();
+    perf_begin();
+    for(uint64_t i = 0;i < 1000000;i++)
+        sum += oa_hash_value(map, oa_hash_get(map64, map, i));
+    t2 = clock();
+    perf_end();
+    assert(sum == 1000000ULL * 1000001ULL / 2U);
+    dur = 1000.0*(t2-t1)/CLOCKS_PER_SEC;
+    printf("open address hash with uint64_t key,query CPU time used:%0.2fms\n", dur);
+    perf_report(1000000);
     oa_hash_free(map64, map);
 
     t1 = clock();
+    perf_begin();
     oa_hash_t(map64) *map2 = oa_hash_new(map64);
     for(uint64_t i = 0;i < 1000000U;i++) {
         uint64_t key = i << 32U | 1U;
@@ -70,17 +226,25 @@ test_open_address_hash() {
         oa_hash_map_add(map64, map2, key, value);
     }
     t2 = clock();
+    perf_end();
     dur = 1000.0*(t2-t1)/CLOCKS_PER_SEC;
     printf("open address hash with uint64_t key of same low bits,insert CPU time used:%0.2fms\n", dur);
-    for(uint64_t i = 0;i < 1000000U;i++) {
-        uint64_t key = i << 32U | 1U;
-        uint64_t value = i+1U;
-        uint32_t idx = oa_hash_get(map64, map2, key);
-        assert(oa_hash_value(map2, idx) == value);
-    }
+    perf_report(1000000);
+    sum = 0;
+    t1 = clock();
+    perf_begin();
+    for(uint64_t i = 0;i < 1000000U;i++)
+        sum += oa_hash_value(map2, oa_hash_get(map64, map2, i << 32U | 1U));
+    t2 = clock();
+    perf_end();
+    assert(sum == 1000000ULL * 1000001ULL / 2U);
+    dur = 1000.0*(t2-t1)/CLOCKS_PER_SEC;
+    printf("open address hash with uint64_t key of same low bits,query CPU time used:%0.2fms\n", dur);
+    perf_report(1000000);
     oa_hash_free(map64, map2);
 
     t1 = clock();
+    perf_begin();
     oa_hash_t(map64wang) *map_wang = oa_hash_new(map64wang);
     for(uint64_t i = 0;i < 1000000U;i++) {
         uint64_t key = i << 32U | 1U;
@@ -88,15 +252,92 @@ test_open_address_hash() {
         oa_hash_map_add(map64wang, map_wang, key, value);
     }
     t2 = clock();
+    perf_end();
     dur = 1000.0*(t2-t1)/CLOCKS_PER_SEC;
     printf("open address wang hash with uint64_t key of same low bits,insert CPU time used:%0.2fms\n", dur);
+    perf_report(1000000);
+    sum = 0;
+    t1 = clock();
+    perf_begin();
+    for(uint64_t i = 0;i < 1000000U;i++)
+        sum += oa_hash_value(map_wang, oa_hash_get(map64wang, map_wang, i << 32U | 1U));
+    t2 = clock();
+    perf_end();
+    assert(sum == 1000000ULL * 1000001ULL / 2U);
+    dur = 1000.0*(t2-t1)/CLOCKS_PER_SEC;
+    printf("open address wang hash with uint64_t key of same low bits,query CPU time used:%0.2fms\n", dur);
+    perf_report(1000000);
+    oa_hash_free(map64wang, map_wang);
+
+    t1 = clock();
+    perf_begin();
+    oa_hash_t(map64cuckoo) *map_cuckoo = oa_hash_new(map64cuckoo);
     for(uint64_t i = 0;i < 1000000U;i++) {
         uint64_t key = i << 32U | 1U;
         uint64_t value = i+1U;
-        uint32_t idx = oa_hash_get(map64wang, map_wang, key);
-        assert(oa_hash_value(map_wang, idx) == value);
+        oa_hash_map_add(map64cuckoo, map_cuckoo, key, value);
+    }
+    t2 = clock();
+    perf_end();
+    dur = 1000.0*(t2-t1)/CLOCKS_PER_SEC;
+    printf("cuckoo hash with uint64_t key of same low bits,insert CPU time used:%0.2fms,load factor:%0.2f\n",
+        dur, (double)oa_hash_size(map_cuckoo) / oa_hash_slot_size(map_cuckoo));
+    perf_report(1000000);
+    sum = 0;
+    t1 = clock();
+    perf_begin();
+    for(uint64_t i = 0;i < 1000000U;i++)
+        sum += oa_hash_value(map_cuckoo, oa_hash_get(map64cuckoo, map_cuckoo, i << 32U | 1U));
+    t2 = clock();
+    perf_end();
+    assert(sum == 1000000ULL * 1000001ULL / 2U);
+    dur = 1000.0*(t2-t1)/CLOCKS_PER_SEC;
+    printf("cuckoo hash with uint64_t key of same low bits,query CPU time used:%0.2fms\n", dur);
+    perf_report(1000000);
+    oa_hash_free(map64cuckoo, map_cuckoo);
+}
+
+static void
+test_bloom_prefilter() {
+    for(int use_bloom = 0;use_bloom <= 1;use_bloom++) {
+        oa_hash_t(map64wang) *map = oa_hash_new(map64wang);
+        if(use_bloom)
+            oa_hash_enable_bloom(map64wang, map, BLOOM_DEFAULT_BITS_PER_KEY);
+        for(uint64_t i = 0;i < 1000000U;i++)
+            oa_hash_map_add(map64wang, map, i << 32U | 1U, i);
+        clock_t t1 = clock();
+        perf_begin();
+        uint64_t hit = 0;
+        for(uint64_t i = 0;i < 10000000U;i++) {
+            uint64_t key = i % 10U == 0 ? (i / 10U) << 32U | 1U : i << 32U | 2U;
+            if(oa_hash_get(map64wang, map, key) != oa_hash_end(map))
+                hit++;
+        }
+        clock_t t2 = clock();
+        perf_end();
+        assert(hit == 1000000U);
+        double dur = 1000.0*(t2-t1)/CLOCKS_PER_SEC;
+        printf("open address wang hash, 90%% misses, bloom:%d,query CPU time used:%0.2fms\n", use_bloom, dur);
+        perf_report(10000000);
+        uint64_t batch[OA_BATCH_SIZE];
+        OaHashInt slots[OA_BATCH_SIZE];
+        t1 = clock();
+        perf_begin();
+        for(uint64_t i = 0;i < 10000000U;i += OA_BATCH_SIZE) {
+            for(uint64_t j = i;j < i + OA_BATCH_SIZE;j++)
+                batch[j - i] = j % 10U == 0 ? (j / 10U) << 32U | 1U : j << 32U | 2U;
+            oa_hash_get_batch(map64wang, map, batch, OA_BATCH_SIZE, slots);
+            for(uint32_t j = 0;j < OA_BATCH_SIZE;j++)
+                hit -= slots[j] != oa_hash_end(map);
+        }
+        t2 = clock();
+        perf_end();
+        assert(hit == 0);
+        dur = 1000.0*(t2-t1)/CLOCKS_PER_SEC;
+        printf("open address wang hash, 90%% misses, bloom:%d,batch query CPU time used:%0.2fms\n", use_bloom, dur);
+        perf_report(10000000);
+        oa_hash_free(map64wang, map);
     }
-    oa_hash_free(map64wang, map_wang);
 }
 
 static int
@@ -137,6 +378,10 @@ MapType str_key_hash_type = {
     copy_str_val_cb,   //copy_val
     free_str_key_cb,   //key_destructor
     free_str_val_cb,   //val_destructor
+    NULL,              //serialize_key
+    NULL,              //deserialize_key
+    NULL,              //serialize_val
+    NULL,              //deserialize_val
 };
 
 uint64_t hash_cb(const void *key) {
@@ -176,6 +421,10 @@ MapType uint64_key_hash_type = {
     copy_val_cb,   //copy_val
     free_key_cb,   //key_destructor
     free_val_cb,   //val_destructor
+    NULL,          //serialize_key
+    NULL,          //deserialize_key
+    NULL,          //serialize_val
+    NULL,          //deserialize_val
 };
 
 static void
@@ -183,32 +432,52 @@ test_link_hash() {
     HashMap *m = new_hashmap(&str_key_hash_type);
     FILE *f = fopen("oliver_twist_word.txt", "r");
     char buffer[MAX_LINE_LEN];
+    uint64_t inserts = 0;
     clock_t t1 = clock();
+    perf_begin();
     while(fgets(buffer, MAX_LINE_LEN, f) != NULL) {
         size_t len = strlen(buffer);
         if(buffer[len - 1] == '\n') {
             int val = 1;
             buffer[len - 1] = '\0';
             add_hashmap(m, (void *)buffer, (void *)&val);
+            inserts++;
         }
         else
             printf("too long line\n");
     }
     clock_t t2 = clock();
+    perf_end();
     double dur = 1000.0*(t2-t1)/CLOCKS_PER_SEC;
     printf("link hash with string key,insert CPU time used:%0.2fms\n", dur);
+    perf_report(inserts);
     
     t1 = clock();
+    perf_begin();
     HashMap *m2 = new_hashmap(&uint64_key_hash_type);
     for(uint64_t i = 0;i < 1000000;i++) {
         int val = 1;
         add_hashmap(m2, (void *)&i, (void *)&val);
     }
     t2 = clock();
+    perf_end();
     dur = 1000.0*(t2-t1)/CLOCKS_PER_SEC;
     printf("link hash with uint64_t key,insert CPU time used:%0.2fms\n", dur);
+    perf_report(1000000);
+    uint64_t sum = 0;
+    t1 = clock();
+    perf_begin();
+    for(uint64_t i = 0;i < 1000000;i++)
+        sum += *(int *)query_hashmap(m2, (void *)&i);
+    t2 = clock();
+    perf_end();
+    assert(sum == 1000000U);
+    dur = 1000.0*(t2-t1)/CLOCKS_PER_SEC;
+    printf("link hash with uint64_t key,query CPU time used:%0.2fms\n", dur);
+    perf_report(1000000);
 
     t1 = clock();
+    perf_begin();
     HashMap *m3 = new_hashmap(&uint64_key_hash_type);
     for(uint64_t i = 0;i < 1000000;i++) {
         uint64_t key = i << 32 | 1;
@@ -216,11 +485,1479 @@ test_link_hash() {
         add_hashmap(m3, (void *)&key, (void *)&val);
     }
     t2 = clock();
+    perf_end();
     dur = 1000.0*(t2-t1)/CLOCKS_PER_SEC;
     printf("link hash with uint64_t key of same low bits,insert CPU time used:%0.2fms\n", dur);
+    perf_report(1000000);
+    sum = 0;
+    t1 = clock();
+    perf_begin();
+    for(uint64_t i = 0;i < 1000000;i++) {
+        uint64_t key = i << 32 | 1;
+        sum += *(int *)query_hashmap(m3, (void *)&key);
+    }
+    t2 = clock();
+    perf_end();
+    assert(sum == 1000000ULL * 1000001ULL / 2U);
+    dur = 1000.0*(t2-t1)/CLOCKS_PER_SEC;
+    printf("link hash with uint64_t key of same low bits,query CPU time used:%0.2fms\n", dur);
+    perf_report(1000000);
+}
+
+#define TTL_KEYS 100000U
+#define TTL_LONG_MS 3600000U
+
+/* lazy and active expiry, persist, ttl readback, and overwrite or remove dropping the deadline */
+static void
+test_ttl() {
+    HashMap *m = new_hashmap(&uint64_key_hash_type);
+    int val = 1;
+    uint64_t key = 1;
+    int ret = add_hashmap_ttl(m, &key, &val, 0);
+    assert(ret == ADD && m->count == 1);
+    void *found = query_hashmap(m, &key);
+    assert(found == NULL && m->count == 0 && m->ext->expires->count == 0);
+    int64_t ttl = ttl_hashmap(m, &key);
+    assert(ttl == TTL_MISSING);
+    ret = expire_hashmap(m, &key, TTL_LONG_MS);
+    assert(ret == FAILED);
+
+    add_hashmap_ttl(m, &key, &val, TTL_LONG_MS);
+    ttl = ttl_hashmap(m, &key);
+    assert(ttl > (int64_t)TTL_LONG_MS - 1000 && ttl <= (int64_t)TTL_LONG_MS);
+    ret = persist_hashmap(m, &key);
+    ttl = ttl_hashmap(m, &key);
+    assert(ret == SUCC && ttl == TTL_NONE);
+    ret = persist_hashmap(m, &key);
+    assert(ret == FAILED);
+    expire_hashmap(m, &key, 0);
+    ttl = ttl_hashmap(m, &key);
+    assert(ttl == TTL_MISSING && m->count == 0);
+
+    // a plain add over a key with a deadline keeps it for good
+    add_hashmap_ttl(m, &key, &val, 0);
+    val = 2;
+    add_hashmap(m, &key, &val);
+    ttl = ttl_hashmap(m, &key);
+    found = query_hashmap(m, &key);
+    assert(m->ext->expires->count == 0 && ttl == TTL_NONE && *(int *)found == 2);
+    // and a removed one comes back without the old deadline
+    expire_hashmap(m, &key, TTL_LONG_MS);
+    remove_hashmap(m, &key);
+    assert(m->ext->expires->count == 0);
+    add_hashmap(m, &key, &val);
+    ttl = ttl_hashmap(m, &key);
+    assert(ttl == TTL_NONE);
+    remove_hashmap(m, &key);
+
+    // odd keys are due right away, even ones in an hour
+    for(uint64_t i = 0;i < TTL_KEYS;i++)
+        add_hashmap_ttl(m, &i, &val, i % 2 ? 0 : TTL_LONG_MS);
+    key = TTL_KEYS;
+    add_hashmap(m, &key, &val);
+    double t1 = wall_ms();
+    int expired = 0, round;
+    for(round = 0;m->ext->expires->count > (int)(TTL_KEYS / 2);round++)
+        expired += active_expire_hashmap(m, 1000);
+    printf("link hash, active expire of %d out of %u keys, rounds:%d,time:%0.2fms\n",
+        expired, TTL_KEYS, round, wall_ms() - t1);
+    assert(expired == TTL_KEYS / 2 && m->count == TTL_KEYS / 2 + 1);
+    uint64_t live = 0;
+    for(uint64_t i = 0;i < TTL_KEYS;i++)
+        live += query_hashmap(m, &i) != NULL && i % 2 == 0;
+    found = query_hashmap(m, &key);
+    assert(live == TTL_KEYS / 2 && found != NULL);
+    (void)ret;
+    (void)ttl;
+    (void)found;
+    free_hashmap(m);
+}
+
+#define TRACE_LEN 5000000U
+#define TRACE_KEYS 200000U
+#define CACHE_CAPACITY 20000
+
+typedef struct LruNode {
+    uint64_t key;
+    struct LruNode *prev;
+    struct LruNode *next;
+} LruNode;
+
+MapType lru_key_hash_type = {
+    hash_cb,       //hash_function
+    compare_cb,    //key_cmp
+    copy_key_cb,   //copy_key
+    NULL,          //copy_val
+    free_key_cb,   //key_destructor
+    NULL,          //val_destructor
+    NULL,          //serialize_key
+    NULL,          //deserialize_key
+    NULL,          //serialize_val
+    NULL,          //deserialize_val
+};
+
+static uint64_t
+xorshift64(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/* zipf(0.99) distributed keys, spread over the key space */
+static uint64_t *
+gen_zipf_trace() {
+    double *cdf = malloc(TRACE_KEYS * sizeof(double));
+    double sum = 0;
+    for(uint32_t i = 0;i < TRACE_KEYS;i++) {
+        sum += 1.0 / pow(i + 1, 0.99);
+        cdf[i] = sum;
+    }
+    uint64_t *trace = malloc(TRACE_LEN * sizeof(uint64_t));
+    uint64_t state = 88172645463325252ULL;
+    for(uint32_t i = 0;i < TRACE_LEN;i++) {
+        double u = (xorshift64(&state) >> 11) * (1.0 / 9007199254740992.0) * sum;
+        uint32_t lo = 0, hi = TRACE_KEYS - 1;
+        while(lo < hi) {
+            uint32_t mid = (lo + hi) / 2;
+            if(cdf[mid] < u)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        trace[i] = (uint64_t)lo * 0x9E3779B97F4A7C15ULL;
+    }
+    free(cdf);
+    return trace;
+}
+
+#define BLOOM_CHECK_KEYS 20000U
+
+/* batch lookups answer as single ones do, with and without the filter and across a rehash */
+static void
+test_bloom_batch() {
+    uint64_t *keys = malloc(BLOOM_CHECK_KEYS * 3 * sizeof(uint64_t));
+    const void **ptrs = malloc(BLOOM_CHECK_KEYS * 3 * sizeof(void *));
+    OaHashInt *slots = malloc(BLOOM_CHECK_KEYS * 3 * sizeof(OaHashInt));
+    void **values = malloc(BLOOM_CHECK_KEYS * 3 * sizeof(void *));
+    for(uint32_t i = 0;i < BLOOM_CHECK_KEYS * 3;i++) {
+        keys[i] = (uint64_t)i << 32U | 1U;
+        ptrs[i] = &keys[i];
+    }
+    int one = 1;
+    for(int use_bloom = 0;use_bloom <= 1;use_bloom++) {
+        oa_hash_t(map64wang) *h = oa_hash_new(map64wang);
+        HashMap *m = new_hashmap(&uint64_key_hash_type);
+        if(use_bloom) {
+            oa_hash_enable_bloom(map64wang, h, BLOOM_DEFAULT_BITS_PER_KEY);
+            enable_hashmap_bloom(m, BLOOM_DEFAULT_BITS_PER_KEY);
+        }
+        // half the keys in, then the other half grows both tables
+        uint32_t mismatch = 0;
+        for(uint32_t round = 1;round <= 2;round++) {
+            OaHashInt old_slots = oa_hash_slot_size(h);
+            int old_slots_size = m->slots_size;
+            for(uint32_t i = (round - 1) * BLOOM_CHECK_KEYS;i < round * BLOOM_CHECK_KEYS;i++) {
+                oa_hash_map_add(map64wang, h, keys[i], i);
+                add_hashmap(m, &keys[i], &one);
+            }
+            assert(round == 1 || (oa_hash_slot_size(h) != old_slots && m->slots_size != old_slots_size));
+            oa_hash_get_batch(map64wang, h, keys, BLOOM_CHECK_KEYS * 3, slots);
+            query_hashmap_batch(m, ptrs, BLOOM_CHECK_KEYS * 3, values);
+            for(uint32_t i = 0;i < BLOOM_CHECK_KEYS * 3;i++) {
+                bool present = i < round * BLOOM_CHECK_KEYS;
+                mismatch += slots[i] != oa_hash_get(map64wang, h, keys[i]);
+                mismatch += (slots[i] != oa_hash_end(h)) != present;
+                mismatch += values[i] != query_hashmap(m, ptrs[i]);
+                mismatch += (values[i] != NULL) != present;
+            }
+            (void)old_slots;
+            (void)old_slots_size;
+        }
+        assert(mismatch == 0);
+        (void)mismatch;
+        oa_hash_free(map64wang, h);
+        free_hashmap(m);
+    }
+    free(keys);
+    free(ptrs);
+    free(slots);
+    free(values);
+}
+
+#define BLOOM_STR_KEYS 1000000U
+#define BLOOM_STR_KEY_LEN 48
+#define BLOOM_STR_QUERIES 2000000U
+
+/*
+ * Misses that have to touch keys: chains of string keys and long string
+ * keys in open addressing, one lookup at a time and in batches.
+ */
+static void
+test_bloom_str_keys() {
+    char *keys = malloc((size_t)BLOOM_STR_KEYS * 2 * BLOOM_STR_KEY_LEN);
+    for(uint32_t i = 0;i < BLOOM_STR_KEYS * 2;i++)
+        snprintf(keys + (size_t)i * BLOOM_STR_KEY_LEN, BLOOM_STR_KEY_LEN,
+            "tenant/%08u/session/%016"PRIx64, i % 1000, (uint64_t)i * UINT64_C(0x9e3779b97f4a7c15));
+    // one in ten queries hits, all in random order
+    const char **queries = malloc(BLOOM_STR_QUERIES * sizeof(char *));
+    uint64_t state = 2463534242ULL;
+    for(uint32_t i = 0;i < BLOOM_STR_QUERIES;i++) {
+        uint64_t idx = xorshift64(&state) % BLOOM_STR_KEYS + (i % 10U ? BLOOM_STR_KEYS : 0);
+        queries[i] = keys + idx * BLOOM_STR_KEY_LEN;
+    }
+    OaHashInt *slots = malloc(BLOOM_STR_QUERIES * sizeof(OaHashInt));
+    void **values = malloc(BLOOM_STR_QUERIES * sizeof(void *));
+    int one = 1;
+    for(int use_bloom = 0;use_bloom <= 1;use_bloom++) {
+        HashMap *m = new_hashmap(&str_key_hash_type);
+        oa_hash_t(mapstr64) *h = oa_hash_new(mapstr64);
+        for(uint32_t i = 0;i < BLOOM_STR_KEYS;i++) {
+            add_hashmap(m, keys + (size_t)i * BLOOM_STR_KEY_LEN, &one);
+            oa_hash_map_add(mapstr64, h, keys + (size_t)i * BLOOM_STR_KEY_LEN, 1);
+        }
+        if(use_bloom) {
+            enable_hashmap_bloom(m, BLOOM_DEFAULT_BITS_PER_KEY);
+            oa_hash_enable_bloom(mapstr64, h, BLOOM_DEFAULT_BITS_PER_KEY);
+        }
+        uint64_t hit = 0;
+        double t1 = wall_ms();
+        perf_begin();
+        for(uint32_t i = 0;i < BLOOM_STR_QUERIES;i++)
+            hit += query_hashmap(m, queries[i]) != NULL;
+        perf_end();
+        printf("link hash with string key, 90%% misses, bloom:%d,query time:%0.2fms\n", use_bloom, wall_ms() - t1);
+        perf_report(BLOOM_STR_QUERIES);
+        t1 = wall_ms();
+        perf_begin();
+        query_hashmap_batch(m, (const void **)queries, BLOOM_STR_QUERIES, values);
+        perf_end();
+        printf("link hash with string key, 90%% misses, bloom:%d,batch query time:%0.2fms\n", use_bloom,
+            wall_ms() - t1);
+        perf_report(BLOOM_STR_QUERIES);
+        for(uint32_t i = 0;i < BLOOM_STR_QUERIES;i++)
+            hit -= values[i] != NULL;
+
+        t1 = wall_ms();
+        perf_begin();
+        for(uint32_t i = 0;i < BLOOM_STR_QUERIES;i++)
+            hit += oa_hash_get(mapstr64, h, queries[i]) != oa_hash_end(h);
+        perf_end();
+        printf("open address hash with long string key, 90%% misses, bloom:%d,query time:%0.2fms\n", use_bloom,
+            wall_ms() - t1);
+        perf_report(BLOOM_STR_QUERIES);
+        t1 = wall_ms();
+        perf_begin();
+        oa_hash_get_batch(mapstr64, h, queries, BLOOM_STR_QUERIES, slots);
+        perf_end();
+        printf("open address hash with long string key, 90%% misses, bloom:%d,batch query time:%0.2fms\n",
+            use_bloom, wall_ms() - t1);
+        perf_report(BLOOM_STR_QUERIES);
+        for(uint32_t i = 0;i < BLOOM_STR_QUERIES;i++)
+            hit -= slots[i] != oa_hash_end(h);
+        assert(hit == 0);
+        free_hashmap(m);
+        oa_hash_free(mapstr64, h);
+    }
+    free(keys);
+    free(queries);
+    free(slots);
+    free(values);
+}
+
+#define COMPACT_KEYS 1000000U
+
+/* random keys in the plain and the quotiented set, membership, key recovery, deletes and memory */
+static void
+test_compact_set() {
+    uint64_t *keys = malloc(COMPACT_KEYS * sizeof(uint64_t));
+    uint64_t state = 2463534242ULL;
+    for(uint32_t i = 0;i < COMPACT_KEYS;i++)
+        keys[i] = xorshift64(&state);
+    oa_hash_t(set64) *plain = oa_hash_new(set64);
+    oa_hash_t(set64compact) *compact = oa_hash_new(set64compact);
+    for(uint32_t i = 0;i < COMPACT_KEYS;i++) {
+        oa_hash_set_add(set64, plain, keys[i]);
+        oa_hash_set_add(set64compact, compact, keys[i]);
+    }
+    assert(oa_hash_size(compact) == oa_hash_size(plain) && oa_hash_size(plain) == COMPACT_KEYS);
+
+    // every stored key comes back as it went in
+    uint64_t key;
+    uint32_t recovered = 0;
+    oa_compact_foreach(set64compact, compact, key, {
+        recovered += oa_hash_get(set64, plain, key) != oa_hash_end(plain);
+    });
+    assert(recovered == COMPACT_KEYS);
+    OaHashInt idx = oa_hash_get(set64compact, compact, keys[0]);
+    assert(idx != oa_hash_end(compact) && oa_compact_key(set64compact, compact, idx) == keys[0]);
+
+    size_t plain_bytes = oa_set64_bytes(oa_hash_slot_size(plain));
+    size_t compact_bytes = oa_set64compact_bytes(oa_hash_slot_size(compact));
+    printf("compact set, %u keys,bytes:%zu,entry bytes:%"PRIu32",plain set bytes:%zu\n",
+        COMPACT_KEYS, compact_bytes, compact->entry_bytes, plain_bytes);
+
+    // hits on the first pass, misses on the second
+    for(int miss = 0;miss <= 1;miss++) {
+        uint32_t plain_hits = 0, compact_hits = 0;
+        double t1 = wall_ms();
+        perf_begin();
+        for(uint32_t i = 0;i < COMPACT_KEYS;i++)
+            plain_hits += oa_hash_get(set64, plain, keys[i] + miss) != oa_hash_end(plain);
+        perf_end();
+        printf("%s, plain set time:%0.2fms\n", miss ? "misses" : "hits", wall_ms() - t1);
+        perf_report(COMPACT_KEYS);
+        t1 = wall_ms();
+        perf_begin();
+        for(uint32_t i = 0;i < COMPACT_KEYS;i++)
+            compact_hits += oa_hash_get(set64compact, compact, keys[i] + miss) != oa_hash_end(compact);
+        perf_end();
+        printf("%s, compact set time:%0.2fms\n", miss ? "misses" : "hits", wall_ms() - t1);
+        perf_report(COMPACT_KEYS);
+        assert(plain_hits == compact_hits && compact_hits == (miss ? 0 : COMPACT_KEYS));
+        (void)plain_hits;
+        (void)compact_hits;
+    }
+
+    for(uint32_t i = 0;i < COMPACT_KEYS;i += 2)
+        oa_hash_delete(set64compact, compact, keys[i]);
+    uint32_t left = 0;
+    for(uint32_t i = 0;i < COMPACT_KEYS;i++)
+        left += (oa_hash_get(set64compact, compact, keys[i]) != oa_hash_end(compact)) == (i % 2 == 1);
+    assert(oa_hash_size(compact) == COMPACT_KEYS / 2 && left == COMPACT_KEYS);
+    uint64_t sum = 0, expect = 0;
+    oa_compact_foreach(set64compact, compact, key, {
+        sum += key;
+    });
+    for(uint32_t i = 1;i < COMPACT_KEYS;i += 2)
+        expect += keys[i];
+    assert(sum == expect);
+    (void)idx;
+    (void)recovered;
+    (void)left;
+    (void)sum;
+    (void)expect;
+    oa_hash_free(set64, plain);
+    oa_hash_free(set64compact, compact);
+    free(keys);
+}
+
+static void
+test_cache_replay() {
+    uint64_t *trace = gen_zipf_trace();
+
+    HashMap *clock_cache = new_hashmap(&uint64_key_hash_type);
+    enable_hashmap_cache(clock_cache, CACHE_CAPACITY, NULL, NULL);
+    clock_t t1 = clock();
+    for(uint32_t i = 0;i < TRACE_LEN;i++) {
+        if(query_hashmap(clock_cache, &trace[i]) == NULL) {
+            int val = 1;
+            add_hashmap(clock_cache, &trace[i], &val);
+        }
+    }
+    clock_t t2 = clock();
+    CacheStats stats;
+    get_hashmap_cache_stats(clock_cache, &stats);
+    double dur = 1000.0*(t2-t1)/CLOCKS_PER_SEC;
+    printf("clock cache replay,hit ratio:%0.4f,evictions:%"PRIu64",CPU time used:%0.2fms\n",
+        (double)stats.hits / TRACE_LEN, stats.evictions, dur);
+    free_hashmap(clock_cache);
+
+    HashMap *lru_map = new_hashmap(&lru_key_hash_type);
+    LruNode head = {0, &head, &head};
+    uint64_t hits = 0;
+    int count = 0;
+    t1 = clock();
+    for(uint32_t i = 0;i < TRACE_LEN;i++) {
+        LruNode *node = query_hashmap(lru_map, &trace[i]);
+        if(node) {
+            hits++;
+            node->prev->next = node->next;
+            node->next->prev = node->prev;
+        }
+        else {
+            if(count >= CACHE_CAPACITY) {
+                LruNode *victim = head.prev;
+                victim->prev->next = &head;
+                head.prev = victim->prev;
+                remove_hashmap(lru_map, &victim->key);
+                free(victim);
+                count--;
+            }
+            node = malloc(sizeof(LruNode));
+            node->key = trace[i];
+            add_hashmap(lru_map, &node->key, node);
+            count++;
+        }
+        node->next = head.next;
+        node->prev = &head;
+        head.next->prev = node;
+        head.next = node;
+    }
+    t2 = clock();
+    dur = 1000.0*(t2-t1)/CLOCKS_PER_SEC;
+    printf("naive lru replay,hit ratio:%0.4f,CPU time used:%0.2fms\n", (double)hits / TRACE_LEN, dur);
+    for(LruNode *node = head.next;node != &head;) {
+        LruNode *next = node->next;
+        free(node);
+        node = next;
+    }
+    free_hashmap(lru_map);
+    free(trace);
+}
+
+#define CLOCK_CAPACITY 256
+#define CLOCK_HOT 32
+#define CLOCK_STREAM 20000U
+
+static void
+count_evicted_cb(const void *key, void *value, void *extra) {
+    (void)value;
+    uint64_t *evicted = extra;
+    evicted[0]++;
+    evicted[1] += *(const uint64_t *)key < CLOCK_HOT;
+}
+
+static int
+keep_even_cb(const void *key, void *value, void *extra) {
+    (void)value;
+    (void)extra;
+    return *(const uint64_t *)key % 2 == 0;
+}
+
+/* keys hit between every add outlive a stream of one-off keys, removes and retain keep the count */
+static void
+test_cache_clock() {
+    HashMap *m = new_hashmap(&uint64_key_hash_type);
+    uint64_t evicted[2] = {0, 0};
+    enable_hashmap_cache(m, CLOCK_CAPACITY, count_evicted_cb, evicted);
+    int val = 1;
+    uint64_t missing = 0;
+    for(uint64_t i = 0;i < CLOCK_STREAM;i++) {
+        add_hashmap(m, &i, &val);
+        for(uint64_t k = 0;k < CLOCK_HOT && k <= i;k++)
+            missing += query_hashmap(m, &k) == NULL;
+        if(i % 100 == 99) {
+            // a removed hot key comes straight back
+            uint64_t k = i / 100 % CLOCK_HOT;
+            remove_hashmap(m, &k);
+            add_hashmap(m, &k, &val);
+        }
+    }
+    assert(missing == 0 && evicted[1] == 0 && m->count == CLOCK_CAPACITY);
+    assert(evicted[0] == CLOCK_STREAM - CLOCK_CAPACITY);
+    int dropped = retain_hashmap(m, keep_even_cb, NULL);
+    uint64_t left = 0;
+    for(uint64_t i = 0;i < CLOCK_STREAM;i++)
+        left += query_hashmap(m, &i) != NULL;
+    assert(left == (uint64_t)m->count && m->count + dropped == CLOCK_CAPACITY);
+    for(uint64_t i = CLOCK_STREAM;i < CLOCK_STREAM + CLOCK_CAPACITY;i++)
+        add_hashmap(m, &i, &val);
+    assert(m->count == CLOCK_CAPACITY);
+    CacheStats stats;
+    get_hashmap_cache_stats(m, &stats);
+    printf("clock cache, %u one-off keys past %d hot ones,evictions:%"PRIu64",hits:%"PRIu64"\n",
+        CLOCK_STREAM, CLOCK_HOT, stats.evictions, stats.hits);
+    (void)missing;
+    (void)dropped;
+    (void)left;
+    free_hashmap(m);
+}
+
+#define TENANTS 2000
+#define USERS 100
+#define COUNTERS 2
+
+static void
+free_nested_cb(void *val) {
+    free_hashmap((HashMap *)val);
+}
+
+MapType nested_key_hash_type = {
+    hash_cb,          //hash_function
+    compare_cb,       //key_cmp
+    copy_key_cb,      //copy_key
+    NULL,             //copy_val
+    free_key_cb,      //key_destructor
+    free_nested_cb,   //val_destructor
+    NULL,             //serialize_key
+    NULL,             //deserialize_key
+    NULL,             //serialize_val
+    NULL,             //deserialize_val
+};
+
+static size_t
+heap_used() {
+#if defined(__GLIBC__)
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+/* tenant -> user -> counter, as nested HashMaps and as one composite map */
+static void
+test_composite_map() {
+    uint32_t total = TENANTS * USERS * COUNTERS;
+    uint32_t *order = malloc(total * sizeof(uint32_t));
+    uint64_t state = 88172645463325252ULL;
+    for(uint32_t i = 0;i < total;i++)
+        order[i] = i;
+    for(uint32_t i = total - 1;i > 0;i--) {
+        uint32_t j = xorshift64(&state) % (i + 1);
+        uint32_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    size_t base = heap_used();
+    clock_t t1 = clock();
+    perf_begin();
+    HashMap *tenants = new_hashmap(&nested_key_hash_type);
+    for(uint64_t t = 0;t < TENANTS;t++) {
+        HashMap *users = new_hashmap(&nested_key_hash_type);
+        add_hashmap(tenants, (void *)&t, (void *)users);
+        for(uint64_t u = 0;u < USERS;u++) {
+            HashMap *counters = new_hashmap(&uint64_key_hash_type);
+            add_hashmap(users, (void *)&u, (void *)counters);
+            for(uint64_t c = 0;c < COUNTERS;c++) {
+                int val = (int)(t + u + c);
+                add_hashmap(counters, (void *)&c, (void *)&val);
+            }
+        }
+    }
+    clock_t t2 = clock();
+    perf_end();
+    size_t nested_bytes = heap_used() - base;
+    double dur = 1000.0*(t2-t1)/CLOCKS_PER_SEC;
+    printf("nested hashmap, insert CPU time used:%0.2fms,heap:%zu bytes\n", dur, nested_bytes);
+    perf_report(total);
+    uint64_t sum = 0, expected = 0;
+    t1 = clock();
+    perf_begin();
+    for(uint32_t i = 0;i < total;i++) {
+        uint64_t t = order[i] / (USERS * COUNTERS), u = order[i] / COUNTERS % USERS, c = order[i] % COUNTERS;
+        HashMap *users = query_hashmap(tenants, (void *)&t);
+        HashMap *counters = query_hashmap(users, (void *)&u);
+        sum += *(int *)query_hashmap(counters, (void *)&c);
+        expected += t + u + c;
+    }
+    t2 = clock();
+    perf_end();
+    assert(sum == expected);
+    dur = 1000.0*(t2-t1)/CLOCKS_PER_SEC;
+    printf("nested hashmap, random query CPU time used:%0.2fms\n", dur);
+    perf_report(total);
+    free_hashmap(tenants);
+
+    base = heap_used();
+    t1 = clock();
+    perf_begin();
+    CompositeType counter_type = {copy_val_cb, free_val_cb};
+    CompositeMap *m = new_composite_map(&counter_type);
+    for(uint64_t t = 0;t < TENANTS;t++) {
+        for(uint64_t u = 0;u < USERS;u++) {
+            for(uint64_t c = 0;c < COUNTERS;c++) {
+                KeyPart key[3] = {KEY_PART_VAL(&t), KEY_PART_VAL(&u), KEY_PART_VAL(&c)};
+                int val = (int)(t + u + c);
+                add_composite_map(m, key, 3, (void *)&val);
+            }
+        }
+    }
+    t2 = clock();
+    perf_end();
+    size_t composite_bytes = heap_used() - base;
+    dur = 1000.0*(t2-t1)/CLOCKS_PER_SEC;
+    printf("composite map, insert CPU time used:%0.2fms,heap:%zu bytes\n", dur, composite_bytes);
+    perf_report(total);
+    sum = 0;
+    t1 = clock();
+    perf_begin();
+    for(uint32_t i = 0;i < total;i++) {
+        uint64_t t = order[i] / (USERS * COUNTERS), u = order[i] / COUNTERS % USERS, c = order[i] % COUNTERS;
+        KeyPart key[3] = {KEY_PART_VAL(&t), KEY_PART_VAL(&u), KEY_PART_VAL(&c)};
+        sum += *(int *)query_composite_map(m, key, 3);
+    }
+    t2 = clock();
+    perf_end();
+    assert(sum == expected);
+    dur = 1000.0*(t2-t1)/CLOCKS_PER_SEC;
+    printf("composite map, random query CPU time used:%0.2fms\n", dur);
+    perf_report(total);
+    t1 = clock();
+    perf_begin();
+    int removed = 0;
+    for(uint64_t t = 0;t < TENANTS;t += 2) {
+        KeyPart key[1] = {KEY_PART_VAL(&t)};
+        removed += remove_composite_prefix(m, key, 1);
+    }
+    t2 = clock();
+    perf_end();
+    assert(removed == TENANTS / 2 * USERS * COUNTERS);
+    dur = 1000.0*(t2-t1)/CLOCKS_PER_SEC;
+    printf("composite map, prefix delete of half the tenants CPU time used:%0.2fms\n", dur);
+    perf_report(removed);
+    free_composite_map(m);
+    free(order);
+}
+
+#define POLICY_KEYS 100000U
+#define POLICY_ROUNDS 20
+
+/* drain and refill with and without shrinking, a memory budget and stats readback */
+static void
+test_resize_policy() {
+    OaResizePolicy keep = oa_default_policy;
+    keep.min_load = 0;
+    const OaResizePolicy *policies[] = {NULL, &keep};
+    const char *names[] = {"default policy", "min_load 0"};
+    OaHashStats stats;
+    for(int p = 0;p < 2;p++) {
+        oa_hash_t(map64) *h = oa_hash_new(map64);
+        oa_hash_set_policy(map64, h, policies[p]);
+        double t1 = wall_ms();
+        for(int round = 0;round < POLICY_ROUNDS;round++) {
+            for(uint64_t i = 0;i < POLICY_KEYS;i++)
+                oa_hash_map_add(map64, h, i, i);
+            OaHashInt full = oa_hash_slot_size(h);
+            for(uint64_t i = 0;i < POLICY_KEYS;i++)
+                oa_hash_delete(map64, h, i);
+            assert(oa_hash_size(h) == 0);
+            assert(p == 0 ? oa_hash_slot_size(h) < full : oa_hash_slot_size(h) == full);
+            (void)full;
+        }
+        printf("open address hash, %s drain and refill time:%0.2fms\n", names[p], wall_ms() - t1);
+        oa_hash_free(map64, h);
+    }
+
+    // a full table refuses new keys but still updates the ones it has
+    OaResizePolicy budget = oa_default_policy;
+    budget.max_bytes = oa_map64_bytes(1024);
+    oa_hash_t(map64) *h = oa_hash_new(map64);
+    oa_hash_set_policy(map64, h, &budget);
+    uint64_t added = 0;
+    for(uint64_t i = 0;i < POLICY_KEYS;i++)
+        added += oa_hash_map_add(map64, h, i, i);
+    oa_hash_stats(map64, h, &stats);
+    assert(added == stats.size && added < POLICY_KEYS);
+    assert(stats.slot_size == 1024 && stats.bytes <= budget.max_bytes);
+    assert(stats.bytes == oa_map64_bytes(stats.slot_size));
+    assert(stats.policy.max_bytes == budget.max_bytes && stats.policy.full_action == OA_FULL_FAIL);
+    assert(stats.load_factor == (double)stats.size / stats.slot_size);
+    bool updated = oa_hash_map_add(map64, h, 0, 7);
+    assert(updated && oa_hash_value(h, oa_hash_get(map64, h, 0)) == 7);
+    (void)updated;
+    oa_hash_free(map64, h);
+
+    // an evicting one takes every key and keeps the newest
+    budget.full_action = OA_FULL_EVICT;
+    h = oa_hash_new(map64);
+    oa_hash_set_policy(map64, h, &budget);
+    added = 0;
+    for(uint64_t i = 0;i < POLICY_KEYS;i++)
+        added += oa_hash_map_add(map64, h, i, i);
+    assert(added == POLICY_KEYS);
+    oa_hash_stats(map64, h, &stats);
+    assert(stats.slot_size == 1024 && stats.size > 0 && stats.size < 1024);
+    assert(stats.policy.full_action == OA_FULL_EVICT);
+    assert(oa_hash_get(map64, h, POLICY_KEYS - 1) != oa_hash_end(h));
+    oa_hash_set_policy(map64, h, NULL);
+    oa_hash_stats(map64, h, &stats);
+    assert(stats.policy.max_bytes == 0 && stats.policy.min_load == oa_default_policy.min_load);
+    oa_hash_free(map64, h);
+}
+
+#define CORPUS_COPIES 600
+
+/* the corpus repeated CORPUS_COPIES times, counted with 1, 2, 4 .. cores */
+static void
+test_wordcount_scaling() {
+    FILE *f = fopen("oliver_twist_word.txt", "r");
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *corpus = malloc(len);
+    size_t got = fread(corpus, 1, len, f);
+    fclose(f);
+    assert(got == (size_t)len);
+    char path[] = "/tmp/wordcount_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    int short_writes = 0;
+    for(int i = 0;i < CORPUS_COPIES;i++)
+        short_writes += write(fd, corpus, len) != len;
+    close(fd);
+    assert(short_writes == 0);
+    (void)got;
+    (void)short_writes;
+    free(corpus);
+
+    double gb = (double)len * CORPUS_COPIES / 1e9;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    double base = 0;
+    uint64_t tokens = 0;
+    for(long threads = 1;threads <= cores;threads *= 2) {
+        double t1 = wall_ms();
+        perf_begin();
+        WordCount *wc = new_wordcount(path, (int)threads);
+        perf_end();
+        double dur = wall_ms() - t1;
+        if(threads == 1) {
+            base = dur;
+            tokens = wc->tokens;
+            assert(tokens % CORPUS_COPIES == 0);
+            assert(query_wordcount(wc, oa_str_slice("raining", 7)) % CORPUS_COPIES == 0);
+        }
+        assert(wc->tokens == tokens);
+        printf("wordcount over %0.2fGB, threads:%ld,words:%"PRIu64",time:%0.2fms,%0.2fGB/s,speedup:%0.2f\n",
+            gb, threads, wc->words, dur, gb / (dur / 1000.0), base / dur);
+        perf_report(wc->tokens);
+        free_wordcount(wc);
+    }
+    (void)tokens;
+    unlink(path);
+}
+
+#define LEN_KEY_ROUNDS 20
+
+/* words sliced out of one buffer, copied into a NUL terminated key or not */
+static void
+test_len_keys() {
+    FILE *f = fopen("oliver_twist_word.txt", "r");
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *data = malloc(size);
+    size_t got = fread(data, 1, size, f);
+    fclose(f);
+    assert(got == (size_t)size);
+    (void)got;
+
+    oa_hash_t(count_str) *h = oa_hash_new(count_str);
+    HashMap *m = new_hashmap(&str_key_hash_type);
+    int one = 1;
+    uint64_t lines = 0;
+    for(char *p = data, *end = data + size, *nl;p < end;p = nl + 1) {
+        nl = memchr(p, '\n', end - p);
+        if(!nl)
+            break;
+        oa_hash_map_add_len(count_str, h, p, nl - p, 1);
+        add_hashmap_len(m, p, nl - p, &one);
+        lines++;
+    }
+    // a key past the scratch buffer, copied through the type's copy_key as well
+    char long_key[MAX_LINE_LEN];
+    size_t long_len = sizeof(long_key) - 1;
+    memset(long_key, 'k', long_len);
+    long_key[long_len] = '\0';
+    int ret = add_hashmap_len(m, long_key, long_len, &one);
+    int again = add_hashmap_len(m, long_key, long_len, &one);
+    assert(ret == ADD && again == REPLACE && query_hashmap_len(m, long_key, long_len) != NULL);
+    ret = remove_hashmap(m, long_key);
+    assert(ret == SUCC);
+    (void)ret;
+    (void)again;
+
+    char buffer[MAX_LINE_LEN];
+    uint64_t found = 0;
+    double t1 = wall_ms();
+    perf_begin();
+    for(int r = 0;r < LEN_KEY_ROUNDS;r++)
+        for(char *p = data, *end = data + size, *nl;p < end;p = nl + 1) {
+            nl = memchr(p, '\n', end - p);
+            if(!nl)
+                break;
+            memcpy(buffer, p, nl - p);
+            buffer[nl - p] = '\0';
+            found += oa_hash_get(count_str, h, buffer) != oa_hash_end(h);
+        }
+    perf_end();
+    printf("open address hash, copy then get time:%0.2fms\n", wall_ms() - t1);
+    perf_report(lines * LEN_KEY_ROUNDS);
+    t1 = wall_ms();
+    perf_begin();
+    for(int r = 0;r < LEN_KEY_ROUNDS;r++)
+        for(char *p = data, *end = data + size, *nl;p < end;p = nl + 1) {
+            nl = memchr(p, '\n', end - p);
+            if(!nl)
+                break;
+            found -= oa_hash_get_len(count_str, h, p, nl - p) != oa_hash_end(h);
+        }
+    perf_end();
+    printf("open address hash, get_len time:%0.2fms\n", wall_ms() - t1);
+    perf_report(lines * LEN_KEY_ROUNDS);
+    assert(found == 0);
+
+    t1 = wall_ms();
+    perf_begin();
+    for(int r = 0;r < LEN_KEY_ROUNDS;r++)
+        for(char *p = data, *end = data + size, *nl;p < end;p = nl + 1) {
+            nl = memchr(p, '\n', end - p);
+            if(!nl)
+                break;
+            memcpy(buffer, p, nl - p);
+            buffer[nl - p] = '\0';
+            found += query_hashmap(m, buffer) != NULL;
+        }
+    perf_end();
+    printf("link hash, copy then query time:%0.2fms\n", wall_ms() - t1);
+    perf_report(lines * LEN_KEY_ROUNDS);
+    t1 = wall_ms();
+    perf_begin();
+    for(int r = 0;r < LEN_KEY_ROUNDS;r++)
+        for(char *p = data, *end = data + size, *nl;p < end;p = nl + 1) {
+            nl = memchr(p, '\n', end - p);
+            if(!nl)
+                break;
+            found -= query_hashmap_len(m, p, nl - p) != NULL;
+        }
+    perf_end();
+    printf("link hash, query_len time:%0.2fms\n", wall_ms() - t1);
+    perf_report(lines * LEN_KEY_ROUNDS);
+    assert(found == 0);
+    oa_hash_free(count_str, h);
+    free_hashmap(m);
+    free(data);
+}
+
+#define JOIN_TABLES 4
+#define JOIN_KEYS 100000
+#define JOIN_KEY_LEN 128
+
+/* every key probed against all tables, hashed per table or once up front */
+static void
+test_with_hash() {
+    char *keys = malloc((size_t)JOIN_KEYS * JOIN_KEY_LEN);
+    for(int i = 0;i < JOIN_KEYS;i++) {
+        char *key = keys + (size_t)i * JOIN_KEY_LEN;
+        memset(key, 'k', JOIN_KEY_LEN - 1);
+        sprintf(key + JOIN_KEY_LEN - 16, "%015d", i);
+    }
+    oa_hash_t(count_str) *tables[JOIN_TABLES];
+    HashMap *maps[JOIN_TABLES];
+    int one = 1;
+    for(int t = 0;t < JOIN_TABLES;t++) {
+        tables[t] = oa_hash_new(count_str);
+        maps[t] = new_hashmap(&str_key_hash_type);
+        for(int i = t;i < JOIN_KEYS;i += t + 1) {
+            oa_hash_map_add(count_str, tables[t], keys + (size_t)i * JOIN_KEY_LEN, 1);
+            add_hashmap(maps[t], keys + (size_t)i * JOIN_KEY_LEN, &one);
+        }
+    }
+
+    uint64_t hits = 0;
+    double t1 = wall_ms();
+    perf_begin();
+    for(int i = 0;i < JOIN_KEYS;i++)
+        for(int t = 0;t < JOIN_TABLES;t++)
+            hits += oa_hash_get(count_str, tables[t], keys + (size_t)i * JOIN_KEY_LEN) != oa_hash_end(tables[t]);
+    perf_end();
+    printf("open address hash, %d way probe time:%0.2fms\n", JOIN_TABLES, wall_ms() - t1);
+    perf_report((uint64_t)JOIN_KEYS * JOIN_TABLES);
+    t1 = wall_ms();
+    perf_begin();
+    for(int i = 0;i < JOIN_KEYS;i++) {
+        const char *key = keys + (size_t)i * JOIN_KEY_LEN;
+        OaHashInt hash = oa_hash_key_hash(count_str, key);
+        for(int t = 0;t < JOIN_TABLES;t++)
+            hits -= oa_hash_get_with_hash(count_str, tables[t], key, hash) != oa_hash_end(tables[t]);
+    }
+    perf_end();
+    printf("open address hash, %d way probe hashing once time:%0.2fms\n", JOIN_TABLES, wall_ms() - t1);
+    perf_report((uint64_t)JOIN_KEYS * JOIN_TABLES);
+    assert(hits == 0);
+
+    t1 = wall_ms();
+    perf_begin();
+    for(int i = 0;i < JOIN_KEYS;i++)
+        for(int t = 0;t < JOIN_TABLES;t++)
+            hits += query_hashmap(maps[t], keys + (size_t)i * JOIN_KEY_LEN) != NULL;
+    perf_end();
+    printf("link hash, %d way probe time:%0.2fms\n", JOIN_TABLES, wall_ms() - t1);
+    perf_report((uint64_t)JOIN_KEYS * JOIN_TABLES);
+    t1 = wall_ms();
+    perf_begin();
+    for(int i = 0;i < JOIN_KEYS;i++) {
+        const char *key = keys + (size_t)i * JOIN_KEY_LEN;
+        uint64_t hash = hash_hashmap(maps[0], key);
+        for(int t = 0;t < JOIN_TABLES;t++)
+            hits -= query_hashmap_with_hash(maps[t], key, hash) != NULL;
+    }
+    perf_end();
+    printf("link hash, %d way probe hashing once time:%0.2fms\n", JOIN_TABLES, wall_ms() - t1);
+    perf_report((uint64_t)JOIN_KEYS * JOIN_TABLES);
+    assert(hits == 0);
+
+    HashMap *u = new_hashmap(&str_key_hash_type);
+    t1 = wall_ms();
+    union_hashmap(maps[0], maps[1], u);
+    printf("link hash, union time:%0.2fms\n", wall_ms() - t1);
+    assert(u->count == maps[0]->count);
+    free_hashmap(u);
+    for(int t = 0;t < JOIN_TABLES;t++) {
+        oa_hash_free(count_str, tables[t]);
+        free_hashmap(maps[t]);
+    }
+    free(keys);
+}
+
+#define COUNTER_KEYS 100000
+#define COUNTER_ROUNDS 50
+
+typedef struct {
+    oa_hash_t(count64) *h;
+    long threads;
+    long idx;
+} CounterArg;
+
+static void *
+_count_atomic(void *arg) {
+    CounterArg *a = (CounterArg *)arg;
+    for(int r = 0;r < COUNTER_ROUNDS / a->threads;r++)
+        for(uint64_t k = 0;k < COUNTER_KEYS;k++)
+            oa_hash_atomic_add_delta(count64, a->h, (k + a->idx * 7919) % COUNTER_KEYS, 1);
+    return NULL;
+}
+
+/* get + value + map_add against add_delta, then the shared atomic table */
+static void
+test_counter() {
+    oa_hash_t(map64) *m = oa_hash_new(map64);
+    double t1 = wall_ms();
+    perf_begin();
+    for(int r = 0;r < COUNTER_ROUNDS;r++)
+        for(uint64_t k = 0;k < COUNTER_KEYS;k++) {
+            OaHashInt idx = oa_hash_get(map64, m, k);
+            uint64_t v = idx == oa_hash_end(m) ? 0 : oa_hash_value(m, idx);
+            oa_hash_map_add(map64, m, k, v + 1);
+        }
+    perf_end();
+    printf("counter, get + map_add time:%0.2fms\n", wall_ms() - t1);
+    perf_report((uint64_t)COUNTER_ROUNDS * COUNTER_KEYS);
+    oa_hash_free(map64, m);
+
+    oa_hash_t(count64) *c = oa_hash_new(count64);
+    t1 = wall_ms();
+    perf_begin();
+    for(int r = 0;r < COUNTER_ROUNDS;r++)
+        for(uint64_t k = 0;k < COUNTER_KEYS;k++)
+            oa_hash_add_delta(count64, c, k, 1);
+    perf_end();
+    printf("counter, add_delta time:%0.2fms\n", wall_ms() - t1);
+    perf_report((uint64_t)COUNTER_ROUNDS * COUNTER_KEYS);
+    assert(oa_hash_value(c, oa_hash_get(count64, c, 0)) == COUNTER_ROUNDS);
+    oa_hash_free(count64, c);
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    for(long threads = 1;threads <= cores;threads *= 2) {
+        c = oa_hash_new(count64);
+        oa_hash_reserve(count64, c, COUNTER_KEYS);
+        pthread_t tids[threads];
+        CounterArg args[threads];
+        t1 = wall_ms();
+        perf_begin();
+        for(long i = 0;i < threads;i++) {
+            args[i] = (CounterArg){c, threads, i};
+            pthread_create(&tids[i], NULL, _count_atomic, &args[i]);
+        }
+        for(long i = 0;i < threads;i++)
+            pthread_join(tids[i], NULL);
+        perf_end();
+        printf("counter, atomic_add_delta threads:%ld,time:%0.2fms\n", threads, wall_ms() - t1);
+        perf_report((uint64_t)(COUNTER_ROUNDS / threads * threads) * COUNTER_KEYS);
+        assert(oa_hash_size(c) == COUNTER_KEYS);
+        assert(oa_hash_atomic_value(count64, c, 1) == (uint64_t)(COUNTER_ROUNDS / threads * threads));
+        oa_hash_free(count64, c);
+    }
+}
+
+#define SNAPSHOT_KEYS 4000000
+#define SNAPSHOT_WRITES 100000
+
+/* a full copy of the arrays against a cow snapshot plus the writes it slows down */
+static void
+test_snapshot() {
+    oa_hash_t(map64) *m = oa_hash_new(map64);
+    for(uint64_t i = 0;i < SNAPSHOT_KEYS;i++)
+        oa_hash_map_add(map64, m, i, i);
+    double t1 = wall_ms();
+    oa_hash_t(map64) copy = *m;
+    copy.keys = malloc(m->slot_size * sizeof(uint64_t));
+    copy.values = malloc(m->slot_size * sizeof(uint64_t));
+    copy.flags = malloc(calc_flags_byte_num(m->slot_size));
+    memcpy(copy.keys, m->keys, m->slot_size * sizeof(uint64_t));
+    memcpy(copy.values, m->values, m->slot_size * sizeof(uint64_t));
+    memcpy(copy.flags, m->flags, calc_flags_byte_num(m->slot_size));
+    printf("snapshot, memcpy of %u slots time:%0.2fms\n", m->slot_size, wall_ms() - t1);
+    assert(oa_hash_get(map64, &copy, SNAPSHOT_KEYS - 1) != oa_hash_end(&copy));
+    free(copy.keys);
+    free(copy.values);
+    free(copy.flags);
+
+    if(!oa_hash_enable_cow(map64, m)) {
+        printf("snapshot, no memfd on this system\n");
+        oa_hash_free(map64, m);
+        return;
+    }
+    t1 = wall_ms();
+    oa_hash_t(map64) *snap = oa_hash_snapshot(map64, m);
+    printf("snapshot, cow snapshot time:%0.2fms\n", wall_ms() - t1);
+    t1 = wall_ms();
+    for(uint64_t i = 0;i < SNAPSHOT_WRITES;i++)
+        oa_hash_map_add(map64, m, rand() % SNAPSHOT_KEYS, 0);
+    printf("snapshot, %d random writes while live time:%0.2fms,dirty pages:%zu\n", SNAPSHOT_WRITES,
+        wall_ms() - t1, m->ext->cow->keys.dirty_num + m->ext->cow->values.dirty_num + m->ext->cow->flags.dirty_num);
+    uint64_t sum = 0, key, value;
+    oa_hash_foreach(snap, key, value, {
+        sum += value;
+        (void)key;
+    });
+    assert(sum == (uint64_t)SNAPSHOT_KEYS * (SNAPSHOT_KEYS - 1) / 2);
+    t1 = wall_ms();
+    oa_hash_release_snapshot(map64, m, snap);
+    printf("snapshot, release time:%0.2fms\n", wall_ms() - t1);
+    oa_hash_free(map64, m);
+}
+
+#define SMALL_MAPS 1000000
+#define SMALL_MAP_KEYS 3
+
+/* a million maps of three entries, heap arrays against entries in the header */
+static void
+test_small_maps() {
+    oa_hash_t(map64) **maps = malloc(SMALL_MAPS * sizeof(oa_hash_t(map64) *));
+    size_t used = heap_used();
+    double t1 = wall_ms();
+    for(uint64_t i = 0;i < SMALL_MAPS;i++) {
+        maps[i] = oa_hash_new(map64);
+        for(uint64_t j = 0;j < SMALL_MAP_KEYS;j++)
+            oa_hash_map_add(map64, maps[i], i * 31 + j, j);
+    }
+    uint64_t sum = 0;
+    for(uint64_t i = 0;i < SMALL_MAPS;i++)
+        sum += oa_hash_value(maps[i], oa_hash_get(map64, maps[i], i * 31 + 1));
+    printf("small maps, open address hash build and query time:%0.2fms,heap:%zuMB\n",
+        wall_ms() - t1, (heap_used() - used) >> 20U);
+    for(uint64_t i = 0;i < SMALL_MAPS;i++)
+        oa_hash_free(map64, maps[i]);
+    free(maps);
+
+    oa_hash_t(small64) **small = malloc(SMALL_MAPS * sizeof(oa_hash_t(small64) *));
+    used = heap_used();
+    t1 = wall_ms();
+    for(uint64_t i = 0;i < SMALL_MAPS;i++) {
+        small[i] = oa_hash_new(small64);
+        for(uint64_t j = 0;j < SMALL_MAP_KEYS;j++)
+            oa_hash_map_add(small64, small[i], i * 31 + j, j);
+    }
+    uint64_t small_sum = 0;
+    for(uint64_t i = 0;i < SMALL_MAPS;i++)
+        small_sum += oa_hash_value(small[i], oa_hash_get(small64, small[i], i * 31 + 1));
+    printf("small maps, inline open address hash build and query time:%0.2fms,heap:%zuMB\n",
+        wall_ms() - t1, (heap_used() - used) >> 20U);
+    assert(sum == small_sum && sum == SMALL_MAPS);
+    for(uint64_t i = 0;i < SMALL_MAPS;i++)
+        oa_hash_free(small64, small[i]);
+    free(small);
+}
+
+#define STR_HASH_KEYS 1000000
+#define STR_HASH_KEY_LEN 48
+
+/* long string keys, a forced rehash and lookups that miss */
+static void
+test_str_hashes() {
+    char *keys = malloc((size_t)STR_HASH_KEYS * 2 * STR_HASH_KEY_LEN);
+    for(int i = 0;i < STR_HASH_KEYS * 2;i++)
+        snprintf(keys + (size_t)i * STR_HASH_KEY_LEN, STR_HASH_KEY_LEN,
+            "tenant/%08d/session/%016"PRIx64, i % 1000, (uint64_t)i * UINT64_C(0x9e3779b97f4a7c15));
+    oa_hash_t(count_str) *h = oa_hash_new(count_str);
+    double t1 = wall_ms();
+    for(int i = 0;i < STR_HASH_KEYS;i++)
+        oa_hash_map_add(count_str, h, keys + (size_t)i * STR_HASH_KEY_LEN, i);
+    printf("open address hash with long string key,insert time:%0.2fms\n", wall_ms() - t1);
+    t1 = wall_ms();
+    oa_hash_reserve(count_str, h, oa_hash_slot_size(h));
+    printf("open address hash with long string key,rehash time:%0.2fms\n", wall_ms() - t1);
+    uint64_t found = 0;
+    t1 = wall_ms();
+    for(int i = STR_HASH_KEYS;i < STR_HASH_KEYS * 2;i++)
+        found += oa_hash_get(count_str, h, keys + (size_t)i * STR_HASH_KEY_LEN) != oa_hash_end(h);
+    printf("open address hash with long string key,miss time:%0.2fms\n", wall_ms() - t1);
+    t1 = wall_ms();
+    for(int i = 0;i < STR_HASH_KEYS;i++)
+        found += oa_hash_get(count_str, h, keys + (size_t)i * STR_HASH_KEY_LEN) != oa_hash_end(h);
+    printf("open address hash with long string key,hit time:%0.2fms\n", wall_ms() - t1);
+    assert(found == STR_HASH_KEYS);
+    oa_hash_free(count_str, h);
+    free(keys);
+}
+
+#define RETAIN_KEYS 1000000
+#define RETAIN_KEEP 10
+
+static bool
+retain_oa_cb(uint64_t key, uint64_t *value, void *extra) {
+    (void)value;
+    (void)extra;
+    return key % RETAIN_KEEP == 0;
+}
+
+static int
+retain_link_cb(const void *key, void *value, void *extra) {
+    (void)value;
+    (void)extra;
+    return *(const uint64_t *)key % RETAIN_KEEP == 0;
+}
+
+/* drop nine in ten keys, deleting one by one after a walk or with one retain */
+static void
+test_retain() {
+    oa_hash_t(map64) *m = oa_hash_new(map64);
+    for(uint64_t i = 0;i < RETAIN_KEYS;i++)
+        oa_hash_map_add(map64, m, i, i);
+    uint64_t *doomed = malloc(RETAIN_KEYS * sizeof(uint64_t));
+    double t1 = wall_ms();
+    uint64_t key, value;
+    size_t n = 0;
+    oa_hash_foreach(m, key, value, {
+        if(!retain_oa_cb(key, &value, NULL))
+            doomed[n++] = key;
+    });
+    for(size_t i = 0;i < n;i++)
+        oa_hash_delete(map64, m, doomed[i]);
+    printf("open address hash, purge by walk and delete time:%0.2fms,slots:%"PRIu32"\n",
+        wall_ms() - t1, oa_hash_slot_size(m));
+    oa_hash_free(map64, m);
+
+    m = oa_hash_new(map64);
+    for(uint64_t i = 0;i < RETAIN_KEYS;i++)
+        oa_hash_map_add(map64, m, i, i);
+    t1 = wall_ms();
+    OaHashInt removed = oa_hash_retain(map64, m, retain_oa_cb, NULL);
+    printf("open address hash, purge by retain time:%0.2fms,slots:%"PRIu32"\n",
+        wall_ms() - t1, oa_hash_slot_size(m));
+    assert(removed == n && oa_hash_size(m) == RETAIN_KEYS / RETAIN_KEEP);
+    (void)removed;
+    oa_hash_free(map64, m);
+
+    HashMap *hm = new_hashmap(&uint64_key_hash_type);
+    for(uint64_t i = 0;i < RETAIN_KEYS;i++)
+        add_hashmap(hm, &i, &i);
+    t1 = wall_ms();
+    n = 0;
+    for(uint64_t i = 0;i < RETAIN_KEYS;i++) {
+        if(!retain_link_cb(&i, NULL, NULL))
+            doomed[n++] = i;
+    }
+    for(size_t i = 0;i < n;i++)
+        remove_hashmap(hm, &doomed[i]);
+    printf("link hash, purge by walk and remove time:%0.2fms,slots:%d\n", wall_ms() - t1, hm->slots_size);
+    free_hashmap(hm);
+
+    hm = new_hashmap(&uint64_key_hash_type);
+    for(uint64_t i = 0;i < RETAIN_KEYS;i++)
+        add_hashmap(hm, &i, &i);
+    t1 = wall_ms();
+    int dropped = retain_hashmap(hm, retain_link_cb, NULL);
+    printf("link hash, purge by retain time:%0.2fms,slots:%d\n", wall_ms() - t1, hm->slots_size);
+    assert((size_t)dropped == n && hm->count == RETAIN_KEYS / RETAIN_KEEP);
+    (void)dropped;
+    free_hashmap(hm);
+    free(doomed);
+}
+
+/* a worker process exited on its own with status 0 */
+static bool
+shm_child_ok(pid_t pid) {
+    int status;
+    return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+#define SHM_KEYS 1000000
+#define SHM_WORKERS 4
+
+#define EXT_BUDGET (32U << 20U)
+#define EXT_KEYS 3000000U
+#define EXT_RECORDS 12000000U
+
+static void
+ext_sum(OaStrSlice key, uint64_t count, void *extra) {
+    (void)key;
+    *(uint64_t *)extra += count;
+}
+
+/* keys needing four times the budget, counted within it or all in memory */
+static void
+test_extcount() {
+    size_t budgets[] = {(size_t)EXT_BUDGET << 10U, EXT_BUDGET};
+    char key[32];
+    for(int b = 0;b < 2;b++) {
+        double t1 = wall_ms();
+        ExtCount *ec = new_extcount("/tmp", budgets[b], 0);
+        uint64_t x = 1;
+        uint32_t failed = 0;
+        for(uint32_t i = 0;i < EXT_RECORDS;i++) {
+            // every key at least once, then a random one
+            uint32_t k = i < EXT_KEYS ? i : (uint32_t)((x = x * 6364136223846793005ULL + 1) >> 33U) % EXT_KEYS;
+            int len = snprintf(key, sizeof(key), "user:%08x", k * 2654435761U);
+            failed += !add_extcount(ec, key, (size_t)len, 1);
+        }
+        assert(failed == 0);
+        OaHashStats stats;
+        oa_hash_stats(extcount, ec->table, &stats);
+        // what the adds hold at the end, the table peaks just before a spill
+        size_t held = stats.bytes + ec->arena_bytes;
+        double t2 = wall_ms();
+        uint64_t sum = 0;
+        bool finished = finish_extcount(ec, ext_sum, &sum);
+        double t3 = wall_ms();
+        assert(finished && sum == EXT_RECORDS && ec->keys == EXT_KEYS);
+        (void)failed;
+        (void)finished;
+        printf("external count, budget:%zuMB,keys:%"PRIu64",table and keys:%0.2fMB,spills:%"PRIu64
+            ",written:%0.2fMB,split depth:%d,add time:%0.2fms,finish time:%0.2fms,%0.2fM records/s\n",
+            budgets[b] >> 20U, ec->keys, held / 1048576.0, ec->spills,
+            ec->bytes_written / 1048576.0, ec->max_depth, t2 - t1, t3 - t2,
+            EXT_RECORDS / ((t3 - t1) * 1000.0));
+        free_extcount(ec);
+    }
+}
+
+/* worker processes answering lookups, each from its own copy or all from one segment */
+static void
+test_shm() {
+    double t1 = wall_ms();
+    pid_t pids[SHM_WORKERS];
+    for(int w = 0;w < SHM_WORKERS;w++) {
+        if((pids[w] = fork()) == 0) {
+            oa_hash_t(map64) *m = oa_hash_new(map64);
+            for(uint64_t i = 0;i < SHM_KEYS;i++)
+                oa_hash_map_add(map64, m, i * 31, i);
+            uint64_t wrong = 0;
+            for(uint64_t i = 0;i < SHM_KEYS;i++)
+                wrong += oa_hash_value(m, oa_hash_get(map64, m, i * 31)) != i;
+            _exit(wrong ? 1 : 0);
+        }
+    }
+    int failed = 0;
+    for(int w = 0;w < SHM_WORKERS;w++)
+        failed += !shm_child_ok(pids[w]);
+    assert(failed == 0);
+    (void)failed;
+    oa_hash_t(map64) *m = oa_hash_new(map64);
+    oa_hash_reserve(map64, m, SHM_KEYS);
+    printf("open address hash, %d workers with a private copy, load and query time:%0.2fms,"
+        "memory:%zuMB\n", SHM_WORKERS, wall_ms() - t1,
+        SHM_WORKERS * oa_map64_bytes(oa_hash_slot_size(m)) >> 20U);
+    oa_hash_free(map64, m);
+
+    t1 = wall_ms();
+    oa_shm_t(shm64) *h = oa_shm_create(shm64, NULL, SHM_KEYS);
+    if(!h) {
+        printf("shared memory hash unavailable:%s\n", strerror(errno));
+        return;
+    }
+    oa_shm_write_begin(shm64, h);
+    for(uint64_t i = 0;i < SHM_KEYS;i++)
+        oa_shm_put(shm64, h, i * 31, i);
+    oa_shm_write_end(shm64, h);
+    double load = wall_ms() - t1;
+    for(int w = 0;w < SHM_WORKERS;w++) {
+        if((pids[w] = fork()) == 0) {
+            oa_shm_t(shm64) *r = oa_shm_attach_fd(shm64, oa_shm_fd(h));
+            uint64_t value, wrong = 0;
+            for(uint64_t i = 0;i < SHM_KEYS;i++)
+                wrong += !oa_shm_get(shm64, r, i * 31, &value) || value != i;
+            _exit(wrong ? 1 : 0);
+        }
+    }
+    failed = 0;
+    for(int w = 0;w < SHM_WORKERS;w++)
+        failed += !shm_child_ok(pids[w]);
+    assert(failed == 0);
+    printf("shared memory hash, %d workers attached to one segment, load and query time:%0.2fms"
+        "(load %0.2fms),memory:%zuMB\n", SHM_WORKERS, wall_ms() - t1, load,
+        (size_t)h->hdr->bytes >> 20U);
+    oa_shm_detach(shm64, h);
+}
+
+#define SHM_CHURN_KEYS 20000U
+#define SHM_CHURN_ROUNDS 300U
+#define SHM_DONE_KEY (3U * SHM_CHURN_KEYS)
+
+/*
+ * Keys below SHM_CHURN_KEYS never change, the next SHM_CHURN_KEYS are put
+ * with a growing generation in the high half of the value and deleted by
+ * turns, puts that hit the capacity and explicit calls compact in place.
+ * A reader attached meanwhile must always find the fixed keys and never
+ * see a churned key with a wrong low half or a generation going back.
+ */
+static void
+test_shm_concurrent() {
+    oa_shm_t(shm64) *h = oa_shm_create(shm64, NULL, 2U * SHM_CHURN_KEYS + 1U);
+    if(!h) {
+        printf("shared memory hash unavailable:%s\n", strerror(errno));
+        return;
+    }
+    for(uint64_t i = 0;i < SHM_CHURN_KEYS;i++)
+        oa_shm_put(shm64, h, i, i);
+    int ready[2];
+    if(pipe(ready) != 0) {
+        printf("shared memory hash, pipe failed:%s\n", strerror(errno));
+        oa_shm_detach(shm64, h);
+        return;
+    }
+    fflush(stdout);
+    pid_t reader = fork();
+    if(reader == 0) {
+        oa_shm_t(shm64) *r = oa_shm_attach_fd(shm64, oa_shm_fd(h));
+        close(ready[0]);
+        close(ready[1]);
+        uint64_t *last = calloc(SHM_CHURN_KEYS, sizeof(uint64_t));
+        uint64_t value, wrong = 0, reads = 0, seen = 0, state = 88172645463325252ULL;
+        while(!oa_shm_get(shm64, r, SHM_DONE_KEY, &value)) {
+            uint64_t i = xorshift64(&state) % SHM_CHURN_KEYS;
+            wrong += !oa_shm_get(shm64, r, i, &value) || value != i;
+            if(oa_shm_get(shm64, r, SHM_CHURN_KEYS + i, &value)) {
+                wrong += (value & UINT32_MAX) != SHM_CHURN_KEYS + i || value >> 32U < last[i];
+                last[i] = value >> 32U;
+                seen++;
+            }
+            reads += 2;
+        }
+        printf("shared memory hash, reader during updates, reads:%"PRIu64",churned keys seen:%"PRIu64
+            ",wrong:%"PRIu64"\n", reads, seen, wrong);
+        fflush(stdout);
+        _exit(wrong ? 1 : 0);
+    }
+    // the reader is attached and running once its end of the pipe is closed
+    char byte;
+    close(ready[1]);
+    ssize_t n = read(ready[0], &byte, 1);
+    assert(n == 0);
+    (void)n;
+    close(ready[0]);
+    double t1 = wall_ms();
+    for(uint64_t round = 1;round <= SHM_CHURN_ROUNDS;round++) {
+        for(uint64_t i = 0;i < SHM_CHURN_KEYS;i++) {
+            uint64_t key = SHM_CHURN_KEYS + i;
+            if((i + round) % 3U == 0)
+                oa_shm_delete(shm64, h, key);
+            else
+                oa_shm_put(shm64, h, key, round << 32U | key);
+        }
+        if(round % 10U)
+            continue;
+        // one batch takes fixed keys out and puts them back, then compacts
+        oa_shm_write_begin(shm64, h);
+        for(uint64_t i = 0;i < SHM_CHURN_KEYS;i += 7)
+            oa_shm_delete(shm64, h, i);
+        // sleep so a reader gets the core while the batch is open, even on one CPU
+        usleep(1000);
+        for(uint64_t i = 0;i < SHM_CHURN_KEYS;i += 7)
+            oa_shm_put(shm64, h, i, i);
+        oa_shm_compact(shm64, h);
+        oa_shm_write_end(shm64, h);
+    }
+    oa_shm_put(shm64, h, SHM_DONE_KEY, 0);
+    double dur = wall_ms() - t1;
+    bool reader_ok = shm_child_ok(reader);
+    assert(reader_ok);
+    (void)reader_ok;
+    printf("shared memory hash, %u rounds over %u churned keys with a reader attached, time:%0.2fms\n",
+        SHM_CHURN_ROUNDS, SHM_CHURN_KEYS, dur);
+    uint64_t value, wrong = 0, live = SHM_CHURN_KEYS + 1U;
+    for(uint64_t i = 0;i < SHM_CHURN_KEYS;i++) {
+        bool found = oa_shm_get(shm64, h, SHM_CHURN_KEYS + i, &value);
+        if((i + SHM_CHURN_ROUNDS) % 3U == 0) {
+            wrong += found;
+            continue;
+        }
+        wrong += !found || value != ((uint64_t)SHM_CHURN_ROUNDS << 32U | (SHM_CHURN_KEYS + i));
+        live++;
+    }
+    assert(wrong == 0 && oa_shm_size(shm64, h) == live);
+    (void)wrong;
+    (void)live;
+    oa_shm_detach(shm64, h);
+}
+
+#define LATENCY_KEYS 1000000
+
+static void
+print_latency(const char *engine, const char *op, const LatencyHist *h) {
+    printf("latency, %s %s, n:%"PRIu64",mean:%0.1fns,p50:%"PRIu64"ns,p99:%"PRIu64"ns,"
+        "p99.9:%"PRIu64"ns,max:%"PRIu64"ns\n", engine, op, h->count, latency_hist_mean(h),
+        latency_hist_percentile(h, 0.5), latency_hist_percentile(h, 0.99),
+        latency_hist_percentile(h, 0.999), h->max);
+}
+
+static void
+print_latency_stats(const char *engine, const LatencyStats *stats) {
+    print_latency(engine, "add", &stats->add);
+    print_latency(engine, "remove", &stats->remove);
+    print_latency(engine, "rehash", &stats->rehash);
+    const RehashEvent *e = latency_rehash_event(stats, 0);
+    if(e)
+        printf("latency, %s last rehash %"PRIu64" -> %"PRIu64" slots,%"PRIu64" entries:%0.2fms\n",
+            engine, e->old_slots, e->new_slots, e->count, e->ns / 1e6);
+}
+
+/* the tail the mean hides, rehashes show up in p99.9 and max */
+static void
+test_latency() {
+    LatencyStats stats;
+    HashMap *m = new_hashmap(&uint64_key_hash_type);
+    oa_hash_t(map64) *h = oa_hash_new(map64);
+    for(uint64_t i = 0;i < LATENCY_KEYS;i++) {
+        int val = 1;
+        add_hashmap(m, (void *)&i, (void *)&val);
+        oa_hash_map_add(map64, h, i, i);
+    }
+    for(uint64_t i = 0;i < LATENCY_KEYS;i++) {
+        remove_hashmap(m, (void *)&i);
+        oa_hash_delete(map64, h, i);
+    }
+    if(get_hashmap_latency(m, &stats) == SUCC)
+        print_latency_stats("link hash", &stats);
+    else
+        printf("latency, built without HASH_LATENCY\n");
+    if(oa_hash_latency(map64, h, &stats))
+        print_latency_stats("open address", &stats);
+    reset_hashmap_latency(m);
+    oa_hash_reset_latency(map64, h);
+    get_hashmap_latency(m, &stats);
+    assert(stats.add.count == 0 && stats.event_num == 0);
+    oa_hash_latency(map64, h, &stats);
+    assert(stats.add.count == 0 && stats.event_num == 0);
+    free_hashmap(m);
+    oa_hash_free(map64, h);
 }
 
 int main() {
+    perf_init();
     test_link_hash();   
+    test_ttl();
     test_open_address_hash();   
+    test_resize_policy();
+    test_bloom_prefilter();
+    test_bloom_batch();
+    test_bloom_str_keys();
+    test_compact_set();
+    test_cache_replay();
+    test_cache_clock();
+    test_composite_map();
+    test_wordcount_scaling();
+    test_counter();
+    test_snapshot();
+    test_len_keys();
+    test_with_hash();
+    test_latency();
+    test_small_maps();
+    test_str_hashes();
+    test_shm();
+    test_shm_concurrent();
+    test_retain();
+    test_extcount();
 }
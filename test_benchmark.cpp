@@ -0,0 +1,201 @@
+#include <time.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "oa_flat_map.hpp"
+
+/*
+ * The workloads of test_open_address_hash in test_benchmark.c, run through
+ * oa::flat_map and std::unordered_map, after a check of the container
+ * semantics std code relies on.
+ * g++ -std=c++17 -O2 -o test_benchmark_cpp test_benchmark.cpp
+ */
+
+#define MAX_LINE_LEN 1024
+#define KEY_NUM 1000000U
+
+static std::vector<std::string>
+read_words() {
+    std::vector<std::string> words;
+    FILE *f = fopen("oliver_twist_word.txt", "r");
+    char buffer[MAX_LINE_LEN];
+    while(f && fgets(buffer, MAX_LINE_LEN, f) != NULL) {
+        size_t len = strlen(buffer);
+        if(buffer[len - 1] == '\n') {
+            buffer[len - 1] = '\0';
+            words.emplace_back(buffer, len - 1);
+        }
+        else
+            printf("too long line\n");
+    }
+    if(f)
+        fclose(f);
+    return words;
+}
+
+static double
+cpu_ms(clock_t t1, clock_t t2) {
+    return 1000.0 * (t2 - t1) / CLOCKS_PER_SEC;
+}
+
+template<class Map>
+static void
+bench_string(const char *engine, const std::vector<std::string> &words) {
+    Map m;
+    clock_t t1 = clock();
+    for(const std::string &word : words)
+        m.insert_or_assign(word, word);
+    clock_t t2 = clock();
+    printf("%s with string key,insert CPU time used:%0.2fms\n", engine, cpu_ms(t1, t2));
+    t1 = clock();
+    for(const std::string &word : words) {
+        auto it = m.find(word);
+        assert(it != m.end() && it->second == word);
+        (void)it;
+    }
+    t2 = clock();
+    printf("%s with string key,query CPU time used:%0.2fms\n", engine, cpu_ms(t1, t2));
+}
+
+template<class Map>
+static void
+bench_uint64(const char *engine, const char *desc, uint64_t (*gen_key)(uint64_t)) {
+    Map m;
+    clock_t t1 = clock();
+    for(uint64_t i = 0;i < KEY_NUM;i++)
+        m.try_emplace(gen_key(i), i + 1);
+    clock_t t2 = clock();
+    printf("%s with uint64_t key%s,insert CPU time used:%0.2fms\n", engine, desc, cpu_ms(t1, t2));
+    t1 = clock();
+    for(uint64_t i = 0;i < KEY_NUM;i++) {
+        auto it = m.find(gen_key(i));
+        assert(it != m.end() && it->second == i + 1);
+        (void)it;
+    }
+    t2 = clock();
+    printf("%s with uint64_t key%s,query CPU time used:%0.2fms\n", engine, desc, cpu_ms(t1, t2));
+}
+
+static uint64_t
+seq_key(uint64_t i) {
+    return i;
+}
+
+static uint64_t
+same_low_bits_key(uint64_t i) {
+    return i << 32U | 1U;
+}
+
+/* string_view lookups into std::string keys, std needs a temporary string for each */
+static void
+bench_string_view(const std::vector<std::string> &words) {
+    std::vector<std::string_view> views(words.begin(), words.end());
+    oa::flat_map<std::string, uint64_t> m;
+    std::unordered_map<std::string, uint64_t> ref;
+    for(const std::string &word : words) {
+        m[word]++;
+        ref[word]++;
+    }
+    uint64_t sum = 0;
+    clock_t t1 = clock();
+    for(std::string_view view : views)
+        sum += m.find(view)->second;
+    clock_t t2 = clock();
+    printf("flat map with string key,string_view query CPU time used:%0.2fms\n", cpu_ms(t1, t2));
+    uint64_t ref_sum = 0;
+    t1 = clock();
+    for(std::string_view view : views)
+        ref_sum += ref.find(std::string(view))->second;
+    t2 = clock();
+    printf("unordered map with string key,string_view query CPU time used:%0.2fms\n", cpu_ms(t1, t2));
+    assert(sum == ref_sum);
+    (void)ref_sum;
+}
+
+/* erase while iterating, move only values, copies and moves, heterogeneous at and find */
+static void
+test_flat_map_semantics(const std::vector<std::string> &words) {
+    oa::flat_map<std::string, uint64_t> m;
+    for(const std::string &word : words)
+        m[word]++;
+    size_t distinct = m.size();
+    size_t even = 0;
+    for(const auto &kv : m)
+        even += kv.first.size() % 2 == 0;
+    for(auto it = m.begin();it != m.end();) {
+        if(it->first.size() % 2)
+            it = m.erase(it);
+        else
+            ++it;
+    }
+    size_t left = 0;
+    for(const auto &kv : m)
+        left += kv.first.size() % 2 == 0;
+    assert(left == even && m.size() == even && even > 0);
+
+    std::string_view view = m.begin()->first;
+    uint64_t count = m.begin()->second;
+    assert(m.at(view) == count && m.find(view)->second == count);
+    assert(m.at(std::string(view).c_str()) == count && m.contains(view));
+    bool thrown = false;
+    try {
+        m.at(std::string_view("no such word in the corpus"));
+    }
+    catch(const std::out_of_range &) {
+        thrown = true;
+    }
+    assert(thrown);
+    (void)thrown;
+
+    oa::flat_map<std::string, uint64_t> copy(m);
+    assert(copy.size() == m.size());
+    size_t same = 0;
+    for(const auto &kv : m)
+        same += copy.at(kv.first) == kv.second;
+    assert(same == m.size());
+    copy.erase(std::string(view));
+    assert(!copy.contains(view) && m.contains(view));
+    oa::flat_map<std::string, uint64_t> moved(std::move(copy));
+    assert(moved.size() == m.size() - 1 && copy.empty());
+    copy = moved;
+    assert(copy.size() == moved.size());
+    copy[std::string(view)] = count;
+    assert(copy.size() == m.size());
+
+    oa::flat_map<uint64_t, std::unique_ptr<uint64_t>> owners;
+    for(uint64_t i = 0;i < KEY_NUM / 10;i++)
+        owners.try_emplace(i, std::make_unique<uint64_t>(i * 3));
+    for(auto it = owners.begin();it != owners.end();) {
+        if(*it->second % 2)
+            it = owners.erase(it);
+        else
+            ++it;
+    }
+    assert(owners.size() == KEY_NUM / 20);
+    oa::flat_map<uint64_t, std::unique_ptr<uint64_t>> owners2(std::move(owners));
+    owners = std::move(owners2);
+    for(uint64_t i = 0;i < KEY_NUM / 10;i += 2)
+        assert(*owners.at(i) == i * 3);
+    assert(owners.find(1) == owners.end() && owners2.empty());
+    printf("flat map semantics checked, %zu of %zu words left\n", m.size(), distinct);
+}
+
+int main() {
+    std::vector<std::string> words = read_words();
+    test_flat_map_semantics(words);
+    bench_string<oa::flat_map<std::string, std::string>>("flat map", words);
+    bench_string<std::unordered_map<std::string, std::string>>("unordered map", words);
+    bench_uint64<oa::flat_map<uint64_t, uint64_t>>("flat map", "", seq_key);
+    bench_uint64<std::unordered_map<uint64_t, uint64_t>>("unordered map", "", seq_key);
+    bench_uint64<oa::flat_map<uint64_t, uint64_t>>("flat map", " of same low bits", same_low_bits_key);
+    bench_uint64<std::unordered_map<uint64_t, uint64_t>>("unordered map", " of same low bits", same_low_bits_key);
+    bench_string_view(words);
+}
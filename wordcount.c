@@ -0,0 +1,199 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wordcount.h"
+
+#define WORDCOUNT_MAX_THREADS 256
+#define SPACE_BYTES 0x2121212121212121ULL
+#define HIGH_BITS 0x8080808080808080ULL
+
+typedef struct {
+    WordCount *wc;
+    const char *begin;
+    const char *end;
+    oa_hash_t(wordcount) **local;       // part_num tables
+    uint64_t tokens;
+    int idx;
+    void *workers;
+} Worker;
+
+static void *_count_chunk(void *arg);
+static void *_merge_part(void *arg);
+static inline int _part_idx(OaStrSlice word, int part_num);
+static const char *_next_line(const char *p, const char *data, const char *end);
+static inline const char *_token_end(const char *p, const char *end);
+
+WordCount *new_wordcount(const char *path, int thread_num) {
+    if(thread_num < 1)
+        thread_num = 1;
+    if(thread_num > WORDCOUNT_MAX_THREADS)
+        thread_num = WORDCOUNT_MAX_THREADS;
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return NULL;
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+    WordCount *wc = (WordCount *)calloc(1, sizeof(WordCount));
+    wc->size = (size_t)st.st_size;
+    if(wc->size) {
+        void *data = mmap(NULL, wc->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data == MAP_FAILED) {
+            close(fd);
+            free(wc);
+            return NULL;
+        }
+        madvise(data, wc->size, MADV_SEQUENTIAL);
+        wc->data = (const char *)data;
+    }
+    close(fd);
+    wc->part_num = thread_num;
+    wc->parts = calloc(thread_num, sizeof(oa_hash_t(wordcount) *));
+
+    Worker *workers = (Worker *)calloc(thread_num, sizeof(Worker));
+    pthread_t threads[WORDCOUNT_MAX_THREADS];
+    const char *end = wc->data + wc->size;
+    for(int i = 0;i < thread_num;i++) {
+        Worker *w = &workers[i];
+        w->wc = wc;
+        w->idx = i;
+        w->workers = workers;
+        w->begin = _next_line(wc->data + wc->size / thread_num * i, wc->data, end);
+        w->end = i == thread_num - 1 ? end : _next_line(wc->data + wc->size / thread_num * (i + 1), wc->data, end);
+        w->local = calloc(thread_num, sizeof(oa_hash_t(wordcount) *));
+        for(int j = 0;j < thread_num;j++)
+            w->local[j] = oa_hash_new(wordcount);
+    }
+    for(int i = 1;i < thread_num;i++)
+        pthread_create(&threads[i], NULL, _count_chunk, &workers[i]);
+    _count_chunk(&workers[0]);
+    for(int i = 1;i < thread_num;i++)
+        pthread_join(threads[i], NULL);
+
+    for(int i = 1;i < thread_num;i++)
+        pthread_create(&threads[i], NULL, _merge_part, &workers[i]);
+    _merge_part(&workers[0]);
+    for(int i = 1;i < thread_num;i++)
+        pthread_join(threads[i], NULL);
+
+    for(int i = 0;i < thread_num;i++) {
+        wc->tokens += workers[i].tokens;
+        wc->words += oa_hash_size(wc->parts[i]);
+        free(workers[i].local);
+    }
+    free(workers);
+    return wc;
+}
+
+void free_wordcount(WordCount *wc) {
+    for(int i = 0;i < wc->part_num;i++)
+        oa_hash_free(wordcount, wc->parts[i]);
+    free(wc->parts);
+    // the tables borrow their keys from the mapping, so it goes last
+    if(wc->size)
+        munmap((void *)wc->data, wc->size);
+    free(wc);
+}
+
+uint64_t query_wordcount(WordCount *wc, OaStrSlice word) {
+    oa_hash_t(wordcount) *h = wc->parts[_part_idx(word, wc->part_num)];
+    OaHashInt idx = oa_hash_get(wordcount, h, word);
+    return idx == oa_hash_end(h) ? 0 : oa_hash_value(h, idx);
+}
+
+void traverse_wordcount(WordCount *wc, wordcount_hook hook, void *extra) {
+    OaStrSlice word;
+    uint64_t count;
+    for(int part = 0;part < wc->part_num;part++) {
+        oa_hash_t(wordcount) *h = wc->parts[part];
+        oa_hash_foreach(h, word, count, {
+            hook(word, count, extra);
+        });
+    }
+}
+
+/* private function */
+static void *_count_chunk(void *arg) {
+    Worker *w = (Worker *)arg;
+    int part_num = w->wc->part_num;
+    const char *p = w->begin;
+    uint64_t tokens = 0;
+    while(p < w->end) {
+        while(p < w->end && (unsigned char)*p <= ' ')
+            p++;
+        const char *start = p;
+        p = _token_end(p, w->end);
+        if(p == start)
+            continue;
+        OaStrSlice word = oa_str_slice(start, (size_t)(p - start));
+        oa_hash_add_delta(wordcount, w->local[_part_idx(word, part_num)], word, 1);
+        tokens++;
+    }
+    w->tokens = tokens;
+    return NULL;
+}
+
+/* partition idx of every thread is folded into the table of thread 0 */
+static void *_merge_part(void *arg) {
+    Worker *w = (Worker *)arg;
+    Worker *workers = (Worker *)w->workers;
+    oa_hash_t(wordcount) *merged = workers[0].local[w->idx];
+    OaStrSlice word;
+    uint64_t count;
+    for(int i = 1;i < w->wc->part_num;i++) {
+        oa_hash_t(wordcount) *h = workers[i].local[w->idx];
+        oa_hash_foreach(h, word, count, {
+            oa_hash_add_delta(wordcount, merged, word, count);
+        });
+        oa_hash_free(wordcount, h);
+    }
+    w->wc->parts[w->idx] = merged;
+    return NULL;
+}
+
+/* the table indexes by the low hash bits, partitions take the high ones */
+static inline int _part_idx(OaStrSlice word, int part_num) {
+    if(part_num == 1)
+        return 0;
+    return (int)(((uint64_t)oa_hash_slice(word) * (uint64_t)part_num) >> 32U);
+}
+
+/*
+ * Eight bytes at a time, a byte below 0x21 sets its high bit in the mask.
+ * Borrows only run upwards, so the lowest flagged byte is exact.
+ */
+static inline const char *_token_end(const char *p, const char *end) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while(p + sizeof(uint64_t) <= end) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        uint64_t mask = (word - SPACE_BYTES) & ~word & HIGH_BITS;
+        if(mask)
+            return p + (__builtin_ctzll(mask) >> 3U);
+        p += sizeof(uint64_t);
+    }
+#endif
+    while(p < end && (unsigned char)*p > ' ')
+        p++;
+    return p;
+}
+
+/* p moved forward to the start of a line */
+static const char *_next_line(const char *p, const char *data, const char *end) {
+    if(p == data)
+        return p;
+    while(p < end && p[-1] != '\n')
+        p++;
+    return p;
+}
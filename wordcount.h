@@ -0,0 +1,36 @@
+#ifndef _WORDCOUNT_H
+#define _WORDCOUNT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "oa_hash.h"
+
+/*
+ * Parallel token count over a file. The input is mmapped and split at
+ * newline boundaries, every thread counts its share into thread local
+ * tables whose keys point into the mapping, one table per partition of
+ * the hash space. Partition j of all threads is then merged by thread j,
+ * so the merge needs no locking and the result stays partitioned.
+ * Tokens are runs of bytes above ' '.
+ */
+
+OA_COUNTER_INIT_STR_SLICE(wordcount, uint64_t, PRIu64)
+
+typedef struct {
+    const char *data;                   // the mapped input, every key points into it
+    size_t size;
+    int part_num;
+    oa_hash_t(wordcount) **parts;       // merged counts, split by hash
+    uint64_t tokens;
+    uint64_t words;                     // distinct tokens
+} WordCount;
+
+typedef void(*wordcount_hook)(OaStrSlice word, uint64_t count, void *extra);
+
+WordCount *new_wordcount(const char *path, int thread_num);
+void free_wordcount(WordCount *wc);
+uint64_t query_wordcount(WordCount *wc, OaStrSlice word);
+void traverse_wordcount(WordCount *wc, wordcount_hook hook, void *extra);
+
+#endif